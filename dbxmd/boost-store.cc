@@ -0,0 +1,177 @@
+#include "boost-store.hh"
+#include "keyspace.hh"
+#include "varint.hh"
+#include "db.hh"
+#include "unittest.hh"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace dbxmd {
+
+// Boost values are stored as fixed-point numbers
+static const float kBoostScale = 1024;
+
+
+float Boost::at(u32 now) const {
+  if (now <= time) {
+    return value;
+  }
+  return value * exp2f(-float(now - time) / float(kBoostHalfLife));
+}
+
+
+float BoostTable::value(DocNum docnum, u32 now) const {
+  auto I = std::lower_bound(docnums.begin(), docnums.end(), docnum);
+  if (I == docnums.end() || *I != docnum) {
+    return 0;
+  }
+  return boosts[I - docnums.begin()].at(now);
+}
+
+
+Status BoostStore::load(leveldb::DB* db) {
+  std::lock_guard<std::mutex> lock(_mu);
+  size_t nmalformed = 0;
+  db_foreach(
+    db,
+    kBoostKeyPrefix,
+    [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+      const char* p = value.data();
+      const char* end = p + value.size();
+      u64 time, scaled_value;
+      if (key.size() != kBoostKeyPrefix.size() + kDocNumSize ||
+          !varint_read(p, end, time) || !varint_read(p, end, scaled_value))
+      {
+        ++nmalformed;
+        return true;
+      }
+      Boost boost;
+      boost.time = u32(time);
+      boost.value = float(scaled_value) / kBoostScale;
+      _boosts.emplace(docnum_decode(key.data() + kBoostKeyPrefix.size()), boost);
+      return true; // continue enumeration
+    }
+  );
+  if (nmalformed != 0) {
+    std::clog << "[dbxmd] ignoring " << nmalformed << " malformed boost(s)" << std::endl;
+  }
+  _table = nullptr;
+  return Status::OK();
+}
+
+
+size_t BoostStore::add(DocNum docnum, float weight, u32 now) {
+  std::lock_guard<std::mutex> lock(_mu);
+  auto& boost = _boosts[docnum];
+  boost.value = boost.at(now) + weight;
+  boost.time = RX_MAX(boost.time, now);
+  _pending.insert(docnum);
+  _table = nullptr;
+  return _pending.size();
+}
+
+
+bool BoostStore::remove(DocNum docnum, leveldb::WriteBatch& batch) {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_boosts.count(docnum) == 0) {
+    return false;
+  }
+  batch.Delete(kBoostKeyPrefix + docnum_encode(docnum));
+  return true;
+}
+
+
+void BoostStore::removed(const std::vector<DocNum>& docnums) {
+  std::lock_guard<std::mutex> lock(_mu);
+  for (auto docnum : docnums) {
+    if (_boosts.erase(docnum) != 0) {
+      _pending.erase(docnum);
+      _table = nullptr;
+    }
+  }
+}
+
+
+Status BoostStore::flush(leveldb::DB* db, bool* wrote) {
+  leveldb::WriteBatch batch;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    if (wrote) {
+      *wrote = !_pending.empty();
+    }
+    if (_pending.empty()) {
+      return Status::OK();
+    }
+    string value;
+    for (auto docnum : _pending) {
+      auto I = _boosts.find(docnum);
+      if (I != _boosts.end()) {
+        value.clear();
+        varint_append(value, I->second.time);
+        varint_append(value, u64(I->second.value * kBoostScale + 0.5f));
+        batch.Put(kBoostKeyPrefix + docnum_encode(docnum), value);
+      }
+    }
+    _pending.clear();
+  }
+  auto s = db->Write(leveldb::WriteOptions(), &batch);
+  return s.ok() ? Status::OK() : Status{s.ToString()};
+}
+
+
+BoostTablePtr BoostStore::table() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_table == nullptr) {
+    auto* table = new BoostTable;
+    table->docnums.reserve(_boosts.size());
+    for (auto& b : _boosts) {
+      table->docnums.push_back(b.first);
+    }
+    std::sort(table->docnums.begin(), table->docnums.end());
+    table->boosts.reserve(_boosts.size());
+    for (auto docnum : table->docnums) {
+      auto& boost = _boosts.find(docnum)->second;
+      table->boosts.push_back(boost);
+      table->max_value = RX_MAX(table->max_value, boost.value);
+    }
+    _table = BoostTablePtr{table};
+  }
+  return _table;
+}
+
+
+UNIT_TEST(boost_store, {
+  BoostStore store;
+  u32 now = 1400000000;
+  store.add(7, 1, now);
+  store.add(3, 1, now - kBoostHalfLife);
+  if (store.add(7, 1, now) != 2) {
+    throw test_failure("expected two pending boosts");
+  }
+  auto table = store.table();
+  if (table->docnums.size() != 2 || table->docnums[0] != 3 || table->max_value != 2) {
+    throw test_failure("unexpected boost table");
+  }
+  if (table->value(7, now) != 2 || table->value(5, now) != 0 ||
+      std::fabs(table->value(7, now + kBoostHalfLife) - 1) > 0.001f ||
+      std::fabs(table->value(3, now) - 0.5f) > 0.001f)
+  {
+    throw test_failure("unexpected boost value");
+  }
+  if (store.table() != table) {
+    throw test_failure("table not shared");
+  }
+  // Removing a boost takes effect once the batch deleting it is written
+  leveldb::WriteBatch batch;
+  if (!store.remove(3, batch) || store.remove(5, batch) || store.table() != table) {
+    throw test_failure("boost removed before its batch was written");
+  }
+  store.removed(std::vector<DocNum>(1, 3));
+  if (store.table() == table || store.table()->value(3, now) != 0) {
+    throw test_failure("boost not removed");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,78 @@
+#pragma once
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <rx/status.hh>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "doc.hh"
+namespace dbxmd {
+
+using std::string;
+using rx::Status;
+
+// How much an entry has been used, e.g. opened from search results. A boost halves every
+// kBoostHalfLife seconds, so entries which were used recently count the most.
+struct Boost {
+  float value = 0; // as of `time`
+  u32   time = 0;  // seconds since 1970-01-01
+
+  // Returns the value at a later time
+  float at(u32 now) const;
+};
+
+static const u32 kBoostHalfLife = 30 * 24 * 60 * 60;
+
+
+// An immutable snapshot of all boosts, for scoring search results
+struct BoostTable {
+  std::vector<DocNum> docnums; // sorted
+  std::vector<Boost>  boosts;  // of docnums[i]
+  float               max_value = 0; // highest value of any boost, not decayed
+
+  // Returns the value of an entry's boost at time `now`, or 0 if it has none
+  float value(DocNum, u32 now) const;
+};
+
+using BoostTablePtr = std::shared_ptr<const BoostTable>;
+
+
+// Boosts are kept in memory and changes are written to the database in batches, so that
+// recording usage is cheap and searching doesn't read boosts from the database.
+//
+//   "u:<docnum>" => <time varint> <value * kBoostScale varint>
+//
+// Safe to use from multiple threads.
+struct BoostStore {
+  // Reads stored boosts. Boosts added before loading take precedence.
+  Status load(leveldb::DB*);
+
+  // Adds weight to an entry's boost. Returns the number of boosts changed since the last flush.
+  size_t add(DocNum, float weight, u32 now);
+
+  // Adds the deletion of an entry's boost to batch, returning false if the entry has no boost.
+  // Call when an entry is removed. The boost is kept until removed() is called once batch is
+  // written, as the batch might be dropped instead.
+  bool remove(DocNum, leveldb::WriteBatch&);
+
+  // Drops the boosts of entries whose deletion was added to a batch by remove(), once the batch
+  // is written
+  void removed(const std::vector<DocNum>&);
+
+  // Writes boosts changed since the last flush in one batch. Sets *wrote to whether there were
+  // any to write.
+  Status flush(leveldb::DB*, bool* wrote = nullptr);
+
+  // Returns a snapshot of all boosts, which is shared until boosts change
+  BoostTablePtr table() const;
+
+private:
+  mutable std::mutex                 _mu;
+  std::unordered_map<DocNum, Boost>  _boosts;
+  std::set<DocNum>                   _pending; // changed since the last flush
+  mutable BoostTablePtr              _table;   // nullptr when boosts changed
+};
+
+} // namespace
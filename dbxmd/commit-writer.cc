@@ -0,0 +1,80 @@
+#include "commit-writer.hh"
+#include <iostream>
+namespace dbxmd {
+
+// With Durability::PeriodicSync, a write is synced when the last synced one was at least this
+// many seconds ago
+static const double kSyncInterval = 5;
+
+// Writes slower than this many seconds are logged
+static const double kSlowWriteSeconds = 0.1;
+
+
+CommitWriter::CommitWriter(Durability durability)
+  : _durability{durability}
+  , _last_sync{Clock::now()}
+  {}
+
+
+void CommitWriter::set_durability(Durability durability) {
+  std::lock_guard<std::mutex> lock(_mu);
+  _durability = durability;
+}
+
+
+leveldb::Status CommitWriter::write(
+  leveldb::DB* db,
+  leveldb::WriteBatch* batch,
+  size_t bytes,
+  bool is_idle)
+{
+  auto start = Clock::now();
+  leveldb::WriteOptions write_options;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    switch (_durability) {
+      case Durability::Sync:
+        write_options.sync = true;
+        break;
+      case Durability::PeriodicSync:
+        write_options.sync = is_idle ||
+          std::chrono::duration<double>(start - _last_sync).count() >= kSyncInterval;
+        break;
+      case Durability::Async:
+        break;
+    }
+  }
+
+  auto s = db->Write(write_options, batch);
+
+  auto end = Clock::now();
+  auto seconds = std::chrono::duration<double>(end - start).count();
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    if (s.ok()) {
+      ++_stats.commits;
+      _stats.bytes += bytes;
+      if (write_options.sync) {
+        ++_stats.synced_commits;
+        _last_sync = end;
+      }
+    }
+    _stats.total_seconds += seconds;
+    _stats.max_seconds = RX_MAX(_stats.max_seconds, seconds);
+    _stats.last_seconds = seconds;
+  }
+  if (seconds >= kSlowWriteSeconds) {
+    std::clog << "[dbxmd] slow commit: " << bytes / 1024 << " kB"
+              << (write_options.sync ? " synced" : "") << " in " << int(seconds * 1000.0)
+              << " ms" << std::endl;
+  }
+  return s;
+}
+
+
+CommitStats CommitWriter::stats() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _stats;
+}
+
+} // namespace
@@ -0,0 +1,33 @@
+#pragma once
+#include "dbxmd.h"
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <chrono>
+#include <mutex>
+namespace dbxmd {
+
+// Writes batches of changes from Dropbox to the database, syncing them as the Durability asks
+// for, and keeps count of how long writes take.
+//
+// Safe to use from multiple threads.
+struct CommitWriter {
+  CommitWriter(Durability = Durability::Async);
+
+  void set_durability(Durability);
+
+  // Writes batch, whose size is about bytes. With PeriodicSync, the write is synced if the last
+  // synced one was a while ago, or if is_idle, i.e. no more changes are expected soon.
+  leveldb::Status write(leveldb::DB*, leveldb::WriteBatch*, size_t bytes, bool is_idle);
+
+  CommitStats stats() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  mutable std::mutex _mu;
+  Durability         _durability;
+  Clock::time_point  _last_sync;
+  CommitStats        _stats;
+};
+
+} // namespace
@@ -31,6 +31,22 @@ void db_foreach(
       if (!fun(it->key(), it->value())) { break; }
     }
   }
+  delete it;
+}
+
+
+void db_foreach_range(
+   leveldb::DB* db,
+   leveldb::ReadOptions& read_options,
+   const leveldb::Slice& begin_key,
+   const leveldb::Slice& end_key,
+   rx::func<bool(const leveldb::Slice& key, const leveldb::Slice& value)> fun)
+{
+  leveldb::Iterator* it = db->NewIterator(read_options);
+  for (it->Seek(begin_key); it->Valid() && it->key().compare(end_key) < 0; it->Next()) {
+    if (!fun(it->key(), it->value())) { break; }
+  }
+  delete it;
 }
 
 
@@ -39,6 +55,7 @@ void db_delete_all(leveldb::DB* db, leveldb::WriteBatch& batch) {
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     batch.Delete(it->key());
   }
+  delete it;
 }
 
 
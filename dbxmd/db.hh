@@ -13,6 +13,14 @@ void db_foreach(
   const leveldb::Slice& key_prefix,
   rx::func<bool(const leveldb::Slice& key, const leveldb::Slice& value)> fun);
 
+// Calls fun for the keys in [begin_key, end_key), in order, until it returns false
+void db_foreach_range(
+  leveldb::DB* db,
+  leveldb::ReadOptions& read_options,
+  const leveldb::Slice& begin_key,
+  const leveldb::Slice& end_key,
+  rx::func<bool(const leveldb::Slice& key, const leveldb::Slice& value)> fun);
+
 // Danger zone
 void db_delete_all(leveldb::DB*, leveldb::WriteBatch&);
 
@@ -0,0 +1,19 @@
+#pragma once
+#include <rx/rx.h>
+#include <rx/status.hh>
+#include <string>
+namespace dbxmd {
+
+using std::string;
+
+// Fetches a page of changes from Dropbox's /delta, like dbxapi::delta_get, but calls cb with the
+// response body as text rather than parsed into a Json DOM, so that it can be read with
+// DeltaReader. Errors have the same dbxapi::StatusCode* codes as dbxapi::delta_get's. cb is
+// called on an arbitrary thread.
+void dbx_delta_get_text(
+  const string& access_token,
+  const string& path_prefix,
+  const string& cursor,
+  rx::func<void(rx::Status, string body)> cb);
+
+} // namespace
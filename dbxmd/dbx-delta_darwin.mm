@@ -0,0 +1,86 @@
+#import "dbx-delta.hh"
+#import <Foundation/Foundation.h>
+#import <dbxapi/dbxapi.hh>
+
+namespace dbxmd {
+
+static NSString* const kDeltaURL = @"https://api.dropbox.com/1/delta";
+
+
+static NSString* form_value(const string& s) {
+  static NSCharacterSet* allowed = [NSCharacterSet
+    characterSetWithCharactersInString:@"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-._~"];
+  return [[NSString stringWithUTF8String:s.c_str()]
+    stringByAddingPercentEncodingWithAllowedCharacters:allowed];
+}
+
+
+static rx::Status status_for_response(NSHTTPURLResponse* res, NSError* error) {
+  if (error != nil) {
+    auto message = string{error.localizedDescription.UTF8String};
+    if ([error.domain isEqualToString:NSURLErrorDomain] &&
+        (error.code == NSURLErrorNotConnectedToInternet ||
+         error.code == NSURLErrorNetworkConnectionLost))
+    {
+      return rx::Status{dbxapi::StatusCodeNotConnected, message};
+    }
+    return rx::Status{dbxapi::StatusCodeConnectionError, message};
+  }
+  auto code = res.statusCode;
+  if (code == 200) {
+    return rx::Status::OK();
+  }
+  if (code == 401) {
+    return rx::Status{dbxapi::StatusCodeAPIRequestUnauthorized, "unauthorized"};
+  }
+  if (code == 429 || code == 503) {
+    // The message is the number of seconds to wait, which is what api_error expects
+    NSString* retryAfter = res.allHeaderFields[@"Retry-After"];
+    return rx::Status{dbxapi::StatusCodeAPIRequestRateLimit,
+                      string{retryAfter != nil ? retryAfter.UTF8String : "0"}};
+  }
+  auto message = "HTTP " + std::to_string(code);
+  if (code >= 400 && code < 500) {
+    return rx::Status{dbxapi::StatusCodeAPIRequestError, message};
+  }
+  if (code >= 500) {
+    return rx::Status{dbxapi::StatusCodeAPIServerError, message};
+  }
+  return rx::Status{dbxapi::StatusCodeResponseError, message};
+}
+
+
+void dbx_delta_get_text(
+  const string& access_token,
+  const string& path_prefix,
+  const string& cursor,
+  rx::func<void(rx::Status, string body)> cb)
+{
+  NSMutableURLRequest* req = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:kDeltaURL]];
+  req.HTTPMethod = @"POST";
+  [req setValue:[NSString stringWithFormat:@"Bearer %s", access_token.c_str()]
+        forHTTPHeaderField:@"Authorization"];
+  [req setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
+
+  NSMutableArray* params = [NSMutableArray array];
+  if (!cursor.empty()) {
+    [params addObject:[@"cursor=" stringByAppendingString:form_value(cursor)]];
+  }
+  if (!path_prefix.empty()) {
+    [params addObject:[@"path_prefix=" stringByAppendingString:form_value(path_prefix)]];
+  }
+  req.HTTPBody = [[params componentsJoinedByString:@"&"] dataUsingEncoding:NSUTF8StringEncoding];
+
+  auto task = [[NSURLSession sharedSession] dataTaskWithRequest:req
+    completionHandler:^(NSData* data, NSURLResponse* res, NSError* error) {
+      auto st = status_for_response((NSHTTPURLResponse*)res, error);
+      if (!st.ok()) {
+        cb(st, string{});
+      } else {
+        cb(st, string{(const char*)data.bytes, data.length});
+      }
+    }];
+  [task resume];
+}
+
+} // namespace
@@ -11,6 +11,8 @@ namespace dbxmd {
 using std::string;
 using rx::Status;
 struct Iterator;
+struct SearchSession;
+struct SearchTask;
 
 
 // Data change description
@@ -26,6 +28,36 @@ using DataChanges = std::vector<DataChange>;
 using DataChangeListener = rx::func<void(const DataChanges&)>;
 using ListenerID = intptr_t;
 
+// Counters of the cache of search results
+struct SearchCacheStats {
+  u64    hits = 0;
+  u64    misses = 0;
+  u64    evictions = 0;     // results dropped to make room for others
+  u64    invalidations = 0; // results dropped because the index changed
+  size_t entries = 0;
+  size_t bytes = 0;         // approximate memory used
+};
+
+// How changes from Dropbox are committed to the database. A synced commit survives a system crash
+// or power loss, while others survive the app crashing but may be lost with the system. Changes
+// which are lost are fetched again from Dropbox, so this trades the time to catch up after a
+// crash for ingest throughput.
+enum class Durability {
+  Sync,         // every commit is synced
+  PeriodicSync, // a commit is synced every few seconds, and when caught up with Dropbox
+  Async,        // commits aren't synced (the default)
+};
+
+// Counters of commits of changes from Dropbox
+struct CommitStats {
+  u64    commits = 0;
+  u64    synced_commits = 0;
+  u64    bytes = 0;              // approximate size of the changes committed
+  double total_seconds = 0;      // time spent committing
+  double max_seconds = 0;        // longest commit
+  double last_seconds = 0;       // most recent commit
+};
+
 using ReauthenticateCallback = rx::func<void(const string& access_token)>;
 
 // Called when the access_token is reported invalid.
@@ -67,13 +99,76 @@ struct Dropbox {
   // Set the access_token. Useful after reauthentication.
   void set_access_token(const string&);
 
+  // How changes from Dropbox are committed, and how long committing them takes
+  void setDurability(Durability);
+  CommitStats commitStats() const;
+
   // Search results. Each value is a JSON-encoded represenation of an entry.
   typedef std::vector<string> SearchResults;
 
-  // Query the index for things matching `text` or optional `type`, returning up to `limit` results
-  // starting from `offset` result. To return all matches, pass 0 for both offset and limit.
+  // Query the index for things matching `text`, returning up to `limit` results. An optional
+  // `type` restricts results to some types of entries: file extensions and "folder", separated by
+  // commas, e.g. "pdf,doc". The text can also include predicates on the fields of entries, which
+  // results must match, with or without any terms:
+  //
+  //   size:>500mb              also <, >=, <=, a range (e.g. size:1mb..2mb) or an exact size
+  //   modified:>=2015-01-01    the same operators, and today, yesterday, or a number of days,
+  //                            weeks, months or years ago, e.g. modified:>7d for the last week
+  //   mime:image               MIME types starting with "image"; any of several can match
+  //   is:folder
+  //
+  // A term which matches nothing, e.g. a misspelled one, matches the terms most similar to it
+  // instead. Results of recent searches are cached until the index changes.
   SearchResults search(const string& type, const string& text, u32 limit) const;
+
+  // A search result whose entry hasn't been read
+  struct SearchHit {
+    string path;
+    u32    score; // lower is better
+  };
+
+  struct SearchPage {
+    std::vector<SearchHit> hits;
+    string                 cursor; // for the next page, or empty if this is the last page
+  };
+
+  // Like search(), but returns the paths of up to `limit` results without reading their entries.
+  // Pass the cursor of a page to get the next page. Each page is searched anew, so results can
+  // shift between pages when the index changes.
+  SearchPage searchPage(
+    const string& type,
+    const string& text,
+    u32 limit,
+    const string& cursor = string{}) const;
+
+  // Read entries as JSON, e.g. the results of searchPage(). Only the given fields of each entry
+  // are included, e.g. {"path", "modified", "bytes"}, or all of them if none are given. A path
+  // without an entry results in an empty string.
+  SearchResults readEntries(
+    const std::vector<string>& paths,
+    const std::vector<string>& fields = std::vector<string>{}) const;
+
+  // Like search(), but runs on one of a few search threads and calls `callback` there with the
+  // results. When searches pile up, the most recently started one runs first. A cancelled search
+  // stops as soon as possible and its callback isn't called.
+  using SearchCallback = rx::func<void(SearchResults)>;
+  SearchTask searchAsync(const string& type, const string& text, u32 limit, SearchCallback) const;
   const string& searchDataKey() const;
+  SearchCacheStats searchCacheStats() const;
+
+  // Start a series of searches, e.g. for search-as-you-type
+  SearchSession newSearchSession() const;
+
+  // Things a user does with an entry which make it rank higher in search results
+  enum class Usage {
+    Opened,   // e.g. opened a file found via search()
+    Selected, // e.g. selected a search result without opening it
+  };
+
+  // Record that the entry at `path` was used. Usage is accumulated in memory and written in
+  // batches, so this is cheap to call for every event. Boosts from usage decay over time.
+  // Cached search results are ranked by new usage once it's written, up to 10 seconds later.
+  void recordUsage(const string& path, Usage);
 
   // List recently edited files (by the uid provided to the constructor)
   Iterator newRecentsIterator() const;
@@ -116,10 +211,39 @@ struct Iterator {
 };
 
 
+// A search started by Dropbox::searchAsync()
+struct SearchTask {
+  // an empty task
+  SearchTask();
+
+  // Stops the search. Its callback is not called, unless it is already being called.
+  void cancel() const;
+  bool isCancelled() const;
+
+  RX_REF_MIXIN_NOVTABLE(SearchTask)
+};
+
+
+// Searches which reuse the work of the previous search of the session when the text is extended,
+// e.g. as the user types. Falls back to a full search when the text is changed in any other way
+// or when the index has changed. Not thread-safe.
+struct SearchSession {
+  // an empty session
+  SearchSession();
+
+  // Like Dropbox::search(), but results are not cached
+  Dropbox::SearchResults search(const string& type, const string& text, u32 limit);
+
+  RX_REF_MIXIN_NOVTABLE(SearchSession)
+};
+
+
 // --------------------------------------------------------------------------------------
 
 inline Dropbox::Dropbox() : Dropbox(nullptr) {}
 inline Iterator::Iterator() : Iterator{nullptr} {}
+inline SearchSession::SearchSession() : SearchSession{nullptr} {}
+inline SearchTask::SearchTask() : SearchTask{nullptr} {}
 
 } // namespace
 
@@ -0,0 +1,255 @@
+#include "delta-pipeline.hh"
+#include "delta-reader.hh"
+#include "unittest.hh"
+#include <deque>
+#include <mutex>
+#include <vector>
+namespace dbxmd {
+
+
+struct DeltaPipeline::Shared {
+  Fetch  fetch;
+  Async  async;
+  Apply  apply;
+  Done   done;
+  size_t max_pages;
+
+  std::mutex         mu;
+  std::deque<string> pages;                   // fetched but not yet applied, oldest first
+  string             next_cursor;             // of the last page fetched
+  Status             api_status;
+  bool               is_fetching = false;
+  bool               is_applying = false;     // _apply is scheduled or running
+  bool               is_last_fetched = false; // there's nothing more to fetch
+  bool               is_stopped = false;      // a page failed to apply
+
+  // Whether the next page may be requested now. Requires mu.
+  bool can_fetch() const {
+    return !is_fetching && !is_last_fetched && !is_stopped && pages.size() < max_pages;
+  }
+};
+
+
+/*static*/ void DeltaPipeline::run(
+  const string& cursor,
+  size_t max_pages,
+  Fetch fetch,
+  Async async,
+  Apply apply,
+  Done done)
+{
+  auto shared = std::make_shared<Shared>();
+  shared->fetch = std::move(fetch);
+  shared->async = std::move(async);
+  shared->apply = std::move(apply);
+  shared->done = std::move(done);
+  shared->max_pages = RX_MAX(max_pages, size_t(1));
+  shared->is_fetching = true;
+  _fetch(shared, cursor);
+}
+
+
+void DeltaPipeline::_fetch(const std::shared_ptr<Shared>& shared, const string& cursor) {
+  shared->fetch(cursor, [shared](Status st, string body) {
+    _fetched(shared, st, std::move(body));
+  });
+}
+
+
+void DeltaPipeline::_fetched(const std::shared_ptr<Shared>& shared, Status st, string body) {
+  string cursor;
+  bool should_fetch = false;
+  bool should_apply = false;
+  {
+    std::lock_guard<std::mutex> lock(shared->mu);
+    shared->is_fetching = false;
+    if (shared->is_stopped) {
+      return;
+    }
+    if (!st.ok()) {
+      shared->api_status = st;
+      shared->is_last_fetched = true;
+    } else {
+      // A malformed page is still queued, as applying it reports what's wrong with it
+      bool has_more = false;
+      if (!DeltaReader::scan(body, shared->next_cursor, has_more) || !has_more) {
+        shared->is_last_fetched = true;
+      }
+      shared->pages.push_back(std::move(body));
+    }
+    if ((should_fetch = shared->can_fetch())) {
+      shared->is_fetching = true;
+      cursor = shared->next_cursor;
+    }
+    if ((should_apply = !shared->is_applying)) {
+      shared->is_applying = true;
+    }
+  }
+  if (should_fetch) {
+    _fetch(shared, cursor);
+  }
+  if (should_apply) {
+    shared->async([shared] { _apply(shared); });
+  }
+}
+
+
+void DeltaPipeline::_apply(const std::shared_ptr<Shared>& shared) {
+  const string* page = nullptr;
+  bool has_next = false;
+  {
+    std::lock_guard<std::mutex> lock(shared->mu);
+    if (!shared->pages.empty()) {
+      page = &shared->pages.front(); // stays put as pages are pushed to the back
+      has_next = shared->pages.size() > 1;
+    }
+  }
+  if (page == nullptr) {
+    // Only scheduled without pages when a fetch failed and there's nothing left to apply
+    shared->done(shared->api_status, nullptr);
+    return;
+  }
+
+  auto st = shared->apply(*page, has_next);
+
+  string cursor;
+  bool should_fetch = false;
+  bool should_continue = false;
+  {
+    std::lock_guard<std::mutex> lock(shared->mu);
+    shared->pages.pop_front();
+    if (!st.ok()) {
+      shared->is_stopped = true;
+      shared->pages.clear();
+    } else {
+      if ((should_fetch = shared->can_fetch())) {
+        shared->is_fetching = true;
+        cursor = shared->next_cursor;
+      }
+      should_continue = !shared->pages.empty() || shared->is_last_fetched;
+      shared->is_applying = should_continue;
+    }
+  }
+  if (!st.ok()) {
+    shared->done(shared->api_status, st);
+    return;
+  }
+  if (should_fetch) {
+    _fetch(shared, cursor);
+  }
+  if (should_continue) {
+    // Apply the next page after anything else waiting for the applying thread
+    shared->async([shared] { _apply(shared); });
+  }
+}
+
+
+UNIT_TEST(delta_pipeline, {
+  // A stand-in for the /delta endpoint and the applying thread, which run queued work only when
+  // the test says so. Serves pages "1" to "5", whose cursors are their numbers.
+  struct Sim {
+    std::deque<rx::func<void()>> responses;
+    std::deque<rx::func<void()>> applier;
+    std::vector<string>          log;
+    int                          fail_fetch = 0;
+    int                          fail_apply = 0;
+    bool                         is_done = false;
+    Status                       api_status;
+    Status                       status;
+  };
+  auto run = [](Sim& sim, size_t max_pages) {
+    DeltaPipeline::run(
+      "",
+      max_pages,
+      [&sim](const string& cursor, DeltaPipeline::FetchCallback cb) {
+        int n = cursor.empty() ? 1 : std::stoi(cursor) + 1;
+        sim.log.push_back("fetch " + std::to_string(n));
+        sim.responses.push_back([&sim, n, cb] {
+          if (n == sim.fail_fetch) {
+            cb(Status{"fetch failed"}, string{});
+          } else {
+            cb(nullptr, "{\"entries\": [], \"cursor\": \"" + std::to_string(n) +
+                        "\", \"has_more\": " + (n < 5 ? "true" : "false") + "}");
+          }
+        });
+      },
+      [&sim](rx::func<void()> fn) { sim.applier.push_back(fn); },
+      [&sim](const string& body, bool has_next) {
+        DeltaReader delta{body};
+        while (delta.next()) {}
+        sim.log.push_back("apply " + delta.cursor() + (has_next ? "+" : ""));
+        return std::stoi(delta.cursor()) == sim.fail_apply ? Status{"apply failed"} : Status::OK();
+      },
+      [&sim](Status api_status, Status status) {
+        sim.is_done = true;
+        sim.api_status = api_status;
+        sim.status = status;
+      });
+  };
+  auto step = [](std::deque<rx::func<void()>>& q) {
+    if (q.empty()) {
+      return false;
+    }
+    auto fn = q.front();
+    q.pop_front();
+    fn();
+    return true;
+  };
+  auto drain = [&](Sim& sim) {
+    while (step(sim.responses) || step(sim.applier)) {}
+  };
+
+  // The next page is requested as soon as a page arrives, before it's applied
+  Sim sim;
+  run(sim, 3);
+  step(sim.responses);
+  if (sim.log != std::vector<string>{"fetch 1", "fetch 2"} || sim.applier.size() != 1) {
+    throw test_failure("DeltaPipeline didn't fetch ahead");
+  }
+  // ... but no more than max_pages ahead of the page being applied
+  step(sim.responses);
+  step(sim.responses);
+  if (sim.log.size() != 3 || !sim.responses.empty()) {
+    throw test_failure("DeltaPipeline fetched too far ahead");
+  }
+  drain(sim);
+  if (!sim.is_done || !sim.status.ok() || !sim.api_status.ok() ||
+      sim.log != std::vector<string>{"fetch 1", "fetch 2", "fetch 3", "apply 1+", "fetch 4",
+                                     "apply 2+", "fetch 5", "apply 3+", "apply 4+", "apply 5"})
+  {
+    throw test_failure("DeltaPipeline didn't apply all pages in order");
+  }
+
+  // With max_pages 1, pages are fetched and applied in turn
+  Sim seq;
+  run(seq, 1);
+  drain(seq);
+  if (seq.log != std::vector<string>{"fetch 1", "apply 1", "fetch 2", "apply 2", "fetch 3",
+                                     "apply 3", "fetch 4", "apply 4", "fetch 5", "apply 5"})
+  {
+    throw test_failure("DeltaPipeline with max_pages 1 fetched ahead");
+  }
+
+  // Pages which arrived before a fetch error are applied
+  Sim fetch_error;
+  fetch_error.fail_fetch = 3;
+  run(fetch_error, 3);
+  drain(fetch_error);
+  if (!fetch_error.is_done || fetch_error.api_status.ok() || !fetch_error.status.ok() ||
+      fetch_error.log.back() != "apply 2")
+  {
+    throw test_failure("DeltaPipeline mishandled a fetch error");
+  }
+
+  // Pages after one which fails to apply are dropped
+  Sim apply_error;
+  apply_error.fail_apply = 2;
+  run(apply_error, 3);
+  drain(apply_error);
+  if (!apply_error.is_done || apply_error.status.ok() || apply_error.log.back() != "apply 2+") {
+    throw test_failure("DeltaPipeline mishandled an apply error");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,47 @@
+#pragma once
+#include <rx/rx.h>
+#include <rx/status.hh>
+#include <memory>
+#include <string>
+namespace dbxmd {
+
+using rx::Status;
+using std::string;
+
+// Fetches pages of /delta ahead of applying them, so that the network isn't idle while a page is
+// applied, and the applying thread isn't idle while the next page downloads. As soon as a page
+// arrives its cursor and has_more are scanned and the next page is requested, while pages are
+// applied one at a time and in order on the applying thread. At most max_pages pages are fetched
+// but not yet applied, counting the one being fetched; with a max_pages of 1 a page is only
+// requested once the previous one has been applied.
+//
+// Stops after applying a page without has_more, or at the first error. Pages which arrived before
+// a fetch error are still applied, while those after a page which fails to apply are dropped.
+struct DeltaPipeline {
+  using FetchCallback = rx::func<void(Status, string body)>;
+
+  // Requests the page after cursor and calls back with its body, on any thread
+  using Fetch = rx::func<void(const string& cursor, FetchCallback)>;
+
+  // Runs a function on the applying thread, which should be serial
+  using Async = rx::func<void(rx::func<void()>)>;
+
+  // Applies a page. When has_next is true the next page has arrived already and is applied next,
+  // so the page's changes may be left uncommitted and committed along with the next page's.
+  // Otherwise they should be committed, with the page's cursor, before returning.
+  using Apply = rx::func<Status(const string& body, bool has_next)>;
+
+  // Called on the applying thread when the pipeline stops, with the error of the fetch which
+  // stopped it, if any, and that of the page which failed to apply, if any.
+  using Done = rx::func<void(Status api_status, Status status)>;
+
+  static void run(const string& cursor, size_t max_pages, Fetch, Async, Apply, Done);
+
+private:
+  struct Shared;
+  static void _fetch(const std::shared_ptr<Shared>&, const string& cursor);
+  static void _fetched(const std::shared_ptr<Shared>&, Status, string body);
+  static void _apply(const std::shared_ptr<Shared>&);
+};
+
+} // namespace
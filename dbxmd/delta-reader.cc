@@ -0,0 +1,294 @@
+#include "delta-reader.hh"
+#include "record.hh"
+#include "unittest.hh"
+#if DEBUG
+#include <json11/json11.hh>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#endif
+#endif
+
+namespace dbxmd {
+
+
+DeltaReader::DeltaReader(const leveldb::Slice& body) : _reader{body} {
+  if (_reader.next() != JsonReader::BeginObject) {
+    _fail("not an object");
+  }
+}
+
+
+bool DeltaReader::_fail(const char* error) {
+  // Report the JSON syntax error, if that's what made us fail
+  _error = _reader.error() != nullptr ? _reader.error() : error;
+  _is_done = true;
+  return false;
+}
+
+
+Status DeltaReader::status() const {
+  if (_error != nullptr) {
+    return Status{string{"Unexpected data from dbx /delta: "} + _error};
+  }
+  if (_is_done && !_has_entries) {
+    return Status{"Unexpected data from dbx /delta: entries is not an array"};
+  }
+  return Status::OK();
+}
+
+
+bool DeltaReader::_readField() {
+  auto name = _reader.string_value();
+  bool is_cursor = name == "cursor";
+  bool is_has_more = name == "has_more";
+  bool is_reset = name == "reset";
+  auto token = _reader.next();
+  if (is_cursor && token == JsonReader::String) {
+    _cursor.assign(_reader.string_value().data(), _reader.string_value().size());
+  } else if (is_has_more && (token == JsonReader::True || token == JsonReader::False)) {
+    _has_more = token == JsonReader::True;
+  } else if (is_reset && (token == JsonReader::True || token == JsonReader::False)) {
+    _reset = token == JsonReader::True;
+  } else if (!_reader.skip(token)) {
+    return _fail("malformed JSON");
+  }
+  return true;
+}
+
+
+bool DeltaReader::next() {
+  if (_is_done) {
+    return false;
+  }
+
+  // Read fields up to the entries, or to the end of the page after them
+  while (!_in_entries) {
+    auto token = _reader.next();
+    if (token == JsonReader::EndObject) {
+      if (_reader.next() != JsonReader::End) {
+        return _fail("malformed JSON");
+      }
+      _is_done = true;
+      return false;
+    }
+    if (token != JsonReader::Key) {
+      return _fail("malformed JSON");
+    }
+    if (_reader.string_value() == "entries") {
+      if (_has_entries || _reader.next() != JsonReader::BeginArray) {
+        return _fail("entries is not an array");
+      }
+      _in_entries = _has_entries = true;
+    } else if (!_readField()) {
+      return false;
+    }
+  }
+
+  // [<path>, <metadata or null>]
+  auto token = _reader.next();
+  if (token == JsonReader::EndArray) {
+    _in_entries = false;
+    return next();
+  }
+  if (token != JsonReader::BeginArray || _reader.next() != JsonReader::String) {
+    return _fail("entry is not a [path, metadata] array");
+  }
+  _ID.assign(_reader.string_value().data(), _reader.string_value().size());
+  _record.clear();
+  token = _reader.next();
+  if (token == JsonReader::Null) {
+    _is_removed = true;
+  } else if (token == JsonReader::BeginObject) {
+    _is_removed = false;
+    if (!Record::encode(_reader, _record)) {
+      return _fail("malformed entry metadata");
+    }
+  } else {
+    return _fail("entry metadata is not an object");
+  }
+  if (_reader.next() != JsonReader::EndArray) {
+    return _fail("entry is not a [path, metadata] array");
+  }
+  return true;
+}
+
+
+/*static*/ bool DeltaReader::scan(const leveldb::Slice& body, string& cursor, bool& has_more) {
+  JsonReader r{body};
+  if (r.next() != JsonReader::BeginObject) {
+    return false;
+  }
+  bool has_cursor = false;
+  has_more = false;
+  for (auto token = r.next(); token != JsonReader::EndObject; token = r.next()) {
+    if (token != JsonReader::Key) {
+      return false;
+    }
+    auto name = r.string_value();
+    bool is_cursor = name == "cursor";
+    bool is_has_more = name == "has_more";
+    token = r.next();
+    if (is_cursor && token == JsonReader::String) {
+      cursor.assign(r.string_value().data(), r.string_value().size());
+      has_cursor = true;
+    } else if (is_has_more && (token == JsonReader::True || token == JsonReader::False)) {
+      has_more = token == JsonReader::True;
+    } else if (!r.skip(token)) {
+      return false;
+    }
+  }
+  return has_cursor && r.next() == JsonReader::End;
+}
+
+
+UNIT_TEST(delta_reader, {
+  auto page = R"({
+    "has_more": true,
+    "entries": [
+      ["/photos/a.jpg", {"bytes": 86, "is_dir": false, "path": "/Photos/a.jpg", "rev": "8cdc"}],
+      ["/old", null],
+      ["/photos", {"bytes": 0, "is_dir": true, "path": "/Photos", "x": {"y": [1, 2]}}]
+    ],
+    "reset": false,
+    "cursor": "AAE-x"
+  })";
+  DeltaReader delta{leveldb::Slice{page}};
+  std::vector<string> IDs;
+  while (delta.next()) {
+    IDs.push_back(delta.ID());
+    if (delta.is_removed() != (delta.ID() == "/old")) {
+      throw test_failure("DeltaReader::is_removed is wrong");
+    }
+    if (delta.ID() == "/photos" &&
+        Record{delta.record()}["x"]["y"][size_t(1)].number_value() != 2)
+    {
+      throw test_failure("DeltaReader::record is wrong");
+    }
+  }
+  if (!delta.status().ok() || IDs.size() != 3 || IDs[2] != "/photos" ||
+      delta.cursor() != "AAE-x" || !delta.has_more() || delta.reset())
+  {
+    throw test_failure("DeltaReader read the page wrong");
+  }
+  string cursor;
+  bool has_more;
+  if (!DeltaReader::scan(page, cursor, has_more) || cursor != "AAE-x" || !has_more ||
+      DeltaReader::scan(R"({"entries": [], "cursor": "x")", cursor, has_more))
+  {
+    throw test_failure("DeltaReader::scan read the page wrong");
+  }
+  // Escaped keys and strings are unescaped into the same buffer
+  if (!DeltaReader::scan(R"({"curs\u006fr": "\u0041B"})", cursor, has_more) || cursor != "AB") {
+    throw test_failure("DeltaReader::scan read an escaped key wrong");
+  }
+
+  auto fails = [](const char* page) {
+    DeltaReader delta{leveldb::Slice{page}};
+    while (delta.next()) {}
+    return !delta.status().ok();
+  };
+  if (!fails(R"({"cursor": "x"})") ||
+      !fails(R"({"entries": {}})") ||
+      !fails(R"({"entries": [["/a", 1]]})") ||
+      !fails(R"({"entries": [["/a", {"b": }]]})") ||
+      !fails(R"({"entries": [], "cursor": )") ||
+      fails(R"({"entries": [], "cursor": "x", "more": [{}]})"))
+  {
+    throw test_failure("DeltaReader accepted a malformed page, or rejected a valid one");
+  }
+})
+
+
+#if DEBUG
+
+// Bytes currently allocated, or 0 where we can't tell
+static size_t heap_in_use() {
+  #ifdef __APPLE__
+  malloc_statistics_t stats;
+  malloc_zone_statistics(nullptr, &stats);
+  return stats.size_in_use;
+  #else
+  return 0;
+  #endif
+}
+
+
+static size_t heap_growth(size_t base) {
+  auto size = heap_in_use();
+  return size > base ? size - base : 0;
+}
+
+
+// Compares applying recorded /delta pages through a json11 DOM, as we used to, with DeltaReader.
+// Runs when DBXMD_DELTA_PAGES names a directory of page bodies, e.g. saved with
+//   curl -X POST https://api.dropbox.com/1/delta -H "Authorization: Bearer $TOKEN" > 1.json
+UNIT_TEST(delta_reader_benchmark, {
+  const char* dir = getenv("DBXMD_DELTA_PAGES");
+  DIR* d = dir != nullptr ? opendir(dir) : nullptr;
+  if (d == nullptr) {
+    return;
+  }
+  std::vector<string> pages;
+  while (auto* ent = readdir(d)) {
+    string name{ent->d_name};
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) {
+      std::ifstream f{string{dir} + "/" + name};
+      std::stringstream ss;
+      ss << f.rdbuf();
+      pages.push_back(ss.str());
+    }
+  }
+  closedir(d);
+
+  using clock = std::chrono::steady_clock;
+  size_t nentries = 0;
+  size_t dom_bytes = 0;
+  size_t dom_peak = 0;
+  size_t reader_bytes = 0;
+  size_t reader_peak = 0;
+  auto t0 = clock::now();
+  for (auto& page : pages) {
+    auto base = heap_in_use();
+    string err;
+    auto delta = json11::Json::parse(page, err);
+    for (auto& entry : delta["entries"].array_items()) {
+      json11::Json value = entry[1]; // as dbx_delta_to_doc_entries did
+      if (!value.is_null()) {
+        dom_bytes += Record::encode(value).size();
+      }
+      dom_peak = RX_MAX(dom_peak, heap_growth(base));
+    }
+  }
+  auto t1 = clock::now();
+  for (auto& page : pages) {
+    auto base = heap_in_use();
+    DeltaReader delta{page};
+    while (delta.next()) {
+      reader_bytes += delta.record().size();
+      reader_peak = RX_MAX(reader_peak, heap_growth(base));
+      ++nentries;
+    }
+    if (!delta.status().ok()) {
+      throw test_failure(delta.status().message());
+    }
+  }
+  auto t2 = clock::now();
+  if (reader_bytes != dom_bytes) {
+    throw test_failure("DeltaReader records differ in size from those encoded from a DOM");
+  }
+  auto ms = [](clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0;
+  };
+  std::clog << "[delta-reader] read " << pages.size() << " pages of " << nentries << " entries: "
+            << ms(t2 - t1) << " ms, peak " << reader_peak / 1024 << " kB (json11 DOM: "
+            << ms(t1 - t0) << " ms, peak " << dom_peak / 1024 << " kB)" << std::endl;
+})
+
+#endif
+
+
+} // namespace
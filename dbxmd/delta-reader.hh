@@ -0,0 +1,67 @@
+#pragma once
+#include <rx/status.hh>
+#include "json-reader.hh"
+namespace dbxmd {
+
+using rx::Status;
+
+// Reads a page of changes returned by Dropbox's /delta one entry at a time, encoding each entry's
+// metadata as a Record as it's read, so that only one entry is held in memory rather than a DOM
+// of the whole page. A page looks like this:
+//
+//   { "entries": [ [<path>, <metadata or null>] ... ],
+//     "cursor": "AAHhN...",
+//     "has_more": true,
+//     "reset": false }
+//
+// Use like this:
+//
+//   DeltaReader delta{body};
+//   while (delta.next()) {
+//     delta.is_removed() ? remove(delta.ID()) : put(delta.ID(), delta.record());
+//   }
+//   if (!delta.status().ok()) ...
+//   use(delta.cursor(), delta.has_more());
+//
+struct DeltaReader {
+  explicit DeltaReader(const leveldb::Slice& body);
+
+  // Reads the next entry. Returns false after the last entry, or if the page is malformed.
+  bool next();
+
+  // The current entry: its path, and its metadata encoded as a Record unless it was removed
+  const string& ID() const { return _ID; }
+  bool is_removed() const { return _is_removed; }
+  const string& record() const { return _record; }
+
+  // The page's fields other than entries. Only complete once next() has returned false, as they
+  // can come after the entries.
+  const string& cursor() const { return _cursor; }
+  bool has_more() const { return _has_more; }
+  bool reset() const { return _reset; }
+
+  // Status of reading the page. Not ok if the page is malformed, or has no entries array.
+  Status status() const;
+
+  // Reads just the cursor and has_more of a page, skipping its entries without encoding them.
+  // Returns false if the page is malformed.
+  static bool scan(const leveldb::Slice& body, string& cursor, bool& has_more);
+
+private:
+  bool _fail(const char* error);
+  bool _readField(); // reads a field of the page other than entries
+
+  JsonReader _reader;
+  string     _ID;
+  string     _record;
+  string     _cursor;
+  bool       _is_removed = false;
+  bool       _has_more = false;
+  bool       _reset = false;
+  bool       _in_entries = false;
+  bool       _has_entries = false;
+  bool       _is_done = false;
+  const char* _error = nullptr;
+};
+
+} // namespace
@@ -1,4 +1,5 @@
 #pragma once
+#include <rx/rx.h>
 #include <json11/json11.hh>
 #include <vector>
 #include <string>
@@ -6,6 +7,30 @@ namespace dbxmd {
 
 using DocID = std::string;
 
+// Numeric document number. Indexes refer to file entries by number rather than by path (ID).
+// 0 is never a valid document number.
+using DocNum = u32;
+
+// Document numbers are encoded as big-endian so that encoded numbers sort in numeric order
+static const size_t kDocNumSize = 4;
+
+inline void docnum_append(std::string& s, DocNum n) {
+  s.push_back(char(n >> 24));
+  s.push_back(char(n >> 16));
+  s.push_back(char(n >> 8));
+  s.push_back(char(n));
+}
+
+inline std::string docnum_encode(DocNum n) {
+  std::string s;
+  docnum_append(s, n);
+  return s;
+}
+
+inline DocNum docnum_decode(const char* p) {
+  return (DocNum(u8(p[0])) << 24) | (DocNum(u8(p[1])) << 16) | (DocNum(u8(p[2])) << 8) | u8(p[3]);
+}
+
 struct DocEntry {
   DocID        ID;
   json11::Json value;
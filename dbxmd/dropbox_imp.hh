@@ -3,6 +3,14 @@
 #include "timer.hh"
 #include "netreach.hh"
 #include "doc.hh"
+#include "path-dict.hh"
+#include "boost-store.hh"
+#include "search-cache.hh"
+#include "search-pool.hh"
+#include "term-dict.hh"
+#include "search-shard.hh"
+#include "delta-pipeline.hh"
+#include "commit-writer.hh"
 #include <rx/status.hh>
 #include <rx/state.hh>
 #include <json11/json11.hh>
@@ -26,23 +34,64 @@ struct Dropbox::Imp : rx::ref_counted_novtable {
 
   leveldb::DB*        db = nullptr;
   leveldb::Options    db_options;
+  PathDict            path_dict;
+  BoostStore          boosts;
+  SearchCache         search_cache;
+  TermDictStore       search_terms; // of the search index, for matching misspelled terms
+  SearchShardStore    search_shard; // of the search index's posting lists, for faster searches
+  std::string         search_shard_path;
 
   Thread              thread;
+  SearchPool          search_pool;
+  Thread              search_terms_thread; // rebuilds search_terms
+  Thread              search_shard_thread; // rewrites search_shard
   NetReach            dbx_api_reachability;
   bool                delta_has_more = true;
   bool                dbx_api_is_reachable = false;
   rx::func<void()>    once_dbx_api_became_reachable;
   Status              last_api_status;
   double              api_back_off_time = 0; // seconds
+  size_t              delta_pages_in_flight = 3; // fetched ahead of applying; 1 for no pipelining
+  CommitWriter        writer; // commits changes from Dropbox
+
+  // Changes from /delta pages which have been applied but not yet committed. The indexes are
+  // between update_begin() and update_end() while is_delta_batch_open.
+  leveldb::WriteBatch delta_batch;
+  size_t              delta_batch_bytes = 0; // approximate, not counting index changes
+  bool                delta_batch_has_more = true;
+  bool                is_delta_batch_open = false;
+  Dropbox             delta_batch_dropbox; // passed to the indexes while the batch is open
+  std::vector<DocNum> delta_batch_removed_boosts; // dropped from boosts once the batch commits
 
   rx::State<std::string> state;
 
   void delta_get(rx::func<void(Status)>);
   void delta_wait(rx::func<void(Status)>);
   void reset_delta_cursor();
-  Status apply_dbx_delta(const Json& delta, leveldb::DB*);
 
-  void apply_doc_entries(const DocEntries&, leveldb::DB*, leveldb::WriteBatch&);
+  // Applies a page of /delta, read from the response body as it's applied, to delta_batch. The
+  // batch is committed with the page's cursor unless has_next (see DeltaPipeline::Apply) and
+  // it's small enough to take another page. A page too large for one batch is committed in
+  // several, the last of which has the cursor.
+  Status apply_dbx_delta(const leveldb::Slice& body, leveldb::DB*, bool has_next);
+  void   open_delta_batch(leveldb::DB*);
+  Status commit_delta_batch(leveldb::DB*, bool is_idle);
+  void   discard_delta_batch();
+
+  Dropbox::SearchResults search(
+    const string& type,
+    const string& text,
+    u32 limit,
+    const std::atomic<bool>* is_cancelled);
+
+  void rebuild_search_terms_if_needed();
+  void rewrite_search_shard_if_needed();
+
+  // Add a changed or removed file entry to batch, without updating the indexes, and return its
+  // document number (0 for a removed entry which wasn't known.) record is the entry's metadata
+  // encoded as a Record.
+  DocNum put_doc_entry(const string& ID, const string& record, leveldb::DB*, leveldb::WriteBatch&);
+  DocNum remove_doc_entry(const string& ID, leveldb::DB*, leveldb::WriteBatch&);
 
   void check_dbversion();
   void start();
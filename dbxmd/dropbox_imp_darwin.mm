@@ -6,13 +6,20 @@
 #import <leveldb/filter_policy.h>
 #import <iomanip>
 #import <forward_list>
+#import <unordered_set>
 #import <dbxapi/dbxapi.hh>
 
 #import "db.hh"
 #import "keyspace.hh"
 #import "version.hh"
+#import "migrate.hh"
+#import "record.hh"
+#import "varint.hh"
 #import "search-index.hh"
 #import "recents-index.hh"
+#import "search_session_imp.hh"
+#import "delta-reader.hh"
+#import "dbx-delta.hh"
 
 
 namespace dbxmd {
@@ -43,81 +50,236 @@ using std::endl;
 // }
 
 
-void Dropbox::Imp::apply_doc_entries(
-    const DocEntries& entries,
-    leveldb::DB* db,
-    leveldb::WriteBatch& batch)
+DocNum Dropbox::Imp::put_doc_entry(
+  const string& ID,
+  const string& value,
+  leveldb::DB* db,
+  leveldb::WriteBatch& batch)
 {
-  Dropbox dropbox{this, /*add_ref=*/true};
+  // added or modified
+  auto docnum = path_dict.assign(db, ID, batch);
+  batch.Put(kFileEntryKeyPrefix + ID, value);
+  return docnum;
+}
 
-  for (auto* index : Index::all()) {
-    index->update_begin(dropbox, db, &batch);
-  }
 
-  for (auto& entry : entries) {
-    if (entry.value.is_null()) {
-      // removed
-      batch.Delete(kFileEntryKeyPrefix + entry.ID);
-      for (auto* index : Index::all()) {
-        index->update_remove(entry.ID);
-      }
-    } else {
-      // added or modified
-      batch.Put(kFileEntryKeyPrefix + entry.ID, entry.value.dump());
-      for (auto* index : Index::all()) {
-        index->update_put(entry.ID, entry.value);
-      }
+DocNum Dropbox::Imp::remove_doc_entry(
+  const string& ID,
+  leveldb::DB* db,
+  leveldb::WriteBatch& batch)
+{
+  batch.Delete(kFileEntryKeyPrefix + ID);
+  auto docnum = path_dict.lookup(db, ID);
+  if (docnum != 0) {
+    // The boost is kept in memory until the batch commits, or the entry loses it when the batch
+    // is discarded and then applied again
+    if (boosts.remove(docnum, batch)) {
+      delta_batch_removed_boosts.push_back(docnum);
     }
+    path_dict.remove(ID, docnum, batch);
   }
+  return docnum;
+}
+
+
+// Entries of a /delta page are mapped in chunks of roughly this many bytes
+static const size_t kDeltaMapChunkSize = 512 * 1024;
 
+// Changes from /delta are committed in batches of roughly this many bytes. Small pages are
+// committed together, and large ones split, as huge batches stall leveldb while it compacts.
+static const size_t kDeltaCommitSize = 4 * 1024 * 1024;
+
+// An entry of a /delta page being applied
+struct DeltaEntry {
+  string                   ID;
+  string                   record;
+  DocNum                   docnum = 0;
+  bool                     is_removed = false;
+  bool                     is_repeat = false; // an earlier entry of the chunk has the same ID
+  std::vector<ReverseKeys> mapped; // by each of Index::all()
+};
+
+
+void Dropbox::Imp::open_delta_batch(leveldb::DB* db) {
+  assert(!is_delta_batch_open);
+  delta_batch_dropbox = Dropbox{this, /*add_ref=*/true};
   for (auto* index : Index::all()) {
-    index->update_end();
+    index->update_begin(delta_batch_dropbox, db, &delta_batch);
+  }
+  is_delta_batch_open = true;
+}
+
+
+Status Dropbox::Imp::commit_delta_batch(leveldb::DB* db, bool is_idle) {
+  assert(is_delta_batch_open);
+  auto bytes = delta_batch_bytes;
+  for (auto* index : Index::all()) {
+    bytes += index->update_bytes();
+    index->update_end(); // adds remaining posting list changes to the batch
   }
+  auto s = writer.write(db, &delta_batch, bytes, is_idle);
+  path_dict.reset_pending();
+  if (s.ok()) {
+    boosts.removed(delta_batch_removed_boosts);
+  }
+  if (s.ok() && !data_change_listeners.empty()) {
+    notify_data_changes(delta_batch);
+  }
+  delta_batch.Clear();
+  delta_batch_bytes = 0;
+  delta_batch_removed_boosts.clear();
+  is_delta_batch_open = false;
+  delta_batch_dropbox = Dropbox{};
+  return s.ok() ? Status::OK() : Status{s.ToString()};
 }
 
 
-static DocEntries dbx_delta_to_doc_entries(const Json& delta) {
-  DocEntries entries;
-  auto delta_entries = delta["entries"].array_items();
-  entries.reserve(delta_entries.size());
-  for (auto& entry : delta_entries) {
-    auto ID = entry[0].string_value();
-    auto value = entry[1];
-    entries.emplace_back(ID, value);
+void Dropbox::Imp::discard_delta_batch() {
+  if (!is_delta_batch_open) {
+    return;
   }
-  return std::move(entries);
+  for (auto* index : Index::all()) {
+    index->update_end();
+  }
+  path_dict.reset_pending();
+  delta_batch.Clear();
+  delta_batch_bytes = 0;
+  delta_batch_removed_boosts.clear();
+  is_delta_batch_open = false;
+  delta_batch_dropbox = Dropbox{};
 }
 
 
-Status Dropbox::Imp::apply_dbx_delta(const Json& delta, leveldb::DB* db) {
+Status Dropbox::Imp::apply_dbx_delta(const leveldb::Slice& body, leveldb::DB* db, bool has_next) {
   // TODO: Handle "reset" case (see https://www.dropbox.com/developers/core/docs#delta)
 
-  // Check `entries`
-  Json entries = delta["entries"];
-  if (!delta["entries"].is_array()) {
-    return Status{"Unexpected data from dbx /delta: entries is not an array"};
+  auto& indexes = Index::all();
+  auto nindexes = size_t(std::distance(indexes.begin(), indexes.end()));
+  auto batch_bytes = [&] {
+    size_t bytes = delta_batch_bytes;
+    for (auto* index : indexes) {
+      bytes += index->update_bytes();
+    }
+    return bytes;
+  };
+
+  // Introduce changes into db as they are read, a chunk of entries at a time. Entries are given
+  // document numbers in order, then mapped to all indexes in parallel, and then added to the
+  // indexes in order, so the outcome is the same as if each was applied in turn.
+  if (!is_delta_batch_open) {
+    open_delta_batch(db);
   }
-  
-  leveldb::WriteBatch batch; // database modification transaction
-  
-  // Introduce changes into db
-  auto doc_entries = dbx_delta_to_doc_entries(delta);
-  apply_doc_entries(doc_entries, db, batch);
-  
-  // Finalize
-  batch.Put("dbx:delta-cursor", delta["cursor"].string_value());
-  auto s = db->Write(leveldb::WriteOptions(), &batch);
+  auto& batch = delta_batch;
+  DeltaReader delta{body};
+  std::vector<DeltaEntry> chunk;
+  std::unordered_set<string> chunk_IDs;
+  for (bool is_last = false; !is_last;) {
+    size_t n = 0;
+    size_t chunk_bytes = 0;
+    chunk_IDs.clear();
+    while (chunk_bytes < kDeltaMapChunkSize) {
+      if (!delta.next()) {
+        is_last = true;
+        break;
+      }
+      if (n == chunk.size()) {
+        chunk.emplace_back();
+        chunk.back().mapped.resize(nindexes);
+      }
+      auto& entry = chunk[n++];
+      entry.ID = delta.ID();
+      entry.is_removed = delta.is_removed();
+      entry.is_repeat = !chunk_IDs.insert(entry.ID).second;
+      if (entry.is_removed) {
+        entry.record.clear();
+        entry.docnum = remove_doc_entry(entry.ID, db, batch);
+      } else {
+        entry.record = delta.record();
+        entry.docnum = put_doc_entry(entry.ID, entry.record, db, batch);
+      }
+      chunk_bytes += entry.ID.size() + entry.record.size();
+    }
+    if (n == 0) {
+      break;
+    }
+    delta_batch_bytes += chunk_bytes;
+
+    // Mapping, e.g. splitting paths into search terms, is most of the work. An entry which changes
+    // again later in the chunk is mapped after its earlier version is added, as map() can read
+    // what that version wrote, e.g. with getMeta().
+    Thread::apply(n, [&](size_t i) {
+      auto& entry = chunk[i];
+      if (!entry.is_removed && !entry.is_repeat) {
+        Record record{entry.record};
+        size_t j = 0;
+        for (auto* index : indexes) {
+          index->update_map(entry.ID, entry.docnum, record, entry.mapped[j++]);
+        }
+      }
+    });
 
-  // Notify any change listeners
-  if (s.ok() && !data_change_listeners.empty()) {
-    notify_data_changes(batch);
+    for (size_t i = 0; i != n; ++i) {
+      auto& entry = chunk[i];
+      size_t j = 0;
+      for (auto* index : indexes) {
+        if (!entry.is_removed) {
+          if (entry.is_repeat) {
+            index->update_map(entry.ID, entry.docnum, Record{entry.record}, entry.mapped[j]);
+          }
+          index->update_put_mapped(entry.docnum, entry.mapped[j]);
+        } else if (entry.docnum != 0) {
+          index->update_remove(entry.docnum);
+        }
+        ++j;
+      }
+    }
+
+    // Commit a page too large for one batch in parts. Only the last part has the page's cursor,
+    // so if we stop before that, the page is applied again, which is harmless.
+    if (!is_last && batch_bytes() >= kDeltaCommitSize) {
+      auto st = commit_delta_batch(db, /*is_idle=*/false);
+      if (!st.ok()) {
+        return st;
+      }
+      open_delta_batch(db);
+    }
+  }
+  auto st = delta.status();
+  if (!st.ok()) {
+    // Drops any earlier pages in the batch too. They're fetched again from the committed cursor.
+    discard_delta_batch();
+    return st;
   }
 
-  return s.ok() ? Status::OK() : Status{s.ToString()};
+  // Finalize. The page is committed along with the next one if there's room.
+  batch.Put("dbx:delta-cursor", delta.cursor());
+  delta_batch_has_more = delta.has_more();
+  if (has_next && delta.has_more() && batch_bytes() < kDeltaCommitSize) {
+    return Status::OK();
+  }
+  st = commit_delta_batch(db, /*is_idle=*/!delta.has_more());
+  if (st.ok()) {
+    delta_has_more = delta_batch_has_more;
+  }
+  return st;
 }
 
 // ================================================================================================
 
+// Searches run on this many threads, separate from the thread which applies changes
+static const size_t kSearchThreads = 2;
+
+static std::vector<Thread> search_threads() {
+  std::vector<Thread> threads;
+  for (size_t i = 0; i != kSearchThreads; ++i) {
+    threads.emplace_back(
+      (__bridge void*)dispatch_queue_create("dbxmd.search", DISPATCH_QUEUE_SERIAL),
+      Thread::Type::DispatchQueue
+    );
+  }
+  return threads;
+}
+
 Dropbox::Imp::Imp(
   const string& uid,
   const std::string& atok,
@@ -134,6 +296,18 @@ Dropbox::Imp::Imp(
       Thread::Type::DispatchQueue
     }}
 
+  , search_pool{search_threads()}
+
+  , search_terms_thread{Thread{
+      (__bridge void*)dispatch_queue_create("dbxmd.search-terms", DISPATCH_QUEUE_SERIAL),
+      Thread::Type::DispatchQueue
+    }}
+
+  , search_shard_thread{Thread{
+      (__bridge void*)dispatch_queue_create("dbxmd.search-shard", DISPATCH_QUEUE_SERIAL),
+      Thread::Type::DispatchQueue
+    }}
+
   , dbx_api_reachability{
       "api.dropbox.com",
       NetReach::State::Unreachable,
@@ -280,18 +454,57 @@ void Dropbox::Imp::reauthenticate() {
 
 
 void Dropbox::Imp::reset_delta_cursor() {
-  db->Delete(leveldb::WriteOptions{}, "dbx:delta-cursor");
+  leveldb::WriteBatch batch;
+  batch.Delete("dbx:delta-cursor");
+  auto s = writer.write(db, &batch, 0, /*is_idle=*/true);
+  if (!s.ok()) {
+    clog << "[dbxmd] failed to reset delta cursor: " << s.ToString() << endl;
+  }
 }
 
 
 void Dropbox::Imp::start() {
-  // Rebuild indexes as needed
+  // Rebuild indexes as needed, all in one pass over the file entries
   Dropbox dropbox{this, /*add_ref=*/true};
+  Index::List stale_indexes;
   for (auto* index : Index::all()) {
     if (index->read_version(db) != index->version()) {
-      index->rebuild(dropbox, db);
+      stale_indexes.push_front(index);
     }
   }
+  Index::rebuild(dropbox, db, stale_indexes);
+
+  boosts.load(db);
+  search_terms.load(db, SearchIndex::sharedInstance()->terms_key());
+  auto st = search_shard.open(
+    db,
+    search_shard_path,
+    SearchIndex::sharedInstance()->version(),
+    SearchIndex::sharedInstance()->posting_list_prefixes());
+  if (!st.ok()) {
+    clog << "[dbxmd] failed to open search shard: " << st.message() << endl;
+  }
+
+  // Update the search terms and shard and drop cached search results as the search index changes.
+  // Rebuilds aren't reported to listeners, so drop any results cached while rebuilding.
+  dropbox.addChangeListener(
+    SearchIndex::sharedInstance()->key(),
+    [this](const DataChanges& changes) {
+      search_terms.update(changes);
+      rebuild_search_terms_if_needed();
+      search_shard.update(changes);
+      rewrite_search_shard_if_needed();
+      search_cache.invalidate(changes);
+    }
+  );
+  // Cached results include their entries, which can change without changing the search index,
+  // e.g. when only an entry's rev changes
+  dropbox.addChangeListener(
+    kFileEntryKeyPrefix,
+    [this](const DataChanges& changes) { search_cache.invalidate(changes); }
+  );
+  search_cache.clear();
+  rewrite_search_shard_if_needed();
 
   // auto it = RecentsIndex::sharedInstance()->newIterator(db);
   // // for (it.seekToKey("2014-"); it.valid(); it.prev()) {
@@ -323,12 +536,43 @@ void Dropbox::Imp::start() {
 }
 
 
+void Dropbox::Imp::rebuild_search_terms_if_needed() {
+  if (!search_terms.should_rebuild()) {
+    return;
+  }
+  // Searches keep using the current dictionary and its overlay until the rebuilt one replaces it
+  Dropbox ref{this, /*add_ref=*/true};
+  search_terms_thread.async([ref] { ref->search_terms.rebuild(); });
+}
+
+
+void Dropbox::Imp::rewrite_search_shard_if_needed() {
+  if (!search_shard.should_rewrite()) {
+    return;
+  }
+  // Searches keep reading the current shard, and the lists which changed since it was written
+  // from the database, until the new shard replaces it
+  Dropbox ref{this, /*add_ref=*/true};
+  search_shard_thread.async([ref] {
+    auto st = ref->search_shard.rewrite(ref->db);
+    if (!st.ok()) {
+      clog << "[dbxmd] failed to write search shard: " << st.message() << endl;
+    }
+  });
+}
+
+
 void Dropbox::__dealloc(Dropbox::Imp* p) { delete p; }
 
 
 Dropbox::Imp::~Imp() {
   clog << "Dropbox::Imp::~Imp()" << endl;
   if (db) {
+    boosts.flush(db);
+    auto st = search_shard.close(db);
+    if (!st.ok()) {
+      clog << "[dbxmd] failed to record search shard: " << st.message() << endl;
+    }
     delete db;
   }
   if (db_options.filter_policy) {
@@ -351,6 +595,7 @@ Status Dropbox::open(const string& data_dirname) {
   assert(self->db == nullptr);
 
   string db_path = data_dirname + "/" + self->uid + ".dbxmd";
+  self->search_shard_path = data_dirname + "/" + self->uid + ".search-shard";
 
   // Create directories if needed
   NSError* error;
@@ -395,6 +640,16 @@ opendb:
     // Check version
     string dbversion;
     st = self->db->Get(leveldb::ReadOptions{}, "g:dbversion", &dbversion);
+    if (dbversion != kDatabaseVersion && db_can_migrate(dbversion)) {
+      clog << "[dbxmd] migrating local storage from version " << dbversion
+           << " to " << kDatabaseVersion << endl;
+      auto mst = db_migrate(self->db, dbversion);
+      if (mst.ok()) {
+        dbversion = kDatabaseVersion;
+      } else {
+        clog << "[dbxmd] migration failed: " << mst.message() << endl;
+      }
+    }
     if (dbversion != kDatabaseVersion) {
       clog << "[dbxmd] resetting local storage (version mismatch: stored=\""
            << dbversion << "\", program=\"" << kDatabaseVersion << "\")" << endl;
@@ -446,25 +701,30 @@ void Dropbox::Imp::delta_get(rx::func<void(Status)> cb) {
   string cursor;
   db->Get(leveldb::ReadOptions(), "dbx:delta-cursor", &cursor);
   Dropbox dbx{this, /*add_ref=*/true};
-  dbxapi::delta_get(access_token, path_prefix, cursor, [dbx,cb,cursor](rx::Status st, Json json) {
-    dbx->thread.async([=]{
-      dbx->last_api_status = st;
-      // if (json["reset"].bool_value()) 
+  auto access_token = this->access_token;
+  auto path_prefix = this->path_prefix;
+
+  // Fetch pages ahead while applying each in turn on our thread, until has_more is false
+  DeltaPipeline::run(
+    cursor,
+    delta_pages_in_flight,
+    [access_token, path_prefix](const string& cursor, DeltaPipeline::FetchCallback cb) {
+      dbx_delta_get_text(access_token, path_prefix, cursor, cb);
+    },
+    [dbx](rx::func<void()> fn) { dbx->thread.async(fn); },
+    [dbx](const string& body, bool has_next) {
+      // if (delta.reset())
       //   TODO: Dropbox wants us to clear the database here ... Really?
+      return dbx->apply_dbx_delta(body, dbx->db, has_next);
+    },
+    [dbx,cb](Status api_status, Status st) {
+      dbx->last_api_status = api_status;
       if (!st.ok()) {
         cb(st);
       } else {
-        // std::cout << "dbx_delta_get -> " << json.dump() << endl;
-        auto st = dbx->apply_dbx_delta(json, dbx->db);
-        if (!st.ok()) {
-          cb(st);
-        } else {
-          dbx->delta_has_more = json["has_more"].bool_value();
-          cb(nullptr);
-        }
+        cb(api_status);
       }
     });
-  });
 }
 
   
@@ -484,12 +744,209 @@ void Dropbox::Imp::delta_wait(rx::func<void(Status)> cb) {
 }
 
 
+Dropbox::SearchResults Dropbox::Imp::search(
+  const string& type,
+  const string& text,
+  u32 limit,
+  const std::atomic<bool>* is_cancelled)
+{
+  auto* index = SearchIndex::sharedInstance();
+  auto terms = search_terms.dict();
+  auto keys = index->query_keys(text, type, terms.get());
+  SearchCache::Query query{type, keys.text, limit};
+  SearchResults results;
+  u64 generation;
+  if (!search_cache.get(query, results, generation)) {
+    auto boosts = this->boosts.table(); // after get(), as writing usage clears the cache
+    auto shard = search_shard.view();
+    std::vector<string> entry_keys;
+    results = index->search_sync(
+      db, type, text, limit, boosts.get(), terms.get(), &shard, nullptr, is_cancelled, &entry_keys);
+    if (is_cancelled == nullptr || !is_cancelled->load()) {
+      search_cache.put(query, keys.prefixes, entry_keys, results, generation);
+    }
+  }
+  return results;
+}
+
+
 Dropbox::SearchResults Dropbox::search(
   const string& type,
   const string& text,
   u32 limit) const
 {
-  return SearchIndex::sharedInstance()->search_sync(self->db, type, text, limit);
+  return self->search(type, text, limit, nullptr);
+}
+
+
+// A page cursor is the score and document number of the last result of the page, so that the
+// next page starts with the result after it, and the limit of the first page
+static string encode_search_cursor(const SearchIndex::Hit& hit, u32 first_limit) {
+  string cursor;
+  varint_append(cursor, hit.score);
+  varint_append(cursor, hit.docnum);
+  varint_append(cursor, first_limit);
+  return cursor;
+}
+
+static bool decode_search_cursor(const string& cursor, SearchIndex::Hit& hit, u32& first_limit) {
+  const char* p = cursor.data();
+  const char* end = p + cursor.size();
+  u64 score, docnum, n;
+  if (!varint_read(p, end, score) || !varint_read(p, end, docnum) ||
+      !varint_read(p, end, n) || p != end)
+  {
+    return false;
+  }
+  hit.score = u32(score);
+  hit.docnum = DocNum(docnum);
+  first_limit = u32(n);
+  return true;
+}
+
+
+Dropbox::SearchPage Dropbox::searchPage(
+  const string& type,
+  const string& text,
+  u32 limit,
+  const string& cursor) const
+{
+  SearchIndex::Hit after;
+  u32 first_limit = limit;
+  if (!cursor.empty() && !decode_search_cursor(cursor, after, first_limit)) {
+    clog << "[dbxmd] searchPage: malformed cursor" << endl;
+    return SearchPage{};
+  }
+  // Look one result ahead to know whether there's another page
+  auto boosts = self->boosts.table();
+  auto terms = self->search_terms.dict();
+  auto shard = self->search_shard.view();
+  auto hits = SearchIndex::sharedInstance()->search_hits(
+    self->db,
+    type,
+    text,
+    limit + 1,
+    boosts.get(),
+    terms.get(),
+    &shard,
+    cursor.empty() ? nullptr : &after,
+    first_limit);
+  SearchPage page;
+  if (hits.size() > limit) {
+    hits.resize(limit);
+    if (!hits.empty()) {
+      page.cursor = encode_search_cursor(hits.back(), first_limit);
+    }
+  }
+  page.hits.reserve(hits.size());
+  for (auto& hit : hits) {
+    page.hits.push_back(SearchHit{std::move(hit.path), hit.score});
+  }
+  return page;
+}
+
+
+Dropbox::SearchResults Dropbox::readEntries(
+  const std::vector<string>& paths,
+  const std::vector<string>& fields) const
+{
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = self->db->GetSnapshot();
+  SearchResults entries;
+  entries.reserve(paths.size());
+  string value;
+  for (auto& path : paths) {
+    auto st = self->db->Get(read_options, kFileEntryKeyPrefix + path, &value);
+    if (!st.ok()) {
+      entries.emplace_back();
+      continue;
+    }
+    Record record{value};
+    if (fields.empty()) {
+      entries.emplace_back(record.to_json().dump());
+      continue;
+    }
+    Json::object projection;
+    for (auto& field : fields) {
+      auto v = record[field];
+      if (!v.is_null()) {
+        projection[field] = v.to_json();
+      }
+    }
+    entries.emplace_back(Json{projection}.dump());
+  }
+  self->db->ReleaseSnapshot(read_options.snapshot);
+  return entries;
+}
+
+
+SearchTask Dropbox::searchAsync(
+  const string& type,
+  const string& text,
+  u32 limit,
+  SearchCallback callback) const
+{
+  SearchTask task{new SearchTask::Imp};
+  auto dbx = *this;
+  self->search_pool.async(task, [=] {
+    auto results = dbx->search(type, text, limit, &task->is_cancelled);
+    if (!task.isCancelled()) {
+      callback(std::move(results));
+    }
+  });
+  return task;
+}
+
+
+SearchCacheStats Dropbox::searchCacheStats() const {
+  return self->search_cache.stats();
+}
+
+
+void Dropbox::setDurability(Durability durability) {
+  self->writer.set_durability(durability);
+}
+
+
+CommitStats Dropbox::commitStats() const {
+  return self->writer.stats();
+}
+
+
+SearchSession Dropbox::newSearchSession() const {
+  return SearchSession{new SearchSession::Imp{*this}};
+}
+
+
+// Usage is written once this many boosts have changed, or this many seconds after the first
+// change, whichever comes first. Cached search results are dropped when usage is written, so
+// their ranking can lag behind recorded usage by up to kBoostFlushDelay.
+static const size_t kMaxPendingBoosts = 64;
+static const Timer::Seconds kBoostFlushDelay = 10;
+
+void Dropbox::recordUsage(const string& path, Usage usage) {
+  auto docnum = PathDict::read_docnum(self->db, leveldb::ReadOptions(), path);
+  if (docnum == 0) {
+    return;
+  }
+  float weight = usage == Usage::Opened ? 1.0f : 0.5f;
+  auto npending = self->boosts.add(docnum, weight, u32(time(nullptr)));
+  auto dbx = *this;
+  auto flush = [dbx] {
+    bool wrote = false;
+    auto st = dbx->boosts.flush(dbx->db, &wrote);
+    if (!st.ok()) {
+      clog << "[dbxmd] failed to write usage boosts: " << st.message() << endl;
+    }
+    if (wrote) {
+      dbx->search_cache.clear(); // results are scored with boosts
+    }
+  };
+  if (npending == kMaxPendingBoosts) {
+    self->thread.async(flush);
+  } else if (npending == 1) {
+    Timer::startTimeout(kBoostFlushDelay, self->thread, flush);
+  }
 }
 
 
@@ -546,9 +1003,11 @@ struct DBBatchChangeVisitor : leveldb::WriteBatch::Handler {
   DBBatchChangeVisitor(const Dropbox::Imp::DataChangeListeners& listeners) : listeners{listeners} {}
 
   void add_change(const leveldb::Slice& key, DataChange::Kind kind) {
-    auto p = listeners.upper_bound(key.ToString());
-    if (p != listeners.end()) {
-      changes_map[p->first].emplace_back(key, kind);
+    // Listeners are keyed by their prefix followed by "\xff"
+    for (auto& p : listeners) {
+      if (key.starts_with(leveldb::Slice{p.first.data(), p.first.size() - 1})) {
+        changes_map[p.first].emplace_back(key, kind);
+      }
     }
   }
 
@@ -0,0 +1,220 @@
+#include "field-query.hh"
+#include "str.hh"
+#include "unittest.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace dbxmd {
+
+static string to_lower(string s) {
+  for (auto& c : s) {
+    c = (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+  }
+  return s;
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+
+// Parses a size such as "500", "1.5mb" or "2g" as a number of bytes
+static bool parse_size(const string& s, u64& bytes) {
+  if (s.empty() || !(is_digit(s[0]) || s[0] == '.')) {
+    return false;
+  }
+  char* end = nullptr;
+  double n = strtod(s.c_str(), &end);
+  string unit{end};
+  double multiplier;
+  if (unit.empty() || unit == "b") {
+    multiplier = 1;
+  } else if (unit == "k" || unit == "kb") {
+    multiplier = 1024.0;
+  } else if (unit == "m" || unit == "mb") {
+    multiplier = 1024.0 * 1024;
+  } else if (unit == "g" || unit == "gb") {
+    multiplier = 1024.0 * 1024 * 1024;
+  } else if (unit == "t" || unit == "tb") {
+    multiplier = 1024.0 * 1024 * 1024 * 1024;
+  } else {
+    return false;
+  }
+  n *= multiplier;
+  if (n >= 18446744073709551615.0) {
+    return false;
+  }
+  bytes = u64(n + 0.5);
+  return true;
+}
+
+
+// Returns the number of days from 1970-01-01 to a date of the proleptic Gregorian calendar
+static i64 days_from_civil(i64 y, u32 m, u32 d) {
+  y -= m <= 2 ? 1 : 0;
+  i64 era = (y >= 0 ? y : y - 399) / 400;
+  u32 yoe = u32(y - era * 400);
+  u32 doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  u32 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + i64(doe) - 719468;
+}
+
+
+// Parses a day such as "2015-01-31", "today", "yesterday" or "3w" (three weeks ago) as a number
+// of days since 1970-01-01
+static bool parse_day(const string& s, u32 today, u64& day) {
+  if (s == "today" || s == "yesterday") {
+    day = s == "today" ? today : (today != 0 ? today - 1 : 0);
+    return true;
+  }
+  if (s.empty() || !is_digit(s[0])) {
+    return false;
+  }
+  char* end = nullptr;
+  auto n = strtoul(s.c_str(), &end, 10);
+  if (end[0] != '\0' && end[1] == '\0') {
+    u64 days_per_unit;
+    switch (end[0]) {
+      case 'd': days_per_unit = 1; break;
+      case 'w': days_per_unit = 7; break;
+      case 'm': days_per_unit = 30; break;
+      case 'y': days_per_unit = 365; break;
+      default: return false;
+    }
+    auto days_ago = u64(n) * days_per_unit;
+    day = days_ago < today ? today - days_ago : 0;
+    return true;
+  }
+  unsigned y, m, d;
+  int len = 0;
+  if (sscanf(s.c_str(), "%4u-%2u-%2u%n", &y, &m, &d, &len) != 3 || size_t(len) != s.size() ||
+      y < 1970 || m < 1 || m > 12 || d < 1 || d > 31)
+  {
+    return false;
+  }
+  day = u64(days_from_civil(y, m, d));
+  return true;
+}
+
+
+// Parses a range of values, e.g. ">X", ">=X", "<X", "<=X", "X..Y", "X.." or "..Y", or one value
+static bool parse_range(
+  const string& s,
+  rx::func<bool(const string&, u64&)> parse_value,
+  FieldRange& range)
+{
+  FieldRange r;
+  u64 v = 0;
+  auto dots = s.find("..");
+  if (s.compare(0, 2, ">=") == 0) {
+    if (!parse_value(s.substr(2), r.min)) { return false; }
+  } else if (s.compare(0, 2, "<=") == 0) {
+    if (!parse_value(s.substr(2), r.max)) { return false; }
+  } else if (s[0] == '>') {
+    if (!parse_value(s.substr(1), v) || v == UINT64_MAX) { return false; }
+    r.min = v + 1;
+  } else if (s[0] == '<') {
+    if (!parse_value(s.substr(1), v)) { return false; }
+    if (v == 0) {
+      r.min = 1; // nothing is less than zero
+      r.max = 0;
+    } else {
+      r.max = v - 1;
+    }
+  } else if (dots != string::npos) {
+    if ((dots != 0 && !parse_value(s.substr(0, dots), r.min)) ||
+        (dots + 2 != s.size() && !parse_value(s.substr(dots + 2), r.max)))
+    {
+      return false;
+    }
+  } else {
+    if (!parse_value(s, v)) { return false; }
+    r.min = r.max = v;
+  }
+  // Several predicates on a field must all match
+  range.min = std::max(range.min, r.min);
+  range.max = std::min(range.max, r.max);
+  return true;
+}
+
+
+FieldQuery FieldQuery::parse(string& text, u32 today) {
+  FieldQuery q;
+  auto parse_bytes = [](const string& s, u64& v) { return parse_size(s, v); };
+  auto parse_date = [today](const string& s, u64& v) { return parse_day(s, today, v); };
+  vector<string> words;
+  bool is_any_predicate = false;
+  for (auto& word : str_split(text, " ")) {
+    auto w = to_lower(word);
+    auto colon = w.find(':');
+    auto name = w.substr(0, colon == string::npos ? 0 : colon);
+    auto value = colon == string::npos ? string{} : w.substr(colon + 1);
+    bool is_predicate = false;
+    if (value.empty()) {
+      // not a predicate
+    } else if (name == "size") {
+      is_predicate = parse_range(value, parse_bytes, q.size);
+      q.has_size = q.has_size || is_predicate;
+    } else if (name == "modified") {
+      is_predicate = parse_range(value, parse_date, q.modified);
+      q.has_modified = q.has_modified || is_predicate;
+    } else if (name == "mime") {
+      q.mime_types.push_back(value);
+      is_predicate = true;
+    } else if (name == "is" && (value == "folder" || value == "dir")) {
+      q.is_folder = is_predicate = true;
+    }
+    if (is_predicate) {
+      is_any_predicate = true;
+    } else if (!word.empty()) {
+      words.push_back(word);
+    }
+  }
+  if (is_any_predicate) {
+    text = str_join(words, " ");
+  }
+  std::sort(q.mime_types.begin(), q.mime_types.end());
+  q.mime_types.erase(std::unique(q.mime_types.begin(), q.mime_types.end()), q.mime_types.end());
+  return q;
+}
+
+
+bool FieldQuery::operator==(const FieldQuery& other) const {
+  return has_size == other.has_size && (!has_size || size == other.size) &&
+         has_modified == other.has_modified && (!has_modified || modified == other.modified) &&
+         mime_types == other.mime_types &&
+         is_folder == other.is_folder;
+}
+
+
+UNIT_TEST(field_query, {
+  string text = "budget Size:>1.5mb  modified:2015-01-31..today mime:image report is:folder";
+  auto q = FieldQuery::parse(text, 16500);
+  if (text != "budget report") {
+    throw test_failure("predicates left in text: " + text);
+  }
+  if (!q.has_size || q.size.min != 1572865 || q.size.max != UINT64_MAX) {
+    throw test_failure("unexpected size range");
+  }
+  if (!q.has_modified || q.modified.min != 16466 || q.modified.max != 16500) {
+    throw test_failure("unexpected modified range");
+  }
+  if (q.mime_types.size() != 1 || q.mime_types[0] != "image" || !q.is_folder) {
+    throw test_failure("unexpected mime types or kind");
+  }
+
+  // Malformed predicates are searched for as text; several ranges of a field intersect
+  text = "size:lots modified:<1w modified:>=2d size:<1k";
+  q = FieldQuery::parse(text, 16500);
+  if (text != "size:lots" || q.size.max != 1023 ||
+      q.modified.min != 16498 || q.modified.max != 16492 || !q.modified.is_empty())
+  {
+    throw test_failure("unexpected parse of \"" + text + "\"");
+  }
+  text = "plain text";
+  if (!FieldQuery::parse(text, 16500).empty() || text != "plain text") {
+    throw test_failure("found predicates in plain text");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,46 @@
+#pragma once
+#include <rx/rx.h>
+#include <string>
+#include <vector>
+namespace dbxmd {
+
+using std::string;
+
+// An inclusive range of numbers
+struct FieldRange {
+  u64 min = 0;
+  u64 max = UINT64_MAX;
+
+  bool is_empty() const { return min > max; }
+  bool operator==(const FieldRange& other) const { return min == other.min && max == other.max; }
+};
+
+// Predicates on the fields of entries, which a search's text can include along with its terms:
+//
+//   size:>500mb           more than 500 MB; also <, .. (e.g. 1mb..2mb) or an exact size.
+//                         Units are b, k(b), m(b), g(b) and t(b), in powers of 1024.
+//   modified:>2015-01-31  modified after a day; also <, .. or a single day. Instead of a date,
+//                         today, yesterday, or a number of days, weeks, months or years ago, e.g.
+//                         modified:>7d for the last week.
+//   mime:image            of a MIME type starting with "image"
+//   is:folder             a folder
+//
+// Several predicates must all match, except for several MIME types, which any can match.
+struct FieldQuery {
+  bool                has_size = false;
+  FieldRange          size;     // bytes
+  bool                has_modified = false;
+  FieldRange          modified; // days since 1970-01-01
+  std::vector<string> mime_types; // lower case, sorted
+  bool                is_folder = false;
+
+  bool empty() const { return !has_size && !has_modified && mime_types.empty() && !is_folder; }
+  bool operator==(const FieldQuery&) const;
+
+  // Removes the predicates from text and returns them. Relative dates are relative to `today`,
+  // counted in days since 1970-01-01. Words which look like predicates but can't be parsed are
+  // left in text, to be searched for as terms.
+  static FieldQuery parse(string& text, u32 today);
+};
+
+} // namespace
@@ -7,6 +7,7 @@
 #include "recents-index.hh"
 #include "keyspace.hh"
 #include "db.hh"
+#include "thread.hh"
 
 namespace dbxmd {
 
@@ -16,6 +17,20 @@ static const string kMetaKeyPrefix{"\xff"};
 
 static const string kMetaVersionKey{"_version_"};
 static const string kMetaReverseLookupKeyPrefix{"_keys_:"};
+static const string kMetaRebuildCheckpointKey{"_rebuild_"};
+
+// Rebuilds are committed in chunks of roughly this many bytes
+static const size_t kRebuildChunkSize = 4 * 1024 * 1024;
+
+// Rebuilds read file entries in chunks of roughly this many bytes
+static const size_t kRebuildReadChunkSize = 1024 * 1024;
+
+// The entry which map() is mapping on this thread, which emit(), post() and putMeta() add to
+struct MapTarget {
+  const Index* index;
+  ReverseKeys* entry;
+};
+static __thread MapTarget* t_map_target = nullptr;
 
 static Index::List gAllIndexes{
   SearchIndex::sharedInstance(),
@@ -32,6 +47,25 @@ string Index::read_version(leveldb::DB* db) const {
 }
 
 
+std::vector<string> Index::read_lists(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  DocNum docnum) const
+{
+  std::vector<string> lists;
+  string value;
+  auto reverse_key = key(kMetaKeyPrefix + kMetaReverseLookupKeyPrefix + docnum_encode(docnum));
+  ReverseKeys rk;
+  if (db->Get(read_options, reverse_key, &value).ok() && rk.decode(value)) {
+    lists.reserve(rk.lists().size());
+    for (auto& item : rk.lists()) {
+      lists.emplace_back(rk.key(item).ToString());
+    }
+  }
+  return lists;
+}
+
+
 void Index::update_begin(const Dropbox& dropbox, leveldb::DB* db, leveldb::WriteBatch* batch) {
   _db = db;
   _batch = batch;
@@ -39,10 +73,25 @@ void Index::update_begin(const Dropbox& dropbox, leveldb::DB* db, leveldb::Write
 }
 
 void Index::update_end() {
+  if (_batch != nullptr) {
+    _flushPostings();
+  }
   _db = nullptr;
   _batch = nullptr;
   _dropbox = nullptr;
-  _keys.clear();
+  _entry.clear();
+  _prior.clear();
+  _pending_reverse_keys.clear();
+  _pending_meta.clear();
+  _is_rebuilding = false;
+  _batch_bytes = 0;
+}
+
+
+void Index::_flushPostings() {
+  if (!_postings.empty()) {
+    _batch_bytes += _postings.flush(_db, _key_prefix, *_batch);
+  }
 }
 
 
@@ -55,41 +104,184 @@ void Index::update_init() {
 }
 
 
-void Index::update_put(const string& ID, const Json& obj) {
-  map(ID, obj);
-  if (!_keys.empty()) {
-    _putMeta(kMetaReverseLookupKeyPrefix + ID, Json{_keys}.dump());
-    _keys.clear();
+ReverseKeys* Index::_mapping() const {
+  auto* target = t_map_target;
+  return target != nullptr && target->index == this ? target->entry : nullptr;
+}
+
+
+bool Index::_readReverseKeys(DocNum docnum, string& value) const {
+  auto I = _pending_reverse_keys.find(docnum);
+  if (I != _pending_reverse_keys.end()) {
+    value = I->second;
+    return true;
   }
+  value.clear();
+  _db->Get(
+    leveldb::ReadOptions(),
+    key(kMetaKeyPrefix + kMetaReverseLookupKeyPrefix + docnum_encode(docnum)),
+    &value);
+  return false;
+}
+
+
+void Index::_putReverseKeys(DocNum docnum, const ReverseKeys& entry, const string& old_value) {
+  _entry_value.clear();
+  if (!entry.empty()) {
+    entry.encode(_entry_value);
+  }
+  if (_entry_value != old_value) {
+    auto reverse_key = kMetaReverseLookupKeyPrefix + docnum_encode(docnum);
+    if (_entry_value.empty()) {
+      _removeMeta(reverse_key);
+    } else {
+      _putMeta(reverse_key, _entry_value);
+    }
+  }
+  if (!_is_rebuilding) {
+    _pending_reverse_keys[docnum] = _entry_value;
+  }
+}
+
+
+const string& Index::_fullKey(const leveldb::Slice& k) {
+  _key_buf.assign(_key_prefix).append(k.data(), k.size());
+  return _key_buf;
+}
+
+
+void Index::update_put(const string& ID, DocNum docnum, const Record& record) {
+  update_map(ID, docnum, record, _entry);
+  update_put_mapped(docnum, _entry);
+}
+
+
+void Index::update_map(const string& ID, DocNum docnum, const Record& record, ReverseKeys& mapped) {
+  assert(_batch != nullptr);
+  mapped.clear();
+  MapTarget target{this, &mapped};
+  auto* outer_target = t_map_target;
+  t_map_target = &target;
+  map(ID, docnum, record);
+  t_map_target = outer_target;
+  mapped.sort();
 }
 
 
-void Index::update_remove(const string& ID) {
+void Index::update_put_mapped(DocNum docnum, ReverseKeys& entry) {
+  // Read what the entry's previous version was mapped to. A rebuild maps each entry once, to an
+  // index without any entries.
+  bool is_pending = false;
+  _prior.clear();
+  _prior_value.clear();
+  if (!_is_rebuilding) {
+    is_pending = _readReverseKeys(docnum, _prior_value);
+    if (!_prior_value.empty() && !_prior.decode(_prior_value)) {
+      std::clog << "[dbxmd] malformed reverse key list in index \"" << name() << "\"" << std::endl;
+    }
+  }
+
+  // Both are in key order, so walk them side by side: write the keys which are new or have a
+  // different value, and delete the keys which are gone. The values of keys written earlier in
+  // this update aren't in the database yet, so those are always written.
+  auto& keys = entry.keys();
+  auto& prior_keys = _prior.keys();
+  string value;
+  for (size_t i = 0, j = 0; i != keys.size() || j != prior_keys.size();) {
+    int cmp = i == keys.size() ? 1 : j == prior_keys.size() ? -1 :
+      entry.key(keys[i]).compare(_prior.key(prior_keys[j]));
+    if (cmp > 0) {
+      auto k = _prior.key(prior_keys[j++]);
+      _batch->Delete(_fullKey(k));
+      _batch_bytes += _key_prefix.size() + k.size();
+      _putPendingMeta(k, leveldb::Slice{});
+      continue;
+    }
+    auto k = entry.key(keys[i]);
+    auto v = entry.value(keys[i++]);
+    if (cmp == 0) {
+      ++j;
+      if (!is_pending && _db->Get(leveldb::ReadOptions(), _fullKey(k), &value).ok() && value == v) {
+        continue;
+      }
+    }
+    _batch->Put(_fullKey(k), v);
+    _batch_bytes += _key_prefix.size() + k.size() + v.size();
+    _putPendingMeta(k, v);
+  }
+
+  // Add the entry to lists it's new to or has a different payload in, and remove it from lists it
+  // left
+  auto& lists = entry.lists();
+  auto& prior_lists = _prior.lists();
+  for (size_t i = 0, j = 0; i != lists.size() || j != prior_lists.size();) {
+    int cmp = i == lists.size() ? 1 : j == prior_lists.size() ? -1 :
+      entry.key(lists[i]).compare(_prior.key(prior_lists[j]));
+    if (cmp > 0) {
+      auto list = _prior.key(prior_lists[j++]);
+      _postings.remove(list.ToString(), docnum);
+      _batch_bytes += list.size() + sizeof(u32); // approximate; flushing adds the actual size
+      continue;
+    }
+    auto& item = lists[i++];
+    if (cmp == 0 && prior_lists[j++].payload == item.payload) {
+      continue; // in the list already, with the same payload
+    }
+    auto list = entry.key(item);
+    _postings.add(list.ToString(), docnum, item.payload);
+    _batch_bytes += list.size() + 2 * sizeof(u32);
+  }
+
+  _putReverseKeys(docnum, entry, _prior_value);
+  entry.clear();
+}
+
+
+void Index::update_remove(DocNum docnum) {
   // entry was removed; read reverse keys and remove those entries
-  string rvs = getMeta(kMetaReverseLookupKeyPrefix + ID);
-  if (!rvs.empty()) {
-    string err;
-    auto rv = Json::parse(rvs, err);
-    for (auto& item : rv.array_items()) {
-      _batch->Delete(key(item.string_value()));
+  _readReverseKeys(docnum, _prior_value);
+  if (!_prior_value.empty() && _prior.decode(_prior_value)) {
+    for (auto& item : _prior.keys()) {
+      _batch->Delete(_fullKey(_prior.key(item)));
+      _putPendingMeta(_prior.key(item), leveldb::Slice{});
+    }
+    for (auto& item : _prior.lists()) {
+      _postings.remove(_prior.key(item).ToString(), docnum);
     }
   }
   // ... and remove the reverse key list itself
-  _removeMeta(kMetaReverseLookupKeyPrefix + ID);
+  _removeMeta(kMetaReverseLookupKeyPrefix + docnum_encode(docnum));
+  _pending_reverse_keys[docnum].clear();
 }
 
 
 void Index::emit(const string& k, const leveldb::Slice& value) {
   assert(_batch != nullptr);
-  _batch->Put(key(k), value);
-  _keys.emplace(std::move(k));
+  if (auto* entry = _mapping()) {
+    entry->add_key(k, value);
+  } else {
+    // Outside of map(), e.g. from init()
+    _batch->Put(key(k), value);
+    _batch_bytes += _key_prefix.size() + k.size() + value.size();
+  }
 }
 
 
 void Index::remove(const string& k) {
   assert(_batch != nullptr);
-  _batch->Delete(key(k));
-  _keys.erase(k);
+  if (auto* entry = _mapping()) {
+    entry->remove_key(k);
+  } else {
+    _batch->Delete(key(k));
+    _batch_bytes += _key_prefix.size() + k.size();
+  }
+}
+
+
+void Index::post(const string& list, u32 payload) {
+  auto* entry = _mapping();
+  assert(_batch != nullptr && entry != nullptr);
+  entry->add_list(list, payload);
 }
 
 
@@ -103,17 +295,30 @@ string Index::get(const string& k) {
 
 string Index::getMeta(const string& k) const {
   assert(_db != nullptr);
+  // Only changes outside of map(), so it can be read by map() calls on several threads
+  if (!_pending_meta.empty()) {
+    auto I = _pending_meta.find(k);
+    if (I != _pending_meta.end()) {
+      return I->second;
+    }
+  }
   return _getMeta(_db, k);
 }
 
 void Index::putMeta(const string& k, const leveldb::Slice& value) {
-  _putMeta(k, value);
-  _keys.emplace(std::move(k));
+  if (auto* entry = _mapping()) {
+    entry->add_key(kMetaKeyPrefix + k, value);
+  } else {
+    _putMeta(k, value);
+  }
 }
 
 void Index::removeMeta(const string& k) {
-  _removeMeta(k);
-  _keys.erase(k);
+  if (auto* entry = _mapping()) {
+    entry->remove_key(kMetaKeyPrefix + k);
+  } else {
+    _removeMeta(k);
+  }
 }
 
 string Index::_getMeta(leveldb::DB* db, const string& k) const {
@@ -122,14 +327,24 @@ string Index::_getMeta(leveldb::DB* db, const string& k) const {
   return std::move(v);
 }
 
+void Index::_putPendingMeta(const leveldb::Slice& k, const leveldb::Slice& value) {
+  // Entries' meta keys are stored with their prefix
+  if (!_is_rebuilding && k.starts_with(kMetaKeyPrefix)) {
+    _pending_meta[string{k.data() + kMetaKeyPrefix.size(), k.size() - kMetaKeyPrefix.size()}] =
+      value.ToString();
+  }
+}
+
 void Index::_putMeta(const string& k, const leveldb::Slice& value) {
   assert(_batch != nullptr);
   _batch->Put(key(kMetaKeyPrefix + k), value);
+  _batch_bytes += _key_prefix.size() + kMetaKeyPrefix.size() + k.size() + value.size();
 }
 
 void Index::_removeMeta(const string& k) {
   assert(_batch != nullptr);
   _batch->Delete(key(kMetaKeyPrefix + k));
+  _batch_bytes += _key_prefix.size() + kMetaKeyPrefix.size() + k.size();
 }
 
 
@@ -140,62 +355,309 @@ const Dropbox& Index::dropbox() const {
 }
 
 
-Status Index::rebuild(const Dropbox& dropbox, leveldb::DB* db) {
-  std::clog << "[dbxmd] rebuilding index \"" << name() << "\" ..." << std::endl;
+bool Index::_readCheckpoint(leveldb::DB* db, string& ID, u64& entries) const {
+  // A checkpoint is only valid for the version it was recorded with
+  string err;
+  auto checkpoint = Json::parse(_getMeta(db, kMetaRebuildCheckpointKey), err);
+  if (!checkpoint.is_object() || checkpoint["version"].string_value() != version()) {
+    return false;
+  }
+  ID = checkpoint["ID"].string_value();
+  entries = (u64)checkpoint["entries"].number_value();
+  return true;
+}
+
+
+void Index::_putCheckpoint(const string& ID, u64 entries) {
+  _putMeta(kMetaRebuildCheckpointKey, Json{Json::object{
+    {"version", version()},
+    {"ID", ID},
+    {"entries", (double)entries},
+  }}.dump());
+}
 
+
+Status Index::_clear(leveldb::DB* db) {
+  // Delete any existing index entries, committing in chunks
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
   leveldb::WriteBatch batch;
-  UpdateScope updateScope{*this, dropbox, db, &batch};
+  size_t batch_bytes = 0;
+  leveldb::Status s;
 
-  // First delete any existing index entries
   db_foreach(
     db,
+    read_options,
     key(),
     [&](const leveldb::Slice& key, const leveldb::Slice& value) {
       batch.Delete(key);
-      return true;
+      batch_bytes += key.size();
+      if (batch_bytes >= kRebuildChunkSize) {
+        s = db->Write(leveldb::WriteOptions(), &batch);
+        batch.Clear();
+        batch_bytes = 0;
+      }
+      return s.ok();
     }
   );
-  
-  // Init
+
+  if (s.ok() && batch_bytes != 0) {
+    s = db->Write(leveldb::WriteOptions(), &batch);
+  }
+  db->ReleaseSnapshot(read_options.snapshot);
+  return s.ok() ? Status::OK() : Status{s.ToString()};
+}
+
+
+static double approximate_fraction(leveldb::DB* db, const leveldb::Slice& current_key) {
+  // Returns how far into the file entries current_key is, based on the on-disk size of the key
+  // ranges before and after it.
+  auto limit = kFileEntryKeyPrefix + "\xff";
+  leveldb::Range ranges[2] = {
+    {kFileEntryKeyPrefix, current_key},
+    {kFileEntryKeyPrefix, limit},
+  };
+  uint64_t sizes[2] = {0, 0};
+  db->GetApproximateSizes(ranges, 2, sizes);
+  return sizes[1] == 0 ? 0.0 : RX_MIN(1.0, double(sizes[0]) / double(sizes[1]));
+}
+
+
+// State of one index being rebuilt
+struct Index::RebuildState {
+  Index*              index = nullptr;
+  string              resume_ID; // entries up to and including this ID are already mapped
+  RebuildProgress     progress{0, 0.0};
+  leveldb::WriteBatch batch;
+  leveldb::Status     status;
+};
+
+
+Status Index::_rebuildBegin(leveldb::DB* db, RebuildState& st) {
+  // Resume an interrupted rebuild of the same version, or start over
+  if (_readCheckpoint(db, st.resume_ID, st.progress.entries)) {
+    std::clog << "[dbxmd] resuming rebuild of index \"" << name() << "\" after "
+              << st.progress.entries << " entries ..." << std::endl;
+    return Status::OK();
+  }
+
+  std::clog << "[dbxmd] rebuilding index \"" << name() << "\" ..." << std::endl;
+
+  // First delete any existing index entries
+  auto s = _clear(db);
+  if (!s.ok()) {
+    return s;
+  }
+
+  // Init, and record a checkpoint before the first entry
+  st.resume_ID.clear();
+  st.progress.entries = 0;
   update_init();
+  _putCheckpoint(st.resume_ID, 0);
+  st.status = db->Write(leveldb::WriteOptions(), &st.batch);
+  st.batch.Clear();
+  _batch_bytes = 0;
+  return st.status.ok() ? Status::OK() : Status{st.status.ToString()};
+}
 
-  // Set version
-  _putMeta(kMetaVersionKey, version());
 
-  // TODO: run in chunks to save on memory
-  //   1. instead of using db_foreach, get an iterator to file entries and
-  //   2. map N entries, then
-  //   3. db->Write(batch), if iterator is valid goto 2, else
-  //   4. complete
+void Index::_rebuildCommit(
+  leveldb::DB* db,
+  RebuildState& st,
+  const string& ID,
+  RebuildProgressFunc progress)
+{
+  _flushPostings();
+  _putCheckpoint(ID, st.progress.entries);
+  st.status = db->Write(leveldb::WriteOptions(), &st.batch);
+  st.batch.Clear();
+  _batch_bytes = 0;
+  if (st.status.ok()) {
+    st.progress.fraction = approximate_fraction(db, kFileEntryKeyPrefix + ID);
+    std::clog << "[dbxmd] rebuilding index \"" << name() << "\": " << st.progress.entries
+              << " entries (" << int(st.progress.fraction * 100.0) << "%)" << std::endl;
+    if (progress) {
+      progress(*this, st.progress);
+    }
+  }
+}
 
-  // Build indexes from file entries
-  db_foreach(
-    db,
-    kFileEntryKeyPrefix,
-    [&](const leveldb::Slice& key, const leveldb::Slice& value) {
-      // std::cout << "F " << key.ToString() << " = " << value.ToString() << std::endl;
-      string err;
-      auto jsonValue = Json::parse(value.ToString(), err);
-      if (jsonValue.is_object()) {
-        string ID{
-          key.data() + kFileEntryKeyPrefix.size(),
-          key.size() - kFileEntryKeyPrefix.size()
-        };
-        update_put(ID, jsonValue);
+
+Status Index::rebuild(const Dropbox& dropbox, leveldb::DB* db, RebuildProgressFunc progress) {
+  return rebuild(dropbox, db, List{this}, progress);
+}
+
+
+Status Index::rebuild(
+  const Dropbox& dropbox,
+  leveldb::DB* db,
+  const List& indexes,
+  RebuildProgressFunc progress)
+{
+  std::vector<RebuildState> states;
+  for (auto* index : indexes) {
+    states.emplace_back();
+    states.back().index = index;
+  }
+  if (states.empty()) {
+    return Status::OK();
+  }
+
+  for (auto& st : states) {
+    st.index->update_begin(dropbox, db, &st.batch);
+    st.index->_is_rebuilding = true;
+  }
+
+  // Resume or start each index. We only need to read file entries after the earliest
+  // checkpoint.
+  Status status;
+  string start_ID;
+  bool is_first = true;
+  for (auto& st : states) {
+    auto s = st.index->_rebuildBegin(db, st);
+    if (!s.ok()) {
+      status = s;
+      break;
+    }
+    if (is_first || st.resume_ID < start_ID) {
+      start_ID = st.resume_ID;
+      is_first = false;
+    }
+  }
+
+  // A chunk of file entries read from the database
+  struct Entry {
+    string ID;
+    DocNum docnum;
+    string value;
+    bool   is_object = false;
+    Entry(string ID, DocNum docnum, string value)
+      : ID{std::move(ID)}, docnum{docnum}, value{std::move(value)} {}
+  };
+  std::vector<Entry> chunk;
+  std::vector<ReverseKeys> mapped; // of chunk[i] by states[j] at i * states.size() + j
+
+  // File entries and their document numbers are both keyed by ID, so we read them in lockstep
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto* it = db->NewIterator(read_options);
+  auto* docnum_it = db->NewIterator(read_options);
+  it->Seek(kFileEntryKeyPrefix + start_ID);
+  docnum_it->Seek(kDocNumKeyPrefix + start_ID);
+
+  auto read_docnum = [&](const leveldb::Slice& ID) -> DocNum {
+    for (; docnum_it->Valid() && docnum_it->key().starts_with(kDocNumKeyPrefix); docnum_it->Next()) {
+      auto k = docnum_it->key();
+      k.remove_prefix(kDocNumKeyPrefix.size());
+      int cmp = k.compare(ID);
+      if (cmp == 0 && docnum_it->value().size() == kDocNumSize) {
+        return docnum_decode(docnum_it->value().data());
+      } else if (cmp > 0) {
+        break;
       }
-      return true;
     }
-  );
+    return 0;
+  };
+
+  while (status.ok()) {
+    // Read a chunk of file entries
+    chunk.clear();
+    size_t chunk_bytes = 0;
+    for (; it->Valid() && it->key().starts_with(kFileEntryKeyPrefix) &&
+           chunk_bytes < kRebuildReadChunkSize; it->Next())
+    {
+      auto key = it->key();
+      key.remove_prefix(kFileEntryKeyPrefix.size());
+      auto docnum = read_docnum(key);
+      if (docnum == 0) {
+        std::clog << "[dbxmd] file entry \"" << key.ToString() << "\" has no document number"
+                  << std::endl;
+        continue;
+      }
+      chunk.emplace_back(key.ToString(), docnum, it->value().ToString());
+      chunk_bytes += key.size() + it->value().size();
+    }
+    if (chunk.empty()) {
+      break;
+    }
 
-  // Commit
-  auto s = db->Write(leveldb::WriteOptions(), &batch);
-  std::clog << "[dbxmd] rebuilding index \"" << name() << "\"";
-  if (s.ok()) {
-    std::clog << " completed" << std::endl;
-  } else {
-    std::clog << " failed: " << s.ToString() << std::endl;
+    // Map the entries in parallel, each to all indexes
+    if (mapped.size() < chunk.size() * states.size()) {
+      mapped.resize(chunk.size() * states.size());
+    }
+    Thread::apply(chunk.size(), [&](size_t i) {
+      auto& entry = chunk[i];
+      Record record{entry.value};
+      entry.is_object = record.is_object();
+      if (entry.is_object) {
+        for (size_t j = 0; j != states.size(); ++j) {
+          if (entry.ID > states[j].resume_ID) { // else it was mapped by a previous rebuild
+            auto& out = mapped[i * states.size() + j];
+            states[j].index->update_map(entry.ID, entry.docnum, record, out);
+          }
+        }
+      }
+    });
+
+    // Add the mapped entries to the indexes in order, one index per thread
+    Thread::apply(states.size(), [&](size_t j) {
+      auto& st = states[j];
+      auto* index = st.index;
+      for (size_t i = 0; i != chunk.size(); ++i) {
+        auto& entry = chunk[i];
+        if (!st.status.ok()) {
+          break;
+        }
+        if (entry.ID <= st.resume_ID) {
+          continue; // Entry was mapped by a previous rebuild
+        }
+        if (entry.is_object) {
+          index->update_put_mapped(entry.docnum, mapped[i * states.size() + j]);
+        }
+        ++st.progress.entries;
+        if (index->_batch_bytes >= kRebuildChunkSize) {
+          index->_rebuildCommit(db, st, entry.ID, progress);
+        }
+      }
+    });
+
+    for (auto& st : states) {
+      if (!st.status.ok()) {
+        status = Status{st.status.ToString()};
+        break;
+      }
+    }
   }
-  return s.ok() ? Status::OK() : Status{s.ToString()};
+  delete it;
+  delete docnum_it;
+  db->ReleaseSnapshot(read_options.snapshot);
+
+  // Commit the last chunk of each index, set the version and remove the checkpoint
+  for (auto& st : states) {
+    auto* index = st.index;
+    if (status.ok()) {
+      index->_flushPostings();
+      index->_putMeta(kMetaVersionKey, index->version());
+      index->_removeMeta(kMetaRebuildCheckpointKey);
+      st.status = db->Write(leveldb::WriteOptions(), &st.batch);
+      if (!st.status.ok()) {
+        status = Status{st.status.ToString()};
+      }
+    }
+    std::clog << "[dbxmd] rebuilding index \"" << index->name() << "\"";
+    if (status.ok()) {
+      std::clog << " completed (" << st.progress.entries << " entries)" << std::endl;
+      if (progress) {
+        st.progress.fraction = 1.0;
+        progress(*index, st.progress);
+      }
+    } else {
+      std::clog << " failed: " << status.message() << std::endl;
+    }
+    index->update_end();
+  }
+
+  return status;
 }
 
 
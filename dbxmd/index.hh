@@ -3,8 +3,12 @@
 #include <leveldb/write_batch.h>
 #include <json11/json11.hh>
 #include <rx/status.hh>
+#include "record.hh"
+#include "doc.hh"
+#include "postings.hh"
+#include "reverse-keys.hh"
 #include <forward_list>
-#include <set>
+#include <unordered_map>
 namespace dbxmd {
 
 using std::string;
@@ -25,9 +29,18 @@ struct Index {
   virtual void init() {};
 
   // Maps a database entry to the index. This method should call emit() to create index entries.
-  virtual void map(const string& ID, const Json&) = 0;
-
-  // The Json object passed to map() looks something like this:
+  // Index entries should refer to the entry by its document number rather than by its ID.
+  // When an entry changes, map() is called again and should emit all the entry's index entries,
+  // not just the ones that changed: Entries the new version doesn't emit are removed, and entries
+  // it emits with the same value as before aren't rewritten.
+  // map() is called for several entries at once on different threads, so it must be thread-safe:
+  // it should only read the index's state, other than by calling the methods below, and must not
+  // use static mutable state or non-reentrant C functions like gmtime() or strtok().
+  virtual void map(const string& ID, DocNum, const Record&) = 0;
+
+  // The Record passed to map() references the stored bytes of a file entry, and its fields can
+  // be read without decoding the whole entry, e.g. record[RecordField::IsDir].bool_value().
+  // As JSON, an entry looks something like this:
   //  { "bytes": 86,
   //    "client_mtime": "Wed, 21 Jan 2015 23:03:58 +0000",
   //    "icon": "page_white",
@@ -52,17 +65,26 @@ struct Index {
   //————————————————————————————————————————————————————————————————————————————————————————
   // The following methods are available from within init() and map():
 
-  // Create or set a value in the index
+  // Create or set a value in the index. From map(), the value is written when the entry is done
+  // mapping, and only if it changed.
   void emit(const string& key, const leveldb::Slice& value);
 
   // Read a value from the index
   string get(const string& key);
 
-  // Remove a value from the index
+  // Remove a value from the index. From map(), only removes a value the entry emitted.
   void remove(const string& key);
 
+  // Add the entry being mapped to a posting list with a payload, e.g. a rank. Use this instead of
+  // emit() for keys that many entries share, like search terms: the entries of a list are stored
+  // together in a few compressed blocks rather than as one index entry each. Lists are read with
+  // PostingCursor using keys from key(list). See postings.hh.
+  void post(const string& list, u32 payload);
+
   // Read, write or remove a meta value from the index.
-  // Meta values are not included when iterating over an index's entries.
+  // Meta values are not included when iterating over an index's entries. getMeta() sees the
+  // values written by map() for entries updated earlier in the same update, before they're
+  // committed.
   string getMeta(const string& key) const;
   void putMeta(const string& key, const leveldb::Slice& value);
   void removeMeta(const string& key);
@@ -84,13 +106,24 @@ struct Index {
   string key(const string& suffix) const; // e.g. ("foo") => "index:<name>:foo"
   string read_version(leveldb::DB*) const;
 
+  // Returns the posting lists that an entry was added to with post()
+  std::vector<string> read_lists(leveldb::DB*, const leveldb::ReadOptions&, DocNum) const;
+
   // Update functions. Warning: Non-reentrant.
   void update_begin(const Dropbox&, leveldb::DB*, leveldb::WriteBatch*);
     void update_init();
-    void update_put(const string& ID, const Json&);
-    void update_remove(const string& ID);
+    void update_put(const string& ID, DocNum, const Record&);
+    void update_remove(DocNum);
+    // update_put() in two steps: update_map() maps an entry into a buffer without changing the
+    // index, and may be called from several threads at once for different entries.
+    // update_put_mapped() then adds the mapped entry to the index, and clears the buffer.
+    void update_map(const string& ID, DocNum, const Record&, ReverseKeys& mapped);
+    void update_put_mapped(DocNum, ReverseKeys& mapped);
   void update_end();
 
+  // Approximate size of the changes added to the batch since update_begin()
+  size_t update_bytes() const;
+
   struct UpdateScope {
     UpdateScope(Index& index, const Dropbox& dropbox, leveldb::DB* db, leveldb::WriteBatch* batch)
       : _index{index} { _index.update_begin(dropbox, db, batch); }
@@ -99,13 +132,45 @@ struct Index {
     Index& _index;
   };
 
-  Status rebuild(const Dropbox&, leveldb::DB*);
+  // Progress of a rebuild, reported after each committed chunk
+  struct RebuildProgress {
+    u64    entries;  // number of file entries mapped so far
+    double fraction; // approximate fraction of file entries processed, in the range [0-1]
+  };
+  // Note: May be called concurrently from different threads for different indexes.
+  using RebuildProgressFunc = rx::func<void(const Index&, const RebuildProgress&)>;
+
+  // Rebuilds the index from all file entries. The rebuild is committed in size-capped chunks
+  // and a checkpoint is recorded with each chunk, so that a rebuild which is interrupted
+  // resumes from where it left off the next time it's run rather than starting over.
+  Status rebuild(const Dropbox&, leveldb::DB*, RebuildProgressFunc progress = nullptr);
+
+  // Rebuilds several indexes in a single pass over the file entries. Each entry is read once
+  // and then mapped to all indexes. Entries are mapped in parallel, and then added to the
+  // indexes in order, with the indexes being added to in parallel.
+  static Status rebuild(
+    const Dropbox&,
+    leveldb::DB*,
+    const List& indexes,
+    RebuildProgressFunc progress = nullptr);
 
 private:
+  struct RebuildState;
   Index(const Index&) = delete;
+  ReverseKeys* _mapping() const;
+  bool _readReverseKeys(DocNum, string& value) const;
+  void _putReverseKeys(DocNum, const ReverseKeys& entry, const string& old_value);
+  const string& _fullKey(const leveldb::Slice& k);
+  Status _clear(leveldb::DB*);
+  bool _readCheckpoint(leveldb::DB*, string& ID, u64& entries) const;
+  void _putCheckpoint(const string& ID, u64 entries);
+  Status _rebuildBegin(leveldb::DB*, RebuildState&);
+  void _rebuildCommit(leveldb::DB*, RebuildState&, const string& ID, RebuildProgressFunc);
   string _getMeta(leveldb::DB*, const string& key) const;
   void _putMeta(const string& key, const leveldb::Slice& value);
   void _removeMeta(const string& key);
+  void _putPendingMeta(const leveldb::Slice& key, const leveldb::Slice& value);
+  void _flushPostings();
 
   string               _name;
   string               _key_prefix;
@@ -113,7 +178,20 @@ private:
   leveldb::DB*         _db = nullptr;
   leveldb::WriteBatch* _batch = nullptr;
   const Dropbox*       _dropbox = nullptr;
-  std::set<string>     _keys;
+  // Keys (meta keys with their prefix) and values emitted by an entry, and the posting lists it
+  // was added to, and those of its previous version. Reused for each entry.
+  ReverseKeys          _entry;
+  ReverseKeys          _prior;
+  string               _prior_value;
+  string               _entry_value;
+  string               _key_buf;
+  // Reverse key lists added to _batch, as an entry can change more than once in an update
+  std::unordered_map<DocNum,string> _pending_reverse_keys;
+  // Meta values which entries wrote to _batch, "" if removed, for getMeta()
+  std::unordered_map<string,string> _pending_meta;
+  bool                 _is_rebuilding = false; // entries have no prior keys
+  PostingWriter        _postings;
+  size_t               _batch_bytes = 0; // approximate size of changes added to _batch
 };
 
 //————————————————————————————————————————————————————————————————————————————————————
@@ -125,5 +203,6 @@ inline Index::Index(const string& name)
 inline const string& Index::name() const { return _name; }
 inline const string& Index::key() const { return _key_prefix; }
 inline string Index::key(const string& s) const { return _key_prefix + s; }
+inline size_t Index::update_bytes() const { return _batch_bytes; }
 
 } // namespace
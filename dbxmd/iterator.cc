@@ -3,6 +3,7 @@
 #include "dbxmd.h"
 #include "iterator_imp.hh"
 #include "keyspace.hh"
+#include "record.hh"
 #include <iostream>
 namespace dbxmd {
 
@@ -84,7 +85,7 @@ string Iterator::key() const {
 string Iterator::entryValue() const {
   string v;
   self->db->Get(self->read_options, kFileEntryKeyPrefix + value(), &v);
-  return v;
+  return v.empty() ? v : Record{v}.to_json().dump();
 }
 
 string Iterator::value() const {
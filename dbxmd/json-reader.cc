@@ -0,0 +1,409 @@
+#include "json-reader.hh"
+#include "unicode.hh"
+#include "unittest.hh"
+#include <cstdlib>
+#include <cstring>
+#include <json11/json11.hh>
+
+namespace dbxmd {
+
+
+JsonReader::JsonReader(const leveldb::Slice& text)
+  : _begin{text.data()}
+  , _p{text.data()}
+  , _end{text.data() + text.size()}
+  {}
+
+
+JsonReader::Token JsonReader::_fail(const char* error) {
+  _error = error;
+  return Error;
+}
+
+
+void JsonReader::_skipSpace() {
+  while (_p != _end && (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t')) {
+    ++_p;
+  }
+}
+
+
+bool JsonReader::_literal(const char* s, size_t len) {
+  if (size_t(_end - _p) < len || memcmp(_p, s, len) != 0) {
+    return false;
+  }
+  _p += len;
+  return true;
+}
+
+
+JsonReader::Token JsonReader::next() {
+  if (_error != nullptr) {
+    return Error;
+  }
+  _skipSpace();
+  if (_depth == 0) {
+    if (_done) {
+      return _p == _end ? End : _fail("unexpected text after the value");
+    }
+    return _readValue();
+  }
+  if (_p == _end) {
+    return _fail("unexpected end of text");
+  }
+
+  auto& level = _stack[_depth - 1];
+  if (*_p == (level.is_object ? '}' : ']') && !level.has_key &&
+      (level.is_empty || level.need_comma))
+  {
+    ++_p;
+    --_depth;
+    return _completed(level.is_object ? EndObject : EndArray);
+  }
+  if (level.need_comma) {
+    if (*_p != ',') {
+      return _fail(level.is_object ? "expected ',' or '}'" : "expected ',' or ']'");
+    }
+    ++_p;
+    level.need_comma = false;
+    _skipSpace();
+  }
+  if (level.is_object && !level.has_key) {
+    if (_p == _end || *_p != '"') {
+      return _fail("expected a field name");
+    }
+    if (_readString(Key) == Error) {
+      return Error;
+    }
+    _skipSpace();
+    if (_p == _end || *_p != ':') {
+      return _fail("expected ':'");
+    }
+    ++_p;
+    level.has_key = true;
+    return Key;
+  }
+  return _readValue();
+}
+
+
+// Marks the value which ends with token as read
+JsonReader::Token JsonReader::_completed(Token token) {
+  if (_depth == 0) {
+    _done = true;
+  } else {
+    auto& level = _stack[_depth - 1];
+    level.is_empty = false;
+    level.need_comma = true;
+    level.has_key = false;
+  }
+  return token;
+}
+
+
+JsonReader::Token JsonReader::_readValue() {
+  if (_p == _end) {
+    return _fail("unexpected end of text");
+  }
+  switch (*_p) {
+    case '{':
+    case '[': {
+      if (_depth == kMaxDepth) {
+        return _fail("containers nested too deeply");
+      }
+      bool is_object = *_p++ == '{';
+      _stack[_depth++] = Level{is_object, true, false, false};
+      return is_object ? BeginObject : BeginArray;
+    }
+    case '"': {
+      auto token = _readString(String);
+      return token == Error ? Error : _completed(token);
+    }
+    case 'n': return _literal("null", 4) ? _completed(Null) : _fail("invalid literal");
+    case 't': return _literal("true", 4) ? _completed(True) : _fail("invalid literal");
+    case 'f': return _literal("false", 5) ? _completed(False) : _fail("invalid literal");
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': {
+      return _readNumber();
+    }
+    default:
+      return _fail("unexpected character");
+  }
+}
+
+
+// Reads four hex digits, advancing p only if they are valid
+static bool read_hex4(const char*& p, const char* end, u32& v) {
+  if (end - p < 4) {
+    return false;
+  }
+  v = 0;
+  for (size_t i = 0; i != 4; ++i) {
+    char c = p[i];
+    u32 d = (c >= '0' && c <= '9') ? u32(c - '0') :
+            (c >= 'a' && c <= 'f') ? u32(c - 'a' + 10) :
+            (c >= 'A' && c <= 'F') ? u32(c - 'A' + 10) : 16;
+    if (d == 16) {
+      return false;
+    }
+    v = (v << 4) | d;
+  }
+  p += 4;
+  return true;
+}
+
+
+JsonReader::Token JsonReader::_readString(Token token) {
+  // Most strings have no escapes and are returned as they are
+  const char* start = ++_p;
+  while (_p != _end && *_p != '"' && *_p != '\\' && u8(*_p) >= 0x20) {
+    ++_p;
+  }
+  if (_p != _end && *_p == '"') {
+    _string = leveldb::Slice{start, size_t(_p - start)};
+    ++_p;
+    return token;
+  }
+
+  _buf.assign(start, size_t(_p - start));
+  for (;;) {
+    if (_p == _end) {
+      return _fail("unterminated string");
+    }
+    char c = *_p++;
+    if (c == '"') {
+      break;
+    }
+    if (u8(c) < 0x20) {
+      return _fail("control character in string");
+    }
+    if (c != '\\') {
+      _buf.push_back(c);
+      continue;
+    }
+    if (_p == _end) {
+      return _fail("unterminated string");
+    }
+    switch (*_p++) {
+      case '"':  _buf.push_back('"'); break;
+      case '\\': _buf.push_back('\\'); break;
+      case '/':  _buf.push_back('/'); break;
+      case 'b':  _buf.push_back('\b'); break;
+      case 'f':  _buf.push_back('\f'); break;
+      case 'n':  _buf.push_back('\n'); break;
+      case 'r':  _buf.push_back('\r'); break;
+      case 't':  _buf.push_back('\t'); break;
+      case 'u': {
+        u32 cp;
+        if (!read_hex4(_p, _end, cp)) {
+          return _fail("invalid \\u escape");
+        }
+        if (cp >= 0xD800 && cp < 0xDC00) {
+          // A high surrogate, which should be followed by an escaped low surrogate
+          const char* p = _p;
+          u32 low;
+          if (_end - p >= 2 && p[0] == '\\' && p[1] == 'u' && (p += 2, read_hex4(p, _end, low)) &&
+              low >= 0xDC00 && low < 0xE000)
+          {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            _p = p;
+          } else {
+            cp = 0xFFFD;
+          }
+        } else if (cp >= 0xDC00 && cp < 0xE000) {
+          cp = 0xFFFD;
+        }
+        utf8_append(_buf, cp);
+        break;
+      }
+      default:
+        return _fail("invalid escape in string");
+    }
+  }
+  _string = leveldb::Slice{_buf};
+  return token;
+}
+
+
+JsonReader::Token JsonReader::_readNumber() {
+  // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  const char* start = _p;
+  auto digits = [&] {
+    const char* p = _p;
+    while (_p != _end && *_p >= '0' && *_p <= '9') {
+      ++_p;
+    }
+    return size_t(_p - p);
+  };
+  bool is_negative = *_p == '-';
+  if (is_negative) {
+    ++_p;
+  }
+  const char* int_start = _p;
+  size_t nint = digits();
+  if (nint == 0 || (nint > 1 && *int_start == '0')) {
+    return _fail("invalid number");
+  }
+  bool is_integer = true;
+  if (_p != _end && *_p == '.') {
+    ++_p;
+    if (digits() == 0) {
+      return _fail("invalid number");
+    }
+    is_integer = false;
+  }
+  if (_p != _end && (*_p == 'e' || *_p == 'E')) {
+    ++_p;
+    if (_p != _end && (*_p == '+' || *_p == '-')) {
+      ++_p;
+    }
+    if (digits() == 0) {
+      return _fail("invalid number");
+    }
+    is_integer = false;
+  }
+
+  if (is_integer && nint <= 15) {
+    // Exact as a double
+    u64 n = 0;
+    for (const char* p = int_start; p != int_start + nint; ++p) {
+      n = n * 10 + u64(*p - '0');
+    }
+    _number = is_negative ? -double(n) : double(n);
+  } else {
+    // strtod needs a terminated string
+    char buf[64];
+    size_t len = size_t(_p - start);
+    if (len < sizeof(buf)) {
+      memcpy(buf, start, len);
+      buf[len] = '\0';
+      _number = strtod(buf, nullptr);
+    } else {
+      _buf.assign(start, len);
+      _number = strtod(_buf.c_str(), nullptr);
+    }
+  }
+  return _completed(Number);
+}
+
+
+bool JsonReader::skip(Token first) {
+  if (first == Error) {
+    return false;
+  }
+  if (first != BeginArray && first != BeginObject) {
+    return true;
+  }
+  size_t depth = 1;
+  while (depth != 0) {
+    switch (next()) {
+      case Error:       return false;
+      case BeginArray:
+      case BeginObject: ++depth; break;
+      case EndArray:
+      case EndObject:   --depth; break;
+      default:          break;
+    }
+  }
+  return true;
+}
+
+
+UNIT_TEST(json_reader, {
+  // Read into a DOM and compare with json11
+  rx::func<bool(JsonReader&, JsonReader::Token, json11::Json&)> read_value;
+  read_value = [&](JsonReader& r, JsonReader::Token t, json11::Json& out) {
+    switch (t) {
+      case JsonReader::Null:   out = json11::Json{}; return true;
+      case JsonReader::False:  out = json11::Json{false}; return true;
+      case JsonReader::True:   out = json11::Json{true}; return true;
+      case JsonReader::Number: out = json11::Json{r.number_value()}; return true;
+      case JsonReader::String: out = json11::Json{r.string_value().ToString()}; return true;
+      case JsonReader::BeginArray: {
+        json11::Json::array items;
+        for (t = r.next(); t != JsonReader::EndArray; t = r.next()) {
+          items.emplace_back();
+          if (!read_value(r, t, items.back())) {
+            return false;
+          }
+        }
+        out = json11::Json{items};
+        return true;
+      }
+      case JsonReader::BeginObject: {
+        json11::Json::object fields;
+        for (t = r.next(); t != JsonReader::EndObject; t = r.next()) {
+          if (t != JsonReader::Key) {
+            return false;
+          }
+          auto name = r.string_value().ToString();
+          if (!read_value(r, r.next(), fields[name])) {
+            return false;
+          }
+        }
+        out = json11::Json{fields};
+        return true;
+      }
+      default:
+        return false;
+    }
+  };
+
+  auto valid = [&](const char* text) {
+    string err;
+    auto expected = json11::Json::parse(text, err);
+    JsonReader r{leveldb::Slice{text}};
+    json11::Json actual;
+    if (!read_value(r, r.next(), actual) || r.next() != JsonReader::End) {
+      std::cerr << "text = " << text << "; " << (r.error() ? r.error() : "") << std::endl;
+      throw test_failure("JsonReader failed to read valid JSON");
+    }
+    if (actual != expected) {
+      std::cerr << "text = " << text << "; read " << actual.dump() << std::endl;
+      throw test_failure("JsonReader read differs from json11");
+    }
+  };
+  valid(R"({"has_more": true, "cursor": "AAE-x", "entries": [["/a b", {"bytes": 0}], ["/c", null]]})");
+  valid(R"( [1, -2, 0.5, -1.25e3, 1E-2, 12345678901234567890, 0, -0, "", [], {}, [[]]] )");
+  valid(R"({"s": "a\"b\\c\/d\b\f\n\r\té中😀", "t": "héllo"})");
+  valid("\"caf\xc3\xa9\"");
+  valid("null");
+
+  auto invalid = [&](const char* text) {
+    JsonReader r{leveldb::Slice{text}};
+    json11::Json actual;
+    if (read_value(r, r.next(), actual) && r.next() == JsonReader::End) {
+      std::cerr << "text = " << text << std::endl;
+      throw test_failure("JsonReader accepted invalid JSON");
+    }
+  };
+  invalid("[1,]");
+  invalid("[1 2]");
+  invalid("{\"a\" 1}");
+  invalid("{\"a\": 1,}");
+  invalid("{1: 2}");
+  invalid("[01]");
+  invalid("[1.]");
+  invalid("[-]");
+  invalid("\"abc");
+  invalid("\"a\\x\"");
+  invalid("[\"a\nb\"]");
+  invalid("tru");
+  invalid("[1] 2");
+  invalid("[");
+  invalid("");
+
+  // Skipping values
+  JsonReader r{leveldb::Slice{R"({"a": [1, {"b": [2]}], "c": 3})"}};
+  if (r.next() != JsonReader::BeginObject || r.next() != JsonReader::Key ||
+      !r.skip(r.next()) || r.next() != JsonReader::Key || r.string_value() != "c" ||
+      r.next() != JsonReader::Number || r.number_value() != 3 ||
+      r.next() != JsonReader::EndObject || r.next() != JsonReader::End)
+  {
+    throw test_failure("JsonReader::skip failed");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,80 @@
+#pragma once
+#include <rx/rx.h>
+#include <leveldb/slice.h>
+#include <string>
+namespace dbxmd {
+
+using std::string;
+
+// Reads JSON text one token at a time, without building a DOM. Strings without escapes are
+// returned as slices of the text; others are decoded into a buffer owned by the reader, which is
+// reused by the next string. Nothing else is allocated.
+//
+// In an object, tokens alternate between Key and the first token of a value. Returns Error, and
+// keeps returning it, if the text is not valid JSON.
+struct JsonReader {
+  enum Token : u8 {
+    Error = 0,
+    End,          // after the top-level value
+    Null,
+    False,
+    True,
+    Number,
+    String,
+    Key,          // an object field name
+    BeginArray,
+    EndArray,
+    BeginObject,
+    EndObject,
+  };
+
+  explicit JsonReader(const leveldb::Slice& text);
+
+  Token next();
+
+  // Value of the last String or Key token
+  const leveldb::Slice& string_value() const { return _string; }
+
+  // Value of the last Number token
+  double number_value() const { return _number; }
+
+  // Skips the rest of a value whose first token was just returned by next(). Returns false on
+  // error.
+  bool skip(Token first);
+
+  // Describes the error, and where it happened, after Error was returned
+  const char* error() const { return _error; }
+  size_t error_offset() const { return size_t(_p - _begin); }
+
+  // Containers nest at most this deep
+  static const size_t kMaxDepth = 64;
+
+private:
+  struct Level {
+    bool is_object;
+    bool is_empty;   // no items yet
+    bool need_comma; // an item was just read
+    bool has_key;    // a key was just read
+  };
+
+  Token _fail(const char* error);
+  Token _readValue();
+  Token _completed(Token);
+  Token _readString(Token);
+  Token _readNumber();
+  void  _skipSpace();
+  bool  _literal(const char* s, size_t len);
+
+  const char*    _begin;
+  const char*    _p;
+  const char*    _end;
+  const char*    _error = nullptr;
+  leveldb::Slice _string;
+  double         _number = 0;
+  string         _buf;   // decoded strings with escapes
+  bool           _done = false;
+  size_t         _depth = 0;
+  Level          _stack[kMaxDepth];
+};
+
+} // namespace
@@ -3,4 +3,15 @@ namespace dbxmd {
 
 static const std::string kFileEntryKeyPrefix{"fn:"};
 
+// Path dictionary (see PathDict)
+static const std::string kDocNumKeyPrefix{"dn:"};     // "dn:<path>" => <docnum>
+static const std::string kDocPathKeyPrefix{"dp:"};    // "dp:<docnum>" => <path>
+static const std::string kNextDocNumKey{"g:next-docnum"};
+
+// Search shard (see SearchShardStore)
+static const std::string kSearchShardKey{"g:search-shard"};
+
+// Usage boosts (see BoostStore)
+static const std::string kBoostKeyPrefix{"u:"};       // "u:<docnum>" => <boost>
+
 } // namespace
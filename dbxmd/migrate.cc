@@ -0,0 +1,144 @@
+#include <rx/rx.h>
+#include <leveldb/write_batch.h>
+#include <json11/json11.hh>
+#include <iostream>
+#include "migrate.hh"
+#include "keyspace.hh"
+#include "record.hh"
+#include "version.hh"
+#include "doc.hh"
+
+namespace dbxmd {
+
+using std::string;
+
+// Migrations write in chunks of roughly this many bytes
+static const size_t kMigrationChunkSize = 4 * 1024 * 1024;
+
+
+// 4 ➔ 5: File entries are stored as records instead of JSON text
+static leveldb::Status migrate_4_to_5(leveldb::DB* db) {
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto* it = db->NewIterator(read_options);
+  leveldb::WriteBatch batch;
+  leveldb::Status s;
+  size_t batch_bytes = 0;
+  size_t count = 0;
+  string value;
+
+  for (it->Seek(kFileEntryKeyPrefix);
+       s.ok() && it->Valid() && it->key().starts_with(kFileEntryKeyPrefix);
+       it->Next())
+  {
+    auto v = it->value();
+    if (Record{v}.is_object()) {
+      continue; // already migrated by an earlier, interrupted migration
+    }
+    string err;
+    auto json = json11::Json::parse(v.ToString(), err);
+    value.clear();
+    Record::encode(json, value);
+    batch.Put(it->key(), value);
+    batch_bytes += it->key().size() + value.size();
+    ++count;
+    if (batch_bytes >= kMigrationChunkSize) {
+      s = db->Write(leveldb::WriteOptions(), &batch);
+      batch.Clear();
+      batch_bytes = 0;
+    }
+  }
+  delete it;
+  db->ReleaseSnapshot(read_options.snapshot);
+
+  if (s.ok()) {
+    batch.Put("g:dbversion", "5");
+    s = db->Write(leveldb::WriteOptions(), &batch);
+  }
+  std::clog << "[dbxmd] migrated " << count << " file entries to records" << std::endl;
+  return s;
+}
+
+
+// 5 ➔ 6: File entries are assigned document numbers (see PathDict)
+static leveldb::Status migrate_5_to_6(leveldb::DB* db) {
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto* it = db->NewIterator(read_options);
+  leveldb::WriteBatch batch;
+  leveldb::Status s;
+  size_t batch_bytes = 0;
+
+  // Numbers are assigned in ID order, so running this again after an interruption assigns the
+  // same numbers.
+  DocNum docnum = 0;
+  for (it->Seek(kFileEntryKeyPrefix);
+       s.ok() && it->Valid() && it->key().starts_with(kFileEntryKeyPrefix);
+       it->Next())
+  {
+    auto ID = it->key();
+    ID.remove_prefix(kFileEntryKeyPrefix.size());
+    auto encoded = docnum_encode(++docnum);
+    batch.Put(kDocNumKeyPrefix + ID.ToString(), encoded);
+    batch.Put(kDocPathKeyPrefix + encoded, ID);
+    batch_bytes += (ID.size() + kDocNumSize) * 2;
+    if (batch_bytes >= kMigrationChunkSize) {
+      s = db->Write(leveldb::WriteOptions(), &batch);
+      batch.Clear();
+      batch_bytes = 0;
+    }
+  }
+  delete it;
+  db->ReleaseSnapshot(read_options.snapshot);
+
+  if (s.ok()) {
+    batch.Put(kNextDocNumKey, docnum_encode(docnum + 1));
+    batch.Put("g:dbversion", "6");
+    s = db->Write(leveldb::WriteOptions(), &batch);
+  }
+  std::clog << "[dbxmd] assigned " << docnum << " document numbers" << std::endl;
+  return s;
+}
+
+
+struct Migration {
+  const char* from_version;
+  leveldb::Status(*migrate)(leveldb::DB*);
+};
+
+// Each migration upgrades to the version of the next one, the last one to kDatabaseVersion
+static const Migration kMigrations[] = {
+  {"4", migrate_4_to_5},
+  {"5", migrate_5_to_6},
+};
+static const size_t kMigrationCount = sizeof(kMigrations) / sizeof(*kMigrations);
+
+
+bool db_can_migrate(const string& from_version) {
+  for (auto& m : kMigrations) {
+    if (from_version == m.from_version) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+rx::Status db_migrate(leveldb::DB* db, const string& from_version) {
+  size_t i = 0;
+  while (i != kMigrationCount && from_version != kMigrations[i].from_version) {
+    ++i;
+  }
+  if (i == kMigrationCount) {
+    return rx::Status{"no migration from version \"" + from_version + "\""};
+  }
+  for (; i != kMigrationCount; ++i) {
+    auto s = kMigrations[i].migrate(db);
+    if (!s.ok()) {
+      return rx::Status{s.ToString()};
+    }
+  }
+  return rx::Status::OK();
+}
+
+} // namespace
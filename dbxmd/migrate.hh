@@ -0,0 +1,15 @@
+#pragma once
+#include <leveldb/db.h>
+#include <rx/status.hh>
+#include <string>
+namespace dbxmd {
+
+// Returns true if a database of storage version `from_version` can be upgraded in place to
+// kDatabaseVersion, rather than being reset.
+bool db_can_migrate(const std::string& from_version);
+
+// Upgrades a database from `from_version` to kDatabaseVersion, writing the new version when done.
+// Migrations can be run again if interrupted.
+rx::Status db_migrate(leveldb::DB*, const std::string& from_version);
+
+} // namespace
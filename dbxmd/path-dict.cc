@@ -0,0 +1,68 @@
+#include "path-dict.hh"
+#include "keyspace.hh"
+
+namespace dbxmd {
+
+
+DocNum PathDict::read_docnum(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const string& ID)
+{
+  string v;
+  db->Get(read_options, kDocNumKeyPrefix + ID, &v);
+  return v.size() == kDocNumSize ? docnum_decode(v.data()) : 0;
+}
+
+
+string PathDict::read_path(leveldb::DB* db, const leveldb::ReadOptions& read_options, DocNum n) {
+  string path;
+  db->Get(read_options, kDocPathKeyPrefix + docnum_encode(n), &path);
+  return path;
+}
+
+
+DocNum PathDict::lookup(leveldb::DB* db, const string& ID) const {
+  auto I = _pending.find(ID);
+  if (I != _pending.end()) {
+    return I->second;
+  }
+  return read_docnum(db, leveldb::ReadOptions(), ID);
+}
+
+
+DocNum PathDict::assign(leveldb::DB* db, const string& ID, leveldb::WriteBatch& batch) {
+  auto n = lookup(db, ID);
+  if (n != 0) {
+    return n;
+  }
+
+  if (_next == 0) {
+    string v;
+    db->Get(leveldb::ReadOptions(), kNextDocNumKey, &v);
+    _next = v.size() == kDocNumSize ? docnum_decode(v.data()) : 1;
+  }
+  n = _next++;
+
+  auto encoded = docnum_encode(n);
+  batch.Put(kDocNumKeyPrefix + ID, encoded);
+  batch.Put(kDocPathKeyPrefix + encoded, ID);
+  batch.Put(kNextDocNumKey, docnum_encode(_next));
+  _pending[ID] = n;
+  return n;
+}
+
+
+void PathDict::remove(const string& ID, DocNum n, leveldb::WriteBatch& batch) {
+  batch.Delete(kDocNumKeyPrefix + ID);
+  batch.Delete(kDocPathKeyPrefix + docnum_encode(n));
+  _pending[ID] = 0;
+}
+
+
+void PathDict::reset_pending() {
+  _pending.clear();
+}
+
+
+} // namespace
@@ -0,0 +1,36 @@
+#pragma once
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <unordered_map>
+#include "doc.hh"
+namespace dbxmd {
+
+using std::string;
+
+// Maps file entry IDs (paths) to document numbers and back. Numbers are assigned as entries are
+// added and are never reused.
+struct PathDict {
+  // Returns the document number of ID, or 0 if it has none. Includes numbers assigned with
+  // assign() which have not yet been written.
+  DocNum lookup(leveldb::DB*, const string& ID) const;
+
+  // Returns the document number of ID, assigning a new number if needed. Any changes are added
+  // to batch.
+  DocNum assign(leveldb::DB*, const string& ID, leveldb::WriteBatch&);
+
+  // Removes ID's number. Changes are added to batch.
+  void remove(const string& ID, DocNum, leveldb::WriteBatch&);
+
+  // Must be called after a batch passed to assign() or remove() has been written or discarded
+  void reset_pending();
+
+  // Read a stored mapping. Returns 0 or an empty string if there is none.
+  static DocNum read_docnum(leveldb::DB*, const leveldb::ReadOptions&, const string& ID);
+  static string read_path(leveldb::DB*, const leveldb::ReadOptions&, DocNum);
+
+private:
+  DocNum _next = 0; // 0 until loaded
+  std::unordered_map<string, DocNum> _pending; // assigned or removed (0), but not yet written
+};
+
+} // namespace
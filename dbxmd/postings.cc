@@ -0,0 +1,407 @@
+#include "postings.hh"
+#include "varint.hh"
+#include "unittest.hh"
+#include <algorithm>
+#include <iostream>
+
+namespace dbxmd {
+
+
+void posting_block_encode(const Posting* begin, const Posting* end, string& out) {
+  varint_append(out, u64(end - begin));
+  DocNum prev = begin == end ? 0 : begin->docnum;
+  for (auto* p = begin; p != end; ++p) {
+    varint_append(out, p->docnum - prev);
+    prev = p->docnum;
+  }
+  for (auto* p = begin; p != end; ++p) {
+    varint_append(out, p->payload);
+  }
+}
+
+
+bool posting_block_decode(DocNum first, const leveldb::Slice& data, Postings& out) {
+  const char* p = data.data();
+  const char* end = p + data.size();
+  u64 n, v;
+  if (!varint_read(p, end, n) || n > u64(end - p)) {
+    return false;
+  }
+  size_t start = out.size();
+  out.resize(start + n);
+  DocNum docnum = first;
+  for (size_t i = start; i != out.size(); ++i) {
+    if (!varint_read(p, end, v)) {
+      out.resize(start);
+      return false;
+    }
+    docnum += DocNum(v);
+    out[i].docnum = docnum;
+  }
+  for (size_t i = start; i != out.size(); ++i) {
+    if (!varint_read(p, end, v)) {
+      out.resize(start);
+      return false;
+    }
+    out[i].payload = u32(v);
+  }
+  return true;
+}
+
+
+static string block_key(const string& block_prefix, DocNum first) {
+  string k;
+  k.reserve(block_prefix.size() + kDocNumSize);
+  k.append(block_prefix);
+  docnum_append(k, first);
+  return k;
+}
+
+
+// Positions `it` at the last block whose first document is numbered target or lower, or at the
+// first block if there's no such block. Returns false if the list has no blocks.
+static bool seek_block(leveldb::Iterator* it, const string& block_prefix, DocNum target) {
+  // Block keys are the prefix followed by exactly four bytes, so this is the smallest key which
+  // sorts after target's block key.
+  auto k = block_key(block_prefix, target);
+  k.push_back('\0');
+  it->Seek(k);
+  if (it->Valid()) {
+    it->Prev();
+  } else {
+    it->SeekToLast();
+  }
+  if (!it->Valid() || !it->key().starts_with(block_prefix)) {
+    it->Seek(block_prefix);
+  }
+  return it->Valid() && it->key().starts_with(block_prefix);
+}
+
+
+static DocNum block_first_docnum(const leveldb::Slice& key) {
+  return docnum_decode(key.data() + key.size() - kDocNumSize);
+}
+
+// ------------------------------------------------------------------------------------------------
+// PostingWriter
+
+void PostingWriter::add(const string& list, DocNum docnum, u32 payload) {
+  auto I = _lists[list].emplace(docnum, Change{false, payload});
+  if (!I.second) {
+    auto& change = I.first->second;
+    change.payload = change.remove ? payload : RX_MIN(change.payload, payload);
+    change.remove = false;
+  }
+}
+
+
+void PostingWriter::remove(const string& list, DocNum docnum) {
+  _lists[list][docnum] = Change{true, 0};
+}
+
+
+// Applies the changes in [c, c_end) to the sorted postings, returning the change in document count
+static i64 merge_changes(
+  Postings& postings,
+  PostingWriter::Changes::const_iterator c,
+  PostingWriter::Changes::const_iterator c_end)
+{
+  Postings merged;
+  merged.reserve(postings.size() + size_t(std::distance(c, c_end)));
+  i64 count_delta = 0;
+  auto p = postings.cbegin();
+  while (p != postings.cend() || c != c_end) {
+    if (c == c_end || (p != postings.cend() && p->docnum < c->first)) {
+      merged.push_back(*p++);
+    } else {
+      bool exists = p != postings.cend() && p->docnum == c->first;
+      if (!c->second.remove) {
+        merged.push_back(Posting{c->first, c->second.payload});
+        count_delta += exists ? 0 : 1;
+      } else {
+        count_delta -= exists ? 1 : 0;
+      }
+      if (exists) {
+        ++p;
+      }
+      ++c;
+    }
+  }
+  postings.swap(merged);
+  return count_delta;
+}
+
+
+i64 PostingWriter::merge(Postings& postings, const Changes& changes) {
+  return merge_changes(postings, changes.cbegin(), changes.cend());
+}
+
+
+size_t PostingWriter::flush(leveldb::DB* db, const string& key_prefix, leveldb::WriteBatch& batch) {
+  size_t batch_bytes = 0;
+  auto* it = db->NewIterator(leveldb::ReadOptions());
+  Postings postings;
+  std::vector<string> old_block_keys;
+  std::vector<string> block_keys;
+  string value;
+
+  for (auto& list : _lists) {
+    auto& changes = list.second;
+    auto list_key = key_prefix + list.first;
+    auto block_prefix = list_key + '\0';
+
+    // Read the document count
+    u64 count = 0;
+    if (db->Get(leveldb::ReadOptions(), list_key, &value).ok()) {
+      const char* p = value.data();
+      varint_read(p, p + value.size(), count);
+    }
+    i64 new_count = i64(count);
+
+    // Rewrite only the blocks that changes fall into, one run of blocks at a time. A change falls
+    // into the last block starting at or before it, or into the first block if it precedes them
+    // all, so that changes are merged into existing blocks rather than starting new ones.
+    for (auto c = changes.cbegin(); c != changes.cend(); ) {
+      postings.clear();
+      old_block_keys.clear();
+      bool has_block = seek_block(it, block_prefix, c->first);
+      while (has_block) {
+        if (!posting_block_decode(block_first_docnum(it->key()), it->value(), postings)) {
+          std::clog << "[dbxmd] malformed posting list block in \"" << list_key << "\""
+                    << std::endl;
+        }
+        old_block_keys.emplace_back(it->key().ToString());
+
+        // The block ends where the next one starts
+        it->Next();
+        has_block = it->Valid() && it->key().starts_with(block_prefix);
+        auto next = c;
+        if (has_block) {
+          auto next_first = block_first_docnum(it->key());
+          while (next != changes.cend() && next->first < next_first) {
+            ++next;
+          }
+        } else {
+          next = changes.cend();
+        }
+        new_count += merge_changes(postings, c, next);
+        c = next;
+
+        // Merge a block which shrank below half its size into the following block, rather than
+        // leaving lots of tiny blocks behind as documents are removed
+        if (postings.size() >= kPostingBlockSize / 2) {
+          break;
+        }
+      }
+      if (old_block_keys.empty()) {
+        // The list has no blocks yet
+        new_count += merge_changes(postings, c, changes.cend());
+        c = changes.cend();
+      }
+
+      // Write the merged blocks, splitting them if they grew past twice the block size, and delete
+      // any block whose key changed
+      block_keys.clear();
+      size_t nblocks = postings.size() <= kPostingBlockSize * 2 ? 1 :
+        (postings.size() + kPostingBlockSize - 1) / kPostingBlockSize;
+      size_t block_size = (postings.size() + nblocks - 1) / nblocks;
+      for (size_t i = 0; i < postings.size(); i += block_size) {
+        auto* begin = postings.data() + i;
+        auto* end = postings.data() + RX_MIN(i + block_size, postings.size());
+        block_keys.emplace_back(block_key(block_prefix, begin->docnum));
+        value.clear();
+        posting_block_encode(begin, end, value);
+        batch.Put(block_keys.back(), value);
+        batch_bytes += block_keys.back().size() + value.size();
+      }
+      for (auto& k : old_block_keys) {
+        if (std::find(block_keys.begin(), block_keys.end(), k) == block_keys.end()) {
+          batch.Delete(k);
+          batch_bytes += k.size();
+        }
+      }
+    }
+    count = new_count < 0 ? 0 : u64(new_count);
+
+    // Update the head, removing the list when it's empty
+    value.clear();
+    if (count == 0) {
+      batch.Delete(list_key);
+    } else {
+      varint_append(value, count);
+      batch.Put(list_key, value);
+    }
+    batch_bytes += list_key.size() + value.size();
+  }
+
+  delete it;
+  _lists.clear();
+  return batch_bytes;
+}
+
+// ------------------------------------------------------------------------------------------------
+// PostingCursor
+
+PostingCursor::PostingCursor(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const string& list_key)
+  : _it{db->NewIterator(read_options)}
+  , _block_prefix{list_key + '\0'}
+{
+  rewind();
+}
+
+
+void PostingCursor::rewind() {
+  _it->Seek(_block_prefix);
+  _loadBlock();
+}
+
+
+PostingCursor::~PostingCursor() {
+  delete _it;
+}
+
+
+bool PostingCursor::_loadBlock() {
+  _block.clear();
+  _i = 0;
+  while (_it->Valid() && _it->key().starts_with(_block_prefix)) {
+    if (posting_block_decode(block_first_docnum(_it->key()), _it->value(), _block) &&
+        !_block.empty())
+    {
+      return true;
+    }
+    _block.clear(); // malformed or empty; skip it
+    _it->Next();
+  }
+  return false;
+}
+
+
+void PostingCursor::next() {
+  if (++_i == _block.size()) {
+    _it->Next();
+    _loadBlock();
+  }
+}
+
+
+void PostingCursor::seek(DocNum target) {
+  if (!valid() || target <= docnum()) {
+    return;
+  }
+  if (target > _block.back().docnum) {
+    // Not in the current block. Find the block it would be in, which might end before target.
+    if (!seek_block(_it, _block_prefix, target) || !_loadBlock()) {
+      return;
+    }
+    while (_block.back().docnum < target) {
+      _it->Next();
+      if (!_loadBlock()) {
+        return;
+      }
+    }
+  }
+  _i = std::lower_bound(
+    _block.begin() + _i,
+    _block.end(),
+    target,
+    [](const Posting& p, DocNum target) { return p.docnum < target; }
+  ) - _block.begin();
+}
+
+
+u32 PostingCursor::count(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const string& list_key)
+{
+  string value;
+  u64 count = 0;
+  if (db->Get(read_options, list_key, &value).ok()) {
+    const char* p = value.data();
+    varint_read(p, p + value.size(), count);
+  }
+  return u32(count);
+}
+
+
+void posting_lists_foreach(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const string& key_prefix,
+  rx::func<bool(const leveldb::Slice& list_key, u32 count)> fn)
+{
+  auto* it = db->NewIterator(read_options);
+  it->Seek(key_prefix);
+  string skip_key;
+  while (it->Valid() && it->key().starts_with(key_prefix)) {
+    auto key = it->key();
+    if (memchr(key.data() + key_prefix.size(), '\0', key.size() - key_prefix.size()) != nullptr) {
+      // A block without a head
+      it->Next();
+      continue;
+    }
+    const char* p = it->value().data();
+    u64 count = 0;
+    varint_read(p, p + it->value().size(), count);
+    if (!fn(key, u32(count))) {
+      break;
+    }
+    // Skip past this list's blocks ("\1" follows "\0")
+    skip_key.assign(key.data(), key.size());
+    skip_key.push_back('\1');
+    it->Seek(skip_key);
+  }
+  delete it;
+}
+
+
+UNIT_TEST(postings, {
+  // (Aggregate initializers would be split up as macro arguments)
+  auto posting = [](DocNum docnum, u32 payload) {
+    Posting p; p.docnum = docnum; p.payload = payload; return p;
+  };
+  auto change = [](bool remove, u32 payload) {
+    PostingWriter::Change c; c.remove = remove; c.payload = payload; return c;
+  };
+
+  Postings postings;
+  for (DocNum n = 1; n < 2000; n += 7) {
+    postings.push_back(posting(n, n % 13));
+  }
+  string data;
+  posting_block_encode(postings.data(), postings.data() + postings.size(), data);
+  Postings decoded;
+  if (!posting_block_decode(1, data, decoded) || decoded.size() != postings.size()) {
+    throw test_failure("posting_block_decode failed");
+  }
+  for (size_t i = 0; i != postings.size(); ++i) {
+    if (decoded[i].docnum != postings[i].docnum || decoded[i].payload != postings[i].payload) {
+      throw test_failure("decoded posting differs");
+    }
+  }
+  decoded.clear();
+  if (posting_block_decode(1, data.substr(0, data.size() - 1), decoded)) {
+    throw test_failure("accepted truncated block");
+  }
+
+  PostingWriter::Changes changes;
+  changes[1] = change(true, 0);      // remove existing
+  changes[3] = change(true, 0);      // remove non-existing
+  changes[8] = change(false, 5);     // update existing
+  changes[9] = change(false, 6);     // add
+  changes[5000] = change(false, 7);  // add past the end
+  auto count = postings.size();
+  count += PostingWriter::merge(postings, changes);
+  if (count != postings.size() || postings.front().docnum != 8 ||
+      postings.front().payload != 5 || postings[1].docnum != 9 || postings.back().docnum != 5000)
+  {
+    throw test_failure("unexpected result of PostingWriter::merge");
+  }
+})
+
+
+} // namespace
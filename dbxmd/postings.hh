@@ -0,0 +1,101 @@
+#pragma once
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <map>
+#include <vector>
+#include "doc.hh"
+namespace dbxmd {
+
+using std::string;
+
+// Posting lists map a list key (e.g. a search term) to the set of documents it occurs in, each
+// document with a small integer payload (e.g. a rank). A list is stored as a head holding the
+// number of documents in the list, followed by blocks of documents in document number order:
+//
+//   <list>                       => count:varint
+//   <list> \0 <first docnum:u32> => n:varint delta:varint{n} payload:varint{n}
+//
+// Each delta is relative to the previous document number in the block, the first one relative to
+// the block's first document number (i.e. it is always 0.) The block keys double as a skip table:
+// finding a document means seeking to the block it would be in rather than decoding the list.
+struct Posting {
+  DocNum docnum;
+  u32    payload;
+};
+using Postings = std::vector<Posting>;
+
+// Blocks are split at this many postings. Merging changes can grow a block to at most twice this
+// before it's split.
+static const size_t kPostingBlockSize = 128;
+
+// Encode or decode a block. Decoding appends to out, and appends nothing and returns false if
+// data is malformed.
+void posting_block_encode(const Posting* begin, const Posting* end, string& out);
+bool posting_block_decode(DocNum first, const leveldb::Slice& data, Postings& out);
+
+
+// Collects changes to posting lists and merges them into the stored lists, rewriting only the
+// blocks that the changes fall into.
+struct PostingWriter {
+  // If a document is added to the same list more than once, the lowest payload is kept
+  void add(const string& list, DocNum, u32 payload);
+  void remove(const string& list, DocNum);
+  bool empty() const { return _lists.empty(); }
+
+  // Merges all pending changes into the lists stored in db under key_prefix, adding the changes
+  // to batch. Pending changes are cleared. Returns the approximate number of bytes added to batch.
+  size_t flush(leveldb::DB*, const string& key_prefix, leveldb::WriteBatch&);
+
+  struct Change {
+    bool remove;
+    u32  payload;
+  };
+  using Changes = std::map<DocNum, Change>;
+
+  // Applies changes to the sorted postings, returning the change in document count
+  static i64 merge(Postings&, const Changes&);
+
+private:
+  std::map<string, Changes> _lists;
+};
+
+
+// Reads a posting list in document number order
+struct PostingCursor {
+  PostingCursor(leveldb::DB*, const leveldb::ReadOptions&, const string& list_key);
+  ~PostingCursor();
+
+  bool valid() const { return _i < _block.size(); }
+  DocNum docnum() const { return _block[_i].docnum; }
+  u32 payload() const { return _block[_i].payload; }
+  void next();
+
+  // Moves to the first document numbered target or higher
+  void seek(DocNum target);
+
+  // Moves back to the first document
+  void rewind();
+
+  // Number of documents in the list
+  static u32 count(leveldb::DB*, const leveldb::ReadOptions&, const string& list_key);
+
+private:
+  PostingCursor(const PostingCursor&) = delete;
+  bool _loadBlock();
+
+  leveldb::Iterator* _it;
+  string             _block_prefix; // "<list>\0"
+  Postings           _block;
+  size_t             _i = 0;
+};
+
+
+// Invokes fn with the key and document count of each list whose key starts with key_prefix, in key
+// order. fn should return false to stop.
+void posting_lists_foreach(
+  leveldb::DB*,
+  const leveldb::ReadOptions&,
+  const string& key_prefix,
+  rx::func<bool(const leveldb::Slice& list_key, u32 count)> fn);
+
+} // namespace
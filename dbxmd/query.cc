@@ -0,0 +1,544 @@
+#include "query.hh"
+#include "unittest.hh"
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace dbxmd {
+
+// When one array is this many times larger than the other, intersect by looking up each element
+// of the smaller one in the larger one rather than by merging
+static const size_t kGallopRatio = 32;
+
+
+// Returns the index of the first element in [first, n) which is target or higher, searching
+// forward from first with exponentially growing steps
+static size_t gallop(const DocNum* v, size_t first, size_t n, DocNum target) {
+  if (first >= n || v[first] >= target) {
+    return first;
+  }
+  size_t lo = first, step = 1;
+  size_t hi = first + step;
+  while (hi < n && v[hi] < target) {
+    lo = hi;
+    step *= 2;
+    hi = first + step;
+  }
+  return std::lower_bound(v + lo + 1, v + RX_MIN(hi, n), target) - v;
+}
+
+
+static size_t intersect_scalar(
+  const DocNum* a, size_t na, size_t i,
+  const DocNum* b, size_t nb, size_t j,
+  u32* out, size_t n)
+{
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      out[n++] = u32(i);
+      ++i;
+      ++j;
+    }
+  }
+  return n;
+}
+
+
+size_t intersect_sorted(const DocNum* a, size_t na, const DocNum* b, size_t nb, u32* out) {
+  size_t n = 0;
+
+  if (na * kGallopRatio < nb) {
+    for (size_t i = 0, j = 0; i < na && j < nb; ++i) {
+      j = gallop(b, j, nb, a[i]);
+      if (j < nb && b[j] == a[i]) {
+        out[n++] = u32(i);
+      }
+    }
+    return n;
+  }
+  if (nb * kGallopRatio < na) {
+    for (size_t i = 0, j = 0; i < na && j < nb; ++j) {
+      i = gallop(a, i, na, b[j]);
+      if (i < na && a[i] == b[j]) {
+        out[n++] = u32(i);
+      }
+    }
+    return n;
+  }
+
+  size_t i = 0, j = 0;
+#if defined(__SSE2__)
+  // Compare four elements of a with four of b at a time: each element of a is compared with every
+  // rotation of b's four. Whichever block ends lower is then done with, since all its elements are
+  // lower than those of the other block's successors.
+  while (i + 4 <= na && j + 4 <= nb) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+    __m128i m = _mm_or_si128(
+      _mm_or_si128(
+        _mm_cmpeq_epi32(va, vb),
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+      _mm_or_si128(
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+    while (mask != 0) {
+      out[n++] = u32(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+    DocNum amax = a[i + 3], bmax = b[j + 3];
+    if (amax <= bmax) {
+      i += 4;
+    }
+    if (bmax <= amax) {
+      j += 4;
+    }
+  }
+#endif
+  return intersect_scalar(a, na, i, b, nb, j, out, n);
+}
+
+// ------------------------------------------------------------------------------------------------
+// DocArray
+
+DocArray DocArray::read(DocStream& s) {
+  DocArray a;
+  a.docnums.reserve(s.cost());
+  a.payloads.reserve(s.cost());
+  for (; s.valid(); s.next()) {
+    a.push_back(s.docnum(), s.payload());
+  }
+  return a;
+}
+
+
+void DocArray::intersect(const DocArray& other) {
+  std::vector<u32> common(RX_MIN(size(), other.size()));
+  size_t n = intersect_sorted(
+    docnums.data(), docnums.size(), other.docnums.data(), other.docnums.size(), common.data());
+  for (size_t k = 0; k != n; ++k) {
+    docnums[k] = docnums[common[k]];
+    payloads[k] = payloads[common[k]];
+  }
+  docnums.resize(n);
+  payloads.resize(n);
+}
+
+
+void DocArray::subtract(const DocArray& other) {
+  std::vector<u32> common(RX_MIN(size(), other.size()));
+  size_t n = intersect_sorted(
+    docnums.data(), docnums.size(), other.docnums.data(), other.docnums.size(), common.data());
+  size_t out = 0;
+  for (size_t i = 0, k = 0; i != docnums.size(); ++i) {
+    if (k != n && common[k] == i) {
+      ++k;
+      continue;
+    }
+    docnums[out] = docnums[i];
+    payloads[out] = payloads[i];
+    ++out;
+  }
+  docnums.resize(out);
+  payloads.resize(out);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Streams
+
+struct PostingStream : DocStream {
+  PostingStream(
+    leveldb::DB* db, const leveldb::ReadOptions& read_options, const string& list_key, size_t count)
+    : _cursor{db, read_options, list_key}, _count{count} {}
+
+  bool valid() const { return _cursor.valid(); }
+  DocNum docnum() const { return _cursor.docnum(); }
+  u32 payload() const { return _cursor.payload(); }
+  void next() { _cursor.next(); }
+  void seek(DocNum target) { _cursor.seek(target); }
+  void rewind() { _cursor.rewind(); }
+  size_t cost() const { return _count; }
+
+private:
+  PostingCursor _cursor;
+  size_t        _count;
+};
+
+
+struct ArrayStream : DocStream {
+  ArrayStream(DocArray a) : _a{std::move(a)} {}
+
+  bool valid() const { return _i < _a.size(); }
+  DocNum docnum() const { return _a.docnums[_i]; }
+  u32 payload() const { return _a.payloads[_i]; }
+  void next() { ++_i; }
+  void seek(DocNum target) { _i = gallop(_a.docnums.data(), _i, _a.size(), target); }
+  void rewind() { _i = 0; }
+  size_t cost() const { return _a.size(); }
+  const DocArray* array() const { return &_a; }
+
+private:
+  DocArray _a;
+  size_t   _i = 0;
+};
+
+
+struct SpanStream : DocStream {
+  SpanStream(const DocNum* docnums, const u32* payloads, size_t size)
+    : _docnums{docnums}, _payloads{payloads}, _size{size} {}
+
+  bool valid() const { return _i < _size; }
+  DocNum docnum() const { return _docnums[_i]; }
+  u32 payload() const { return _payloads[_i]; }
+  void next() { ++_i; }
+  void seek(DocNum target) { _i = gallop(_docnums, _i, _size, target); }
+  void rewind() { _i = 0; }
+  size_t cost() const { return _size; }
+
+private:
+  const DocNum* _docnums;
+  const u32*    _payloads;
+  size_t        _size;
+  size_t        _i = 0;
+};
+
+
+struct UnionStream : DocStream {
+  UnionStream(DocStreams streams) : _streams{std::move(streams)} { rewind(); }
+
+  bool valid() const { return !_current.empty(); }
+  DocNum docnum() const { return _docnum; }
+  u32 payload() const { return _payload; }
+
+  void next() {
+    for (auto* s : _current) {
+      s->next();
+      _push(s);
+    }
+    _pop();
+  }
+
+  void seek(DocNum target) {
+    if (!valid() || target <= _docnum) {
+      return;
+    }
+    for (auto* s : _current) {
+      _heap.push_back(s);
+    }
+    for (auto* s : _heap) {
+      s->seek(target);
+    }
+    _heap.erase(std::remove_if(_heap.begin(), _heap.end(), [](DocStream* s) {
+      return !s->valid();
+    }), _heap.end());
+    std::make_heap(_heap.begin(), _heap.end(), _greater);
+    _pop();
+  }
+
+  void rewind() {
+    _heap.clear();
+    _current.clear();
+    for (auto& s : _streams) {
+      s->rewind();
+      _push(s.get());
+    }
+    _pop();
+  }
+
+  size_t cost() const {
+    size_t n = 0;
+    for (auto& s : _streams) {
+      n += s->cost();
+    }
+    return n;
+  }
+
+private:
+  static bool _greater(DocStream* a, DocStream* b) { return a->docnum() > b->docnum(); }
+
+  void _push(DocStream* s) {
+    if (s->valid()) {
+      _heap.push_back(s);
+      std::push_heap(_heap.begin(), _heap.end(), _greater);
+    }
+  }
+
+  // Moves all streams at the lowest document from the heap to _current
+  void _pop() {
+    _current.clear();
+    while (!_heap.empty() && (_current.empty() || _heap.front()->docnum() == _docnum)) {
+      auto* s = _heap.front();
+      std::pop_heap(_heap.begin(), _heap.end(), _greater);
+      _heap.pop_back();
+      if (_current.empty() || s->payload() < _payload) {
+        _payload = s->payload();
+      }
+      _docnum = s->docnum();
+      _current.push_back(s);
+    }
+  }
+
+  DocStreams              _streams;
+  std::vector<DocStream*> _heap;    // streams positioned after the current document
+  std::vector<DocStream*> _current; // streams positioned at the current document
+  DocNum                  _docnum = 0;
+  u32                     _payload = 0;
+};
+
+
+struct AndStream : DocStream {
+  AndStream(DocStreams streams) : _streams{std::move(streams)} {
+    // Lead with the rarest stream, as each document of the leading stream is looked up in the
+    // others. Payloads come from the first stream.
+    _primary = _streams.front().get();
+    std::sort(_streams.begin(), _streams.end(), [](const DocStreamPtr& a, const DocStreamPtr& b) {
+      return a->cost() < b->cost();
+    });
+    _align();
+  }
+
+  bool valid() const { return _valid; }
+  DocNum docnum() const { return _docnum; }
+  u32 payload() const { return _primary->payload(); }
+  void next() { _streams.front()->next(); _align(); }
+
+  void seek(DocNum target) {
+    if (_valid && target > _docnum) {
+      _streams.front()->seek(target);
+      _align();
+    }
+  }
+
+  void rewind() {
+    for (auto& s : _streams) {
+      s->rewind();
+    }
+    _align();
+  }
+
+  size_t cost() const { return _streams.front()->cost(); }
+
+private:
+  // Advances all streams to the next document which they all have ("leapfrogging")
+  void _align() {
+    _valid = false;
+    if (!_streams.front()->valid()) {
+      return;
+    }
+    DocNum target = _streams.front()->docnum();
+    for (;;) {
+      bool all_match = true;
+      for (auto& s : _streams) {
+        s->seek(target);
+        if (!s->valid()) {
+          return;
+        }
+        if (s->docnum() != target) {
+          target = s->docnum();
+          all_match = false;
+          break;
+        }
+      }
+      if (all_match) {
+        _valid = true;
+        _docnum = target;
+        return;
+      }
+    }
+  }
+
+  DocStreams _streams;
+  DocStream* _primary;
+  bool       _valid = false;
+  DocNum     _docnum = 0;
+};
+
+
+struct AndNotStream : DocStream {
+  AndNotStream(DocStreamPtr include, DocStreamPtr exclude)
+    : _include{std::move(include)}, _exclude{std::move(exclude)} { _skip(); }
+
+  bool valid() const { return _include->valid(); }
+  DocNum docnum() const { return _include->docnum(); }
+  u32 payload() const { return _include->payload(); }
+  void next() { _include->next(); _skip(); }
+  void seek(DocNum target) { _include->seek(target); _skip(); }
+  void rewind() { _include->rewind(); _exclude->rewind(); _skip(); }
+  size_t cost() const { return _include->cost(); }
+
+private:
+  // Skips excluded documents. Only the part of `exclude` around included documents is read.
+  void _skip() {
+    while (_include->valid()) {
+      _exclude->seek(_include->docnum());
+      if (!_exclude->valid() || _exclude->docnum() != _include->docnum()) {
+        break;
+      }
+      _include->next();
+    }
+  }
+
+  DocStreamPtr _include;
+  DocStreamPtr _exclude;
+};
+
+
+struct FilterStream : DocStream {
+  FilterStream(DocStreamPtr stream, rx::func<bool(DocNum)> fn)
+    : _stream{std::move(stream)}, _fn{std::move(fn)} { _skip(); }
+
+  bool valid() const { return _stream->valid(); }
+  DocNum docnum() const { return _stream->docnum(); }
+  u32 payload() const { return _stream->payload(); }
+  void next() { _stream->next(); _skip(); }
+  void seek(DocNum target) {
+    if (valid() && target > docnum()) {
+      _stream->seek(target);
+      _skip();
+    }
+  }
+  void rewind() { _stream->rewind(); _skip(); }
+  size_t cost() const { return _stream->cost(); }
+
+private:
+  void _skip() {
+    while (_stream->valid() && !_fn(_stream->docnum())) {
+      _stream->next();
+    }
+  }
+
+  DocStreamPtr           _stream;
+  rx::func<bool(DocNum)> _fn;
+};
+
+
+DocStreamPtr posting_stream(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const string& list_key,
+  size_t count)
+{
+  return DocStreamPtr{new PostingStream{db, read_options, list_key, count}};
+}
+
+
+DocStreamPtr array_stream(DocArray a) {
+  return DocStreamPtr{new ArrayStream{std::move(a)}};
+}
+
+
+DocStreamPtr array_stream(const DocNum* docnums, const u32* payloads, size_t size) {
+  return DocStreamPtr{new SpanStream{docnums, payloads, size}};
+}
+
+
+DocStreamPtr union_stream(DocStreams streams) {
+  if (streams.size() == 1) {
+    return std::move(streams.front());
+  }
+  return DocStreamPtr{new UnionStream{std::move(streams)}};
+}
+
+
+DocStreamPtr and_stream(DocStreams streams) {
+  if (streams.size() == 1) {
+    return std::move(streams.front());
+  }
+  bool all_arrays = true;
+  for (auto& s : streams) {
+    all_arrays = all_arrays && s->array() != nullptr;
+  }
+  if (!all_arrays) {
+    return DocStreamPtr{new AndStream{std::move(streams)}};
+  }
+  // Everything is in memory already, so intersect the arrays directly, smallest first
+  auto a = *streams.front()->array();
+  std::sort(streams.begin() + 1, streams.end(), [](const DocStreamPtr& a, const DocStreamPtr& b) {
+    return a->cost() < b->cost();
+  });
+  for (size_t i = 1; i != streams.size() && a.size() != 0; ++i) {
+    a.intersect(*streams[i]->array());
+  }
+  return array_stream(std::move(a));
+}
+
+
+DocStreamPtr and_not_stream(DocStreamPtr include, DocStreamPtr exclude) {
+  if (include->array() != nullptr && exclude->array() != nullptr) {
+    auto a = *include->array();
+    a.subtract(*exclude->array());
+    return array_stream(std::move(a));
+  }
+  return DocStreamPtr{new AndNotStream{std::move(include), std::move(exclude)}};
+}
+
+
+DocStreamPtr filter_stream(DocStreamPtr stream, rx::func<bool(DocNum)> fn) {
+  return DocStreamPtr{new FilterStream{std::move(stream), std::move(fn)}};
+}
+
+
+UNIT_TEST(query, {
+  // Compare against std::set_intersection, with sizes up to 4681 covering the SIMD, scalar tail
+  // and galloping (e.g. 73 vs 4681) paths
+  auto make_array = [](size_t n, DocNum stride, DocNum offset) {
+    DocArray a;
+    for (DocNum i = 0; i != n; ++i) {
+      a.push_back(offset + i * stride + (i % 3), i);
+    }
+    return a;
+  };
+  for (size_t na = 0; na < 5000; na = na * 8 + 1) {
+    for (size_t nb = 0; nb < 5000; nb = nb * 8 + 1) {
+      auto a = make_array(na, 3, 1);
+      auto b = make_array(nb, 5, 2);
+      std::vector<DocNum> expected;
+      std::set_intersection(
+        a.docnums.begin(), a.docnums.end(), b.docnums.begin(), b.docnums.end(),
+        std::back_inserter(expected));
+      auto c = a;
+      c.intersect(b);
+      if (c.docnums != expected) {
+        throw test_failure("DocArray::intersect result differs from std::set_intersection");
+      }
+      auto d = a;
+      d.subtract(b);
+      if (d.size() + c.size() != a.size()) {
+        throw test_failure("DocArray::subtract result has the wrong size");
+      }
+
+      // The same using streams, which leapfrog rather than merge
+      DocStreams streams;
+      streams.emplace_back(new ArrayStream{a});
+      streams.emplace_back(new ArrayStream{b});
+      DocStreamPtr s{new AndStream{std::move(streams)}};
+      auto e = DocArray::read(*s);
+      if (e.docnums != expected || e.payloads != c.payloads) {
+        throw test_failure("AndStream result differs from std::set_intersection");
+      }
+      s.reset(new AndNotStream{array_stream(a), DocStreamPtr{new UnionStream{[&]{
+        DocStreams u;
+        u.emplace_back(array_stream(b));
+        u.emplace_back(array_stream(make_array(nb, 5, 2)));
+        return u;
+      }()}}});
+      if (DocArray::read(*s).docnums != d.docnums) {
+        throw test_failure("AndNotStream result differs from DocArray::subtract");
+      }
+      s = filter_stream(array_stream(a), [&](DocNum docnum) {
+        return std::binary_search(b.docnums.begin(), b.docnums.end(), docnum);
+      });
+      if (DocArray::read(*s).docnums != expected) {
+        throw test_failure("FilterStream result differs from std::set_intersection");
+      }
+    }
+  }
+})
+
+
+} // namespace
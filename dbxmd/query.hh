@@ -0,0 +1,89 @@
+#pragma once
+#include <leveldb/db.h>
+#include <memory>
+#include <vector>
+#include "postings.hh"
+namespace dbxmd {
+
+struct DocArray;
+
+// Queries are evaluated over streams of documents in document number order. Streams can skip
+// ahead with seek(), which lets an intersection jump over the documents that can't match rather
+// than reading them, e.g. ANDing a rare term with a common one reads only the blocks of the common
+// term's list which the rare term's documents fall into.
+struct DocStream {
+  virtual ~DocStream() {}
+  virtual bool valid() const = 0;
+  virtual DocNum docnum() const = 0;
+  virtual u32 payload() const = 0;
+  virtual void next() = 0;
+
+  // Moves to the first document numbered target or higher. Never moves backwards.
+  virtual void seek(DocNum target) = 0;
+
+  // Moves back to the first document
+  virtual void rewind() = 0;
+
+  // Estimated number of documents in the stream
+  virtual size_t cost() const = 0;
+
+  // The documents of an in-memory stream, or nullptr
+  virtual const DocArray* array() const { return nullptr; }
+};
+
+using DocStreamPtr = std::unique_ptr<DocStream>;
+using DocStreams = std::vector<DocStreamPtr>;
+
+
+// Documents in memory, in document number order. Document numbers and payloads are kept in
+// separate arrays so that document numbers can be compared several at a time.
+struct DocArray {
+  std::vector<DocNum> docnums;
+  std::vector<u32>    payloads;
+
+  size_t size() const { return docnums.size(); }
+  void push_back(DocNum docnum, u32 payload) {
+    docnums.push_back(docnum);
+    payloads.push_back(payload);
+  }
+
+  // Reads all documents of a stream
+  static DocArray read(DocStream&);
+
+  // Keeps only the documents which are also in other, or which are not
+  void intersect(const DocArray& other);
+  void subtract(const DocArray& other);
+};
+
+
+// Finds the elements which are in both a and b, which must each be sorted and free of duplicates.
+// Writes the indexes of the common elements in a to out, which must have room for min(na, nb)
+// indexes, and returns the number of common elements.
+size_t intersect_sorted(const DocNum* a, size_t na, const DocNum* b, size_t nb, u32* out);
+
+
+// The documents of a posting list
+DocStreamPtr posting_stream(
+  leveldb::DB*, const leveldb::ReadOptions&, const string& list_key, size_t count);
+
+// The documents of an array
+DocStreamPtr array_stream(DocArray);
+
+// The documents of arrays which outlive the stream, e.g. in a memory-mapped file
+DocStreamPtr array_stream(const DocNum* docnums, const u32* payloads, size_t size);
+
+// Documents which are in any of the streams. A document's payload is the lowest of its payloads.
+DocStreamPtr union_stream(DocStreams);
+
+// Documents which are in all of the streams. Payloads are those of the first stream.
+DocStreamPtr and_stream(DocStreams);
+
+// Documents which are in `include` but not in `exclude`
+DocStreamPtr and_not_stream(DocStreamPtr include, DocStreamPtr exclude);
+
+// Documents of a stream for which fn returns true. fn is only called for documents which the
+// stream reaches, so this is a way of checking ("probing") a few documents for something which
+// would be expensive to read as a stream.
+DocStreamPtr filter_stream(DocStreamPtr, rx::func<bool(DocNum)> fn);
+
+} // namespace
@@ -16,7 +16,7 @@ using std::string;
 
 static const string kReverseKeyPrefix{"keys:"};
 static const string kModifiedKeyPrefix{"modified:"};
-static const string kVersion{"3"};
+static const string kVersion{"5"};
 
 
 const string& RecentsIndex::version() const { return kVersion; }
@@ -39,39 +39,40 @@ static string parseDropboxDate(const string& date) {
     ts.reserve(20);
     ts.resize(19);
     auto t = mktime(&tm);
-    auto* tmutc = gmtime(&t);
+    struct tm tmutc; // not gmtime(), as map() runs on several threads at once
+    gmtime_r(&t, &tmutc);
 
     // 2015-01-23 22:15:17
-    strftime((char*)ts.data(), 20, "%Y-%m-%d %H:%M:%S", tmutc);
+    strftime((char*)ts.data(), 20, "%Y-%m-%d %H:%M:%S", &tmutc);
     return ts;
   }
   return string{};
 }
 
 
-void RecentsIndex::map(const string& ID, const Json& json) {
-  if (json["is_dir"].bool_value()) {
+void RecentsIndex::map(const string& ID, DocNum docnum, const Record& record) {
+  if (record[RecordField::IsDir].bool_value()) {
     // Don't index directories because they all have empty modifiers, even for
     // directories modified by others. Basically, we can't tell who modified what.
     return;
   }
-  auto& modifier = json["modifier"];
+  auto idToEntryMetaKey = "id-to-entry:" + docnum_encode(docnum);
+  auto modifier = record[RecordField::Modifier];
   if (modifier.is_null() ||
-      std::to_string(int64_t(modifier["uid"].number_value())) == dropbox().uid())
+      std::to_string(int64_t(modifier[RecordField::UID].number_value())) == dropbox().uid())
   {
-    // Modified by viewer
-    auto timeSerial = parseDropboxDate(json["modified"].string_value());
-    auto entryKey = timeSerial + '\t' + json["rev"].string_value();
-
-    // See if we should ignore or replace/create an entry
-    auto idToEntryMetaKey = "id-to-entry:" + ID;
+    // Modified by viewer. An entry modified again is mapped to a new key, and its previous key is
+    // removed.
+    auto timeSerial = parseDropboxDate(record[RecordField::Modified].string_value().ToString());
+    auto entryKey = timeSerial + '\t' + record[RecordField::Rev].string_value().ToString();
+    emit(entryKey, ID); // Note: value is the path, as Iterator::entryValue expects
+    putMeta(idToEntryMetaKey, entryKey);
+  } else {
+    // Modified by someone else. Keep the viewer's last modification, if any.
     auto existingEntryKey = getMeta(idToEntryMetaKey);
-    if (existingEntryKey.empty() || existingEntryKey != entryKey) {
-      if (!existingEntryKey.empty()) {
-        remove(existingEntryKey);
-      }
-      emit(entryKey, ID);
-      putMeta(idToEntryMetaKey, entryKey);
+    if (!existingEntryKey.empty()) {
+      emit(existingEntryKey, ID);
+      putMeta(idToEntryMetaKey, existingEntryKey);
     }
   }
 }
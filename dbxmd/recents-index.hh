@@ -8,7 +8,7 @@ struct RecentsIndex : Index {
   static RecentsIndex* sharedInstance();
   RecentsIndex() : Index{"recents"} {}
   const string& version() const;
-  void map(const string& path, const Json&);
+  void map(const string& path, DocNum, const Record&);
 
   Iterator newIterator(leveldb::DB*) const;
 };
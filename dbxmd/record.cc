@@ -0,0 +1,527 @@
+#include "record.hh"
+#include "varint.hh"
+#include "json-reader.hh"
+#include "unittest.hh"
+#include <cmath>
+#include <cstring>
+
+namespace dbxmd {
+
+static const char* kFieldNames[] = {
+  "",
+  "bytes",
+  "client_mtime",
+  "icon",
+  "is_dir",
+  "mime_type",
+  "modified",
+  "modifier",
+  "parent_shared_folder_id",
+  "path",
+  "read_only",
+  "rev",
+  "revision",
+  "root",
+  "size",
+  "thumb_exists",
+  "display_name",
+  "same_team",
+  "uid",
+  "email",
+  "photo_info",
+  "lat_long",
+  "time_taken",
+  "video_info",
+  "duration",
+  "shared_folder",
+  "is_deleted",
+  "hash",
+  "contents",
+};
+
+static_assert(sizeof(kFieldNames) / sizeof(*kFieldNames) == size_t(RecordField::_Count),
+  "kFieldNames out of sync with RecordField");
+
+
+const char* Record::field_name(RecordField f) {
+  return size_t(f) < size_t(RecordField::_Count) ? kFieldNames[size_t(f)] : "";
+}
+
+
+static RecordField field_for_name(const leveldb::Slice& name) {
+  static const struct Names {
+    leveldb::Slice names[size_t(RecordField::_Count)];
+    Names() {
+      for (size_t i = 0; i != size_t(RecordField::_Count); ++i) {
+        names[i] = leveldb::Slice{kFieldNames[i]};
+      }
+    }
+  } names;
+  for (size_t i = 1; i != size_t(RecordField::_Count); ++i) {
+    if (names.names[i] == name) {
+      return RecordField(i);
+    }
+  }
+  return RecordField::Named;
+}
+
+
+// ------------------------------------------------------------------------------------------------
+// Encoding
+
+static void put_str(string& out, const leveldb::Slice& s) {
+  varint_append(out, s.size());
+  out.append(s.data(), s.size());
+}
+
+
+static void encode_number(double d, string& out) {
+  if (d == std::floor(d) && std::fabs(d) < 9007199254740992.0 && !std::signbit(d)) {
+    out.push_back(RecordValue::UInt);
+    varint_append(out, u64(d));
+  } else if (d == std::floor(d) && std::fabs(d) < 9007199254740992.0 && d != 0.0) {
+    out.push_back(RecordValue::NegInt);
+    varint_append(out, u64(-d) - 1);
+  } else {
+    u64 bits;
+    memcpy(&bits, &d, sizeof(bits));
+    out.push_back(RecordValue::Double);
+    for (size_t i = 0; i != 8; ++i) {
+      out.push_back(char(bits >> (i * 8)));
+    }
+  }
+}
+
+
+static void encode_value(const Json& json, string& out);
+
+
+static void encode_fields(const Json::object& fields, string& out) {
+  for (auto& field : fields) {
+    auto tag = field_for_name(field.first);
+    varint_append(out, u64(tag));
+    if (tag == RecordField::Named) {
+      put_str(out, field.first);
+    }
+    encode_value(field.second, out);
+  }
+}
+
+
+static void encode_value(const Json& json, string& out) {
+  switch (json.type()) {
+    case Json::NUL: {
+      out.push_back(RecordValue::Null);
+      break;
+    }
+    case Json::BOOL: {
+      out.push_back(json.bool_value() ? RecordValue::True : RecordValue::False);
+      break;
+    }
+    case Json::NUMBER: {
+      encode_number(json.number_value(), out);
+      break;
+    }
+    case Json::STRING: {
+      out.push_back(RecordValue::String);
+      put_str(out, json.string_value());
+      break;
+    }
+    case Json::ARRAY: {
+      string items;
+      for (auto& item : json.array_items()) {
+        encode_value(item, items);
+      }
+      out.push_back(RecordValue::Array);
+      put_str(out, items);
+      break;
+    }
+    case Json::OBJECT: {
+      string fields;
+      encode_fields(json.object_items(), fields);
+      out.push_back(RecordValue::Object);
+      put_str(out, fields);
+      break;
+    }
+  }
+}
+
+
+void Record::encode(const Json& json, string& out) {
+  out.push_back(char(kRecordFormatVersion));
+  encode_fields(json.object_items(), out);
+}
+
+
+string Record::encode(const Json& json) {
+  string out;
+  encode(json, out);
+  return out;
+}
+
+
+// Encoding from a JsonReader. Arrays and objects are written in place and their length is
+// inserted in front of them once they end, as it isn't known until then.
+
+static bool encode_fields(JsonReader&, string& out);
+
+static void insert_length(string& out, size_t start) {
+  char buf[10];
+  size_t n = 0;
+  for (u64 v = out.size() - start; ; v >>= 7) {
+    buf[n++] = char(v < 0x80 ? v : (v | 0x80));
+    if (v < 0x80) {
+      break;
+    }
+  }
+  out.insert(start, buf, n);
+}
+
+
+static bool encode_value(JsonReader& reader, JsonReader::Token token, string& out) {
+  switch (token) {
+    case JsonReader::Null: {
+      out.push_back(RecordValue::Null);
+      return true;
+    }
+    case JsonReader::False:
+    case JsonReader::True: {
+      out.push_back(token == JsonReader::True ? RecordValue::True : RecordValue::False);
+      return true;
+    }
+    case JsonReader::Number: {
+      encode_number(reader.number_value(), out);
+      return true;
+    }
+    case JsonReader::String: {
+      out.push_back(RecordValue::String);
+      put_str(out, reader.string_value());
+      return true;
+    }
+    case JsonReader::BeginArray: {
+      out.push_back(RecordValue::Array);
+      size_t start = out.size();
+      for (token = reader.next(); token != JsonReader::EndArray; token = reader.next()) {
+        if (!encode_value(reader, token, out)) {
+          return false;
+        }
+      }
+      insert_length(out, start);
+      return true;
+    }
+    case JsonReader::BeginObject: {
+      out.push_back(RecordValue::Object);
+      size_t start = out.size();
+      if (!encode_fields(reader, out)) {
+        return false;
+      }
+      insert_length(out, start);
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+
+static bool encode_fields(JsonReader& reader, string& out) {
+  for (auto token = reader.next(); token != JsonReader::EndObject; token = reader.next()) {
+    if (token != JsonReader::Key) {
+      return false;
+    }
+    auto tag = field_for_name(reader.string_value());
+    varint_append(out, u64(tag));
+    if (tag == RecordField::Named) {
+      put_str(out, reader.string_value());
+    }
+    if (!encode_value(reader, reader.next(), out)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool Record::encode(JsonReader& reader, string& out) {
+  out.push_back(char(kRecordFormatVersion));
+  return encode_fields(reader, out);
+}
+
+
+// ------------------------------------------------------------------------------------------------
+// Decoding
+
+// Reads from p, advancing it. All reads are bounds-checked against end.
+struct RecordReader {
+  const char* p;
+  const char* end;
+
+  RecordReader(const leveldb::Slice& s) : p{s.data()}, end{s.data() + s.size()} {}
+
+  bool done() const { return p >= end; }
+
+  bool varint(u64& v) {
+    return varint_read(p, end, v);
+  }
+
+  bool bytes(leveldb::Slice& s) {
+    u64 len;
+    if (!varint(len) || len > u64(end - p)) {
+      return false;
+    }
+    s = leveldb::Slice{p, size_t(len)};
+    p += len;
+    return true;
+  }
+
+  bool value(RecordValue& v) {
+    if (p >= end) {
+      return false;
+    }
+    auto type = RecordValue::Type(*p++);
+    const char* start = p;
+    switch (type) {
+      case RecordValue::Null:
+      case RecordValue::False:
+      case RecordValue::True: {
+        v = RecordValue{type, leveldb::Slice{}};
+        return true;
+      }
+      case RecordValue::UInt:
+      case RecordValue::NegInt: {
+        u64 n;
+        if (!varint(n)) return false;
+        v = RecordValue{type, leveldb::Slice{start, size_t(p - start)}};
+        return true;
+      }
+      case RecordValue::Double: {
+        if (end - p < 8) return false;
+        p += 8;
+        v = RecordValue{type, leveldb::Slice{start, 8}};
+        return true;
+      }
+      case RecordValue::String:
+      case RecordValue::Array:
+      case RecordValue::Object: {
+        leveldb::Slice s;
+        if (!bytes(s)) return false;
+        v = RecordValue{type, s};
+        return true;
+      }
+    }
+    return false; // unknown type
+  }
+
+  bool field(RecordField& tag, leveldb::Slice& name, RecordValue& v) {
+    u64 t;
+    if (!varint(t)) {
+      return false;
+    }
+    tag = RecordField(t);
+    if (tag == RecordField::Named) {
+      if (!bytes(name)) return false;
+    } else {
+      name = leveldb::Slice{Record::field_name(tag)};
+    }
+    return value(v);
+  }
+};
+
+
+double RecordValue::number_value() const {
+  switch (_type) {
+    case UInt: {
+      u64 n;
+      return RecordReader{_data}.varint(n) ? double(n) : 0.0;
+    }
+    case NegInt: {
+      u64 n;
+      return RecordReader{_data}.varint(n) ? -double(n) - 1.0 : 0.0;
+    }
+    case Double: {
+      u64 bits = 0;
+      for (size_t i = 0; i != 8; ++i) {
+        bits |= u64(u8(_data[i])) << (i * 8);
+      }
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return d;
+    }
+    default:
+      return 0.0;
+  }
+}
+
+
+void RecordValue::foreach_field(
+  rx::func<bool(RecordField, const leveldb::Slice& name, RecordValue)> fn) const
+{
+  if (_type != Object) {
+    return;
+  }
+  RecordReader r{_data};
+  RecordField tag;
+  leveldb::Slice name;
+  RecordValue v;
+  while (!r.done() && r.field(tag, name, v)) {
+    if (!fn(tag, name, v)) {
+      break;
+    }
+  }
+}
+
+
+RecordValue RecordValue::operator[](RecordField f) const {
+  if (_type == Object) {
+    RecordReader r{_data};
+    RecordField tag;
+    leveldb::Slice name;
+    RecordValue v;
+    while (!r.done() && r.field(tag, name, v)) {
+      if (tag == f) {
+        return v;
+      }
+    }
+  }
+  return RecordValue{};
+}
+
+
+RecordValue RecordValue::operator[](const string& name) const {
+  auto tag = field_for_name(name);
+  if (tag != RecordField::Named) {
+    return (*this)[tag];
+  }
+  RecordValue result;
+  foreach_field([&](RecordField tag, const leveldb::Slice& fname, RecordValue v) {
+    if (tag == RecordField::Named && fname == name) {
+      result = v;
+      return false;
+    }
+    return true;
+  });
+  return result;
+}
+
+
+RecordValue RecordValue::operator[](size_t i) const {
+  if (_type == Array) {
+    RecordReader r{_data};
+    RecordValue v;
+    while (!r.done() && r.value(v)) {
+      if (i-- == 0) {
+        return v;
+      }
+    }
+  }
+  return RecordValue{};
+}
+
+
+size_t RecordValue::size() const {
+  size_t n = 0;
+  RecordReader r{_data};
+  RecordValue v;
+  if (_type == Array) {
+    while (!r.done() && r.value(v)) { ++n; }
+  } else if (_type == Object) {
+    RecordField tag;
+    leveldb::Slice name;
+    while (!r.done() && r.field(tag, name, v)) { ++n; }
+  }
+  return n;
+}
+
+
+Json RecordValue::to_json() const {
+  switch (_type) {
+    case Null:   return Json{};
+    case False:  return Json{false};
+    case True:   return Json{true};
+    case UInt:
+    case NegInt:
+    case Double: return Json{number_value()};
+    case String: return Json{_data.ToString()};
+    case Array: {
+      Json::array items;
+      RecordReader r{_data};
+      RecordValue v;
+      while (!r.done() && r.value(v)) {
+        items.emplace_back(v.to_json());
+      }
+      return Json{std::move(items)};
+    }
+    case Object: {
+      Json::object fields;
+      foreach_field([&](RecordField, const leveldb::Slice& name, RecordValue v) {
+        fields.emplace(name.ToString(), v.to_json());
+        return true;
+      });
+      return Json{std::move(fields)};
+    }
+  }
+  return Json{};
+}
+
+
+Record::Record(const leveldb::Slice& data) {
+  if (data.size() != 0 && u8(data[0]) == kRecordFormatVersion) {
+    static_cast<RecordValue&>(*this) =
+      RecordValue{Object, leveldb::Slice{data.data() + 1, data.size() - 1}};
+  }
+}
+
+
+UNIT_TEST(record, {
+  string err;
+  auto json = Json::parse(R"({
+    "bytes": 86,
+    "client_mtime": "Wed, 21 Jan 2015 23:03:58 +0000",
+    "is_dir": false,
+    "modifier": {"display_name": "John Smith", "same_team": true, "uid": 123456},
+    "path": "/dbapp/Yosemite postmortem.url",
+    "rev": "8cdc23804a74",
+    "revision": 36060,
+    "x_unknown": [1.5, -3, null, "a"]
+  })", err);
+
+  auto data = Record::encode(json);
+  Record r{data};
+  if (!r.is_object()) {
+    throw test_failure("record is not an object");
+  }
+  if (r.to_json() != json) {
+    std::cerr << "json   = " << json.dump() << std::endl;
+    std::cerr << "record = " << r.to_json().dump() << std::endl;
+    throw test_failure("r.to_json() != json");
+  }
+  if (r[RecordField::Path].string_value() != "/dbapp/Yosemite postmortem.url" ||
+      r[RecordField::Bytes].number_value() != 86 ||
+      r[RecordField::IsDir].bool_value() ||
+      !r[RecordField::Modifier][RecordField::SameTeam].bool_value() ||
+      r["modifier"]["uid"].number_value() != 123456 ||
+      r["x_unknown"][size_t(1)].number_value() != -3 ||
+      r["x_unknown"].size() != 4 ||
+      !r[RecordField::Icon].is_null())
+  {
+    throw test_failure("unexpected field value");
+  }
+  // Encoding as the JSON is read gives the same record, except for the order of fields
+  auto text = json.dump();
+  JsonReader reader{text};
+  string streamed;
+  if (reader.next() != JsonReader::BeginObject || !Record::encode(reader, streamed) ||
+      reader.next() != JsonReader::End || Record{streamed}.to_json() != json ||
+      streamed.size() != data.size())
+  {
+    throw test_failure("Record::encode(JsonReader&) differs from Record::encode(Json)");
+  }
+
+  if (Record{leveldb::Slice{"{}"}}.is_object() || Record{data.substr(0, 9)}.to_json() == json) {
+    throw test_failure("accepted invalid record");
+  }
+})
+
+
+} // namespace
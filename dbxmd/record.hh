@@ -0,0 +1,123 @@
+#pragma once
+#include <rx/rx.h>
+#include <leveldb/slice.h>
+#include <json11/json11.hh>
+#include <string>
+namespace dbxmd {
+
+using std::string;
+using json11::Json;
+struct JsonReader;
+
+// Records are a compact binary encoding of file entries, used for the values stored under
+// kFileEntryKeyPrefix. Field names known to the schema are stored as small integer tags rather
+// than as text, and values can be read in place without decoding the whole record.
+//
+//   record := version:u8 field*
+//   field  := tag:varint (tag == 0 ? name:str) value
+//   value  := Null | False | True | UInt varint | NegInt varint | Double f64le | String str
+//           | Array len:varint value* | Object len:varint field*
+//   str    := len:varint bytes
+//
+// NegInt stores (-n - 1) so that e.g. -1 is encoded as 0.
+//
+static const u8 kRecordFormatVersion = 1;
+
+// Field tags. Never renumber these; only add new fields to the end.
+enum class RecordField : u8 {
+  Named = 0, // field name is stored as text
+  Bytes,
+  ClientMTime,
+  Icon,
+  IsDir,
+  MimeType,
+  Modified,
+  Modifier,
+  ParentSharedFolderID,
+  Path,
+  ReadOnly,
+  Rev,
+  Revision,
+  Root,
+  Size,
+  ThumbExists,
+  DisplayName,
+  SameTeam,
+  UID,
+  Email,
+  PhotoInfo,
+  LatLong,
+  TimeTaken,
+  VideoInfo,
+  Duration,
+  SharedFolder,
+  IsDeleted,
+  Hash,
+  Contents,
+  _Count,
+};
+
+// A value inside a record. References the bytes of the record it came from, so a RecordValue
+// is only valid for as long as those bytes are.
+struct RecordValue {
+  enum Type : u8 { Null = 0, False, True, UInt, NegInt, Double, String, Array, Object };
+
+  RecordValue() = default;
+  RecordValue(Type type, const leveldb::Slice& data) : _type{type}, _data{data} {}
+
+  Type type() const { return _type; }
+  bool is_null() const { return _type == Null; }
+  bool is_bool() const { return _type == False || _type == True; }
+  bool is_number() const { return _type == UInt || _type == NegInt || _type == Double; }
+  bool is_string() const { return _type == String; }
+  bool is_array() const { return _type == Array; }
+  bool is_object() const { return _type == Object; }
+
+  // Return the value, or false, 0 or an empty slice if the value is of a different type.
+  // string_value() references the record's bytes; nothing is copied.
+  bool bool_value() const { return _type == True; }
+  double number_value() const;
+  leveldb::Slice string_value() const { return _type == String ? _data : leveldb::Slice{}; }
+
+  // Look up a field of an object. Returns a Null value if there's no such field or if this
+  // value is not an object.
+  RecordValue operator[](RecordField) const;
+  RecordValue operator[](const string& name) const;
+
+  // Array items. Returns a Null value if i is out of range or if this value is not an array.
+  RecordValue operator[](size_t i) const;
+  size_t size() const; // number of array items or object fields
+
+  // Decode into a JSON DOM
+  Json to_json() const;
+
+  // Invokes fn for each field of an object. fn should return false to stop.
+  void foreach_field(rx::func<bool(RecordField, const leveldb::Slice& name, RecordValue)>) const;
+
+private:
+  Type           _type = Null;
+  leveldb::Slice _data; // payload
+};
+
+
+// A file entry record
+struct Record : RecordValue {
+  Record() = default;
+
+  // Reference an encoded record. The result is a Null value if data is not a valid record.
+  explicit Record(const leveldb::Slice& data);
+
+  // Encode a JSON object as a record, appending the result to out
+  static void encode(const Json&, string& out);
+  static string encode(const Json&);
+
+  // Encode a JSON object as it's read, appending the result to out. The object's BeginObject
+  // token must just have been read; reads up to and including its EndObject token. Returns false
+  // if the reader fails.
+  static bool encode(JsonReader&, string& out);
+
+  // Name of a field known to the schema
+  static const char* field_name(RecordField);
+};
+
+} // namespace
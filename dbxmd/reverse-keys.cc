@@ -0,0 +1,201 @@
+#include "reverse-keys.hh"
+#include "varint.hh"
+#include "unittest.hh"
+#include <algorithm>
+
+namespace dbxmd {
+
+
+void ReverseKeys::clear() {
+  _bytes.clear();
+  _keys.clear();
+  _lists.clear();
+}
+
+
+void ReverseKeys::_add(
+  std::vector<Item>& items,
+  const leveldb::Slice& key,
+  const leveldb::Slice& value,
+  u32 payload)
+{
+  items.push_back(Item{u32(_bytes.size()), u32(key.size()), u32(value.size()), payload});
+  _bytes.append(key.data(), key.size());
+  _bytes.append(value.data(), value.size());
+}
+
+
+void ReverseKeys::add_key(const leveldb::Slice& key, const leveldb::Slice& value) {
+  _add(_keys, key, value, 0);
+}
+
+
+void ReverseKeys::add_list(const leveldb::Slice& list, u32 payload) {
+  _add(_lists, list, leveldb::Slice{}, payload);
+}
+
+
+void ReverseKeys::remove_key(const leveldb::Slice& k) {
+  _keys.erase(
+    std::remove_if(_keys.begin(), _keys.end(), [&](const Item& item) { return key(item) == k; }),
+    _keys.end());
+}
+
+
+void ReverseKeys::sort() {
+  auto less = [this](const Item& a, const Item& b) { return key(a).compare(key(b)) < 0; };
+
+  // Keys: the last one added wins
+  std::stable_sort(_keys.begin(), _keys.end(), less);
+  size_t n = 0;
+  for (size_t i = 0; i != _keys.size(); ++i) {
+    if (n != 0 && key(_keys[n - 1]) == key(_keys[i])) {
+      _keys[n - 1] = _keys[i];
+    } else {
+      _keys[n++] = _keys[i];
+    }
+  }
+  _keys.resize(n);
+
+  // Lists: the lowest payload wins
+  std::sort(_lists.begin(), _lists.end(), less);
+  n = 0;
+  for (size_t i = 0; i != _lists.size(); ++i) {
+    if (n != 0 && key(_lists[n - 1]) == key(_lists[i])) {
+      _lists[n - 1].payload = RX_MIN(_lists[n - 1].payload, _lists[i].payload);
+    } else {
+      _lists[n++] = _lists[i];
+    }
+  }
+  _lists.resize(n);
+}
+
+
+void ReverseKeys::encode(string& out) const {
+  varint_append(out, _keys.size());
+  varint_append(out, _lists.size());
+  auto encode_items = [&](const std::vector<Item>& items, bool with_payload) {
+    leveldb::Slice prev;
+    for (auto& item : items) {
+      auto k = key(item);
+      size_t shared = 0;
+      size_t max_shared = RX_MIN(prev.size(), k.size());
+      while (shared != max_shared && prev[shared] == k[shared]) {
+        ++shared;
+      }
+      varint_append(out, shared);
+      varint_append(out, k.size() - shared);
+      out.append(k.data() + shared, k.size() - shared);
+      if (with_payload) {
+        varint_append(out, item.payload);
+      }
+      prev = k;
+    }
+  };
+  encode_items(_keys, false);
+  encode_items(_lists, true);
+}
+
+
+bool ReverseKeys::decode(const leveldb::Slice& data) {
+  clear();
+  const char* p = data.data();
+  const char* end = p + data.size();
+  u64 nkeys, nlists;
+  // Every item takes at least one byte. Each count is checked on its own first, as their sum
+  // could overflow.
+  if (!varint_read(p, end, nkeys) || !varint_read(p, end, nlists) ||
+      nkeys > u64(end - p) || nlists > u64(end - p) || nkeys + nlists > u64(end - p))
+  {
+    return false;
+  }
+  auto decode_items = [&](std::vector<Item>& items, u64 count, bool with_payload) {
+    items.reserve(count);
+    const Item* prev = nullptr;
+    for (u64 i = 0; i != count; ++i) {
+      u64 shared, size, payload = 0;
+      if (!varint_read(p, end, shared) || !varint_read(p, end, size) ||
+          size > u64(end - p) || shared > (prev == nullptr ? 0 : prev->size))
+      {
+        return false;
+      }
+      Item item{u32(_bytes.size()), u32(shared + size), 0, 0};
+      // The shared prefix is copied from the previous item, so make room first
+      _bytes.reserve(_bytes.size() + shared + size);
+      _bytes.append(_bytes.data() + (prev == nullptr ? 0 : prev->offset), shared);
+      _bytes.append(p, size);
+      p += size;
+      if (with_payload && !varint_read(p, end, payload)) {
+        return false;
+      }
+      item.payload = u32(payload);
+      items.push_back(item);
+      prev = &items.back();
+    }
+    return true;
+  };
+  if (!decode_items(_keys, nkeys, false) || !decode_items(_lists, nlists, true) || p != end) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+
+UNIT_TEST(reverse_keys, {
+  ReverseKeys rk;
+  rk.add_key("s:0000000086 \x01\x02\x03\x04", "\x05");
+  rk.add_key("b:foo bar.txt \x10\x20 \x01\x02\x03\x04", "\x01");
+  rk.add_key("s:0000000086 \x01\x02\x03\x04", "\x06");
+  rk.add_key("\xff" "id-to-entry:\x01\x02\x03\x04", "2015-01-23 22:15:17\t8cdc23804a74");
+  rk.add_list("n:foo", 9);
+  rk.add_list("n:bar", 4);
+  rk.add_list("n:foo", 3);
+  rk.add_list("n:foobar", 7);
+  rk.sort();
+
+  if (rk.keys().size() != 3 || rk.key(rk.keys()[0]) != "b:foo bar.txt \x10\x20 \x01\x02\x03\x04" ||
+      rk.value(rk.keys()[1]) != "\x06" || rk.key(rk.keys()[2]).data()[0] != '\xff')
+  {
+    throw test_failure("ReverseKeys::sort: unexpected keys");
+  }
+  if (rk.lists().size() != 3 || rk.key(rk.lists()[1]) != "n:foo" || rk.lists()[1].payload != 3) {
+    throw test_failure("ReverseKeys::sort: unexpected lists");
+  }
+
+  string data;
+  rk.encode(data);
+  ReverseKeys decoded;
+  if (!decoded.decode(data) || decoded.keys().size() != 3 || decoded.lists().size() != 3) {
+    throw test_failure("ReverseKeys::decode failed");
+  }
+  for (size_t i = 0; i != 3; ++i) {
+    if (decoded.key(decoded.keys()[i]) != rk.key(rk.keys()[i]) ||
+        decoded.key(decoded.lists()[i]) != rk.key(rk.lists()[i]) ||
+        decoded.lists()[i].payload != rk.lists()[i].payload)
+    {
+      throw test_failure("decoded reverse keys differ");
+    }
+  }
+  string reencoded;
+  decoded.encode(reencoded);
+  if (reencoded != data) {
+    throw test_failure("reencoded reverse keys differ");
+  }
+  if (decoded.decode(leveldb::Slice{data.data(), data.size() - 1}) || !decoded.empty()) {
+    throw test_failure("accepted truncated reverse keys");
+  }
+  // Counts whose sum overflows: 2^64-1 keys and 2 lists
+  string overflow{"\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01\x02" "ab"};
+  if (decoded.decode(overflow) || !decoded.empty()) {
+    throw test_failure("accepted reverse keys with overflowing counts");
+  }
+
+  rk.remove_key("b:foo bar.txt \x10\x20 \x01\x02\x03\x04");
+  if (rk.keys().size() != 2) {
+    throw test_failure("ReverseKeys::remove_key failed");
+  }
+})
+
+
+} // namespace
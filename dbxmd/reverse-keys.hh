@@ -0,0 +1,64 @@
+#pragma once
+#include <leveldb/slice.h>
+#include <rx/rx.h>
+#include <string>
+#include <vector>
+namespace dbxmd {
+
+using std::string;
+
+// The keys and posting lists that an index maps an entry to, with the keys relative to the index's
+// key prefix. An index records them for each entry (its reverse key list) so that the entry's
+// index entries can be found when it changes or is removed. Keys, their values and lists are
+// stored in a single buffer, which clear() keeps, so collecting an entry's keys doesn't allocate
+// once the buffer has grown to fit.
+//
+// Encoded, keys and lists are in order and share a prefix with the previous key or list:
+//
+//   nkeys:varint nlists:varint key{nkeys} list{nlists}
+//   key  = shared:varint size:varint bytes{size}
+//   list = shared:varint size:varint bytes{size} payload:varint
+//
+// Values are not encoded.
+struct ReverseKeys {
+  struct Item {
+    u32 offset;     // of the key in the buffer, which the value follows
+    u32 size;       // of the key
+    u32 value_size; // 0 for lists
+    u32 payload;    // 0 for keys
+  };
+
+  bool empty() const { return _keys.empty() && _lists.empty(); }
+  void clear();
+
+  // Adds a key or list. Call sort() after adding.
+  void add_key(const leveldb::Slice& key, const leveldb::Slice& value);
+  void add_list(const leveldb::Slice& list, u32 payload);
+  void remove_key(const leveldb::Slice& key);
+
+  // Sorts keys and lists. If a key was added more than once, the last value is kept, and if a list
+  // was added more than once, the lowest payload is kept.
+  void sort();
+
+  const std::vector<Item>& keys() const { return _keys; }
+  const std::vector<Item>& lists() const { return _lists; }
+  leveldb::Slice key(const Item& item) const { return {_bytes.data() + item.offset, item.size}; }
+  leveldb::Slice value(const Item& item) const {
+    return {_bytes.data() + item.offset + item.size, item.value_size};
+  }
+
+  // Appends the sorted keys and lists to out
+  void encode(string& out) const;
+
+  // Replaces the contents with the keys and lists of data. Returns false, leaving it empty, if
+  // data is malformed.
+  bool decode(const leveldb::Slice& data);
+
+private:
+  void _add(std::vector<Item>&, const leveldb::Slice&, const leveldb::Slice&, u32 payload);
+  string            _bytes;
+  std::vector<Item> _keys;
+  std::vector<Item> _lists;
+};
+
+} // namespace
@@ -0,0 +1,230 @@
+#include "search-cache.hh"
+#include "unittest.hh"
+#include <algorithm>
+
+namespace dbxmd {
+
+// Approximate memory used by an entry in addition to its strings
+static const size_t kEntryOverhead = 128;
+
+
+string SearchCache::_key(const Query& q) {
+  string k;
+  k.reserve(q.type.size() + q.text.size() + 2 + sizeof(q.limit));
+  k.append(q.type);
+  k.push_back('\0');
+  k.append(q.text);
+  k.push_back('\0');
+  k.append((const char*)&q.limit, sizeof(q.limit));
+  return k;
+}
+
+
+bool SearchCache::get(const Query& q, Dropbox::SearchResults& results, u64& generation) {
+  auto k = _key(q);
+  std::lock_guard<std::mutex> lock(_mu);
+  generation = _generation;
+  auto I = _index.find(k);
+  if (I == _index.end()) {
+    ++_stats.misses;
+    return false;
+  }
+  ++_stats.hits;
+  _entries.splice(_entries.begin(), _entries, I->second);
+  results = I->second->results;
+  return true;
+}
+
+
+void SearchCache::put(
+  const Query& q,
+  const std::vector<string>& key_prefixes,
+  const std::vector<string>& entry_keys,
+  const Dropbox::SearchResults& results,
+  u64 generation)
+{
+  auto k = _key(q);
+  size_t size = kEntryOverhead + k.size();
+  for (auto& prefix : key_prefixes) {
+    size += prefix.size();
+  }
+  for (auto& entry_key : entry_keys) {
+    size += entry_key.size();
+  }
+  for (auto& result : results) {
+    size += result.size();
+  }
+
+  std::lock_guard<std::mutex> lock(_mu);
+  if (generation != _generation || size > _max_bytes || _index.find(k) != _index.end()) {
+    return;
+  }
+  while (_stats.bytes + size > _max_bytes) {
+    _erase(std::prev(_entries.end()));
+    ++_stats.evictions;
+  }
+  auto sorted_entry_keys = entry_keys;
+  std::sort(sorted_entry_keys.begin(), sorted_entry_keys.end());
+  _entries.push_front(Entry{k, key_prefixes, std::move(sorted_entry_keys), results, size});
+  _index.emplace(std::move(k), _entries.begin());
+  _stats.bytes += size;
+  ++_stats.entries;
+}
+
+
+void SearchCache::_erase(Entries::iterator I) {
+  _stats.bytes -= I->size;
+  --_stats.entries;
+  _index.erase(I->key);
+  _entries.erase(I);
+}
+
+
+void SearchCache::invalidate(const DataChanges& changes) {
+  if (changes.empty()) {
+    return;
+  }
+  // A prefix matches a changed key if the first key which sorts at or after it starts with it
+  std::vector<leveldb::Slice> keys;
+  keys.reserve(changes.size());
+  for (auto& change : changes) {
+    keys.push_back(change.key);
+  }
+  std::sort(keys.begin(), keys.end(), [](const leveldb::Slice& a, const leveldb::Slice& b) {
+    return a.compare(b) < 0;
+  });
+  auto is_changed = [&](const string& prefix) {
+    auto I = std::lower_bound(keys.begin(), keys.end(), leveldb::Slice{prefix},
+      [](const leveldb::Slice& a, const leveldb::Slice& b) { return a.compare(b) < 0; });
+    return I != keys.end() && I->starts_with(prefix);
+  };
+  // An entry matches a changed key if they're equal. Both are sorted, so merge them.
+  auto is_any_changed = [&](const std::vector<string>& entry_keys) {
+    auto I = keys.begin();
+    for (auto& entry_key : entry_keys) {
+      leveldb::Slice k{entry_key};
+      while (I != keys.end() && I->compare(k) < 0) {
+        ++I;
+      }
+      if (I == keys.end()) {
+        return false;
+      }
+      if (*I == k) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  std::lock_guard<std::mutex> lock(_mu);
+  ++_generation;
+  for (auto I = _entries.begin(); I != _entries.end(); ) {
+    auto entry = I++;
+    if (std::any_of(entry->key_prefixes.begin(), entry->key_prefixes.end(), is_changed) ||
+        is_any_changed(entry->entry_keys))
+    {
+      _erase(entry);
+      ++_stats.invalidations;
+    }
+  }
+}
+
+
+void SearchCache::clear() {
+  std::lock_guard<std::mutex> lock(_mu);
+  ++_generation;
+  _entries.clear();
+  _index.clear();
+  _stats.entries = 0;
+  _stats.bytes = 0;
+}
+
+
+SearchCacheStats SearchCache::stats() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _stats;
+}
+
+
+u64 SearchCache::generation() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _generation;
+}
+
+
+UNIT_TEST(search_cache, {
+  auto query = [](const string& text) {
+    SearchCache::Query q; q.text = text; q.limit = 10; return q;
+  };
+  auto prefixes = [](const string& a, const string& b) {
+    std::vector<string> v; v.push_back(a); v.push_back(b); return v;
+  };
+  auto entries = [](const string& text) {
+    return std::vector<string>(1, "fn:/" + text + ".txt");
+  };
+  Dropbox::SearchResults results(1, string(100, 'x'));
+  SearchCache cache{3 * (kEntryOverhead + 200)};
+  u64 gen;
+  cache.get(query("cat"), results, gen);
+  cache.put(query("cat"), prefixes("i:b:cat", "i:n:cat"), entries("cat"), results, gen);
+  cache.get(query("dog"), results, gen);
+  cache.put(query("dog"), prefixes("i:b:dog", "i:n:dog"), entries("dog"), results, gen);
+  if (!cache.get(query("cat"), results, gen) || results.size() != 1) {
+    throw test_failure("expected a hit");
+  }
+
+  // Changing "i:n:catalog" invalidates "cat" but not "dog"
+  DataChanges changes;
+  changes.emplace_back(leveldb::Slice{"i:n:catalog"}, DataChange::Modified);
+  changes.emplace_back(leveldb::Slice{"i:n:bird"}, DataChange::Removed);
+  cache.invalidate(changes);
+  if (cache.get(query("cat"), results, gen) || !cache.get(query("dog"), results, gen)) {
+    throw test_failure("unexpected invalidation");
+  }
+
+  // Results read before an invalidation aren't cached
+  cache.get(query("cow"), results, gen);
+  cache.invalidate(changes);
+  cache.put(query("cow"), prefixes("i:b:cow", "i:n:cow"), entries("cow"), results, gen);
+  if (cache.get(query("cow"), results, gen)) {
+    throw test_failure("cached results from before an invalidation");
+  }
+
+  // Least recently used results are evicted
+  for (auto text : prefixes("ant", "bee")) {
+    cache.get(query(text), results, gen);
+    cache.put(query(text), prefixes("i:b:" + text, "i:n:" + text), entries(text), results, gen);
+  }
+  cache.get(query("dog"), results, gen);
+  cache.get(query("eel"), results, gen);
+  cache.put(query("eel"), prefixes("i:b:eel", "i:n:eel"), entries("eel"), results, gen);
+  auto stats = cache.stats();
+  if (stats.entries != 3 || stats.evictions != 1 || cache.get(query("ant"), results, gen)) {
+    throw test_failure("unexpected eviction");
+  }
+
+  // Changing only an entry's file entry, e.g. its rev, invalidates the results which return it
+  Dropbox::SearchResults fox(1, "{\"path\": \"/fox.txt\", \"rev\": \"1\"}");
+  cache.get(query("fox"), results, gen);
+  cache.put(query("fox"), prefixes("i:b:fox", "i:n:fox"), entries("fox"), fox, gen);
+  DataChanges entry_changes;
+  entry_changes.emplace_back(leveldb::Slice{"fn:/fox.tx"}, DataChange::Modified);
+  entry_changes.emplace_back(leveldb::Slice{"fn:/fox.txt/bar"}, DataChange::Modified);
+  cache.invalidate(entry_changes);
+  if (!cache.get(query("fox"), results, gen)) {
+    throw test_failure("invalidated by other entries");
+  }
+  entry_changes.emplace_back(leveldb::Slice{"fn:/fox.txt"}, DataChange::Modified);
+  cache.invalidate(entry_changes);
+  if (cache.get(query("fox"), results, gen)) {
+    throw test_failure("not invalidated by a changed entry");
+  }
+  fox[0] = "{\"path\": \"/fox.txt\", \"rev\": \"2\"}";
+  cache.put(query("fox"), prefixes("i:b:fox", "i:n:fox"), entries("fox"), fox, gen);
+  if (!cache.get(query("fox"), results, gen) || results != fox) {
+    throw test_failure("cached results don't reflect the changed entry");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,77 @@
+#pragma once
+#include "dbxmd.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+namespace dbxmd {
+
+using std::string;
+
+// Caches the results of recent searches, evicting the least recently used results when the
+// cache exceeds its size. Each result records the prefixes of the index keys its query reads and
+// the keys of the file entries it returns, and is invalidated when a key with any of those
+// prefixes or any of those entries changes.
+//
+// Safe to use from multiple threads.
+struct SearchCache {
+  SearchCache(size_t max_bytes = kDefaultMaxBytes) : _max_bytes{max_bytes} {}
+
+  static const size_t kDefaultMaxBytes = 4 * 1024 * 1024;
+
+  // Identifies a search. `text` should be normalized.
+  struct Query {
+    string type;
+    string text;
+    u32    limit;
+  };
+
+  // Returns true and sets results if the query's results are cached. Sets generation, which
+  // must be passed to put().
+  bool get(const Query&, Dropbox::SearchResults& results, u64& generation);
+
+  // Caches results of a query which reads the index keys starting with key_prefixes, and whose
+  // results are the file entries with entry_keys. Ignored if any results were invalidated since
+  // get() returned generation, as the results might have been read before the change which
+  // invalidated them.
+  void put(
+    const Query&,
+    const std::vector<string>& key_prefixes,
+    const std::vector<string>& entry_keys,
+    const Dropbox::SearchResults& results,
+    u64 generation);
+
+  // Drops the results of queries reading any of the changed keys, or returning any of the
+  // changed entries
+  void invalidate(const DataChanges&);
+
+  // Drops all results
+  void clear();
+
+  SearchCacheStats stats() const;
+
+  // Changes whenever any results are invalidated
+  u64 generation() const;
+
+private:
+  struct Entry {
+    string                 key;
+    std::vector<string>    key_prefixes;
+    std::vector<string>    entry_keys; // sorted
+    Dropbox::SearchResults results;
+    size_t                 size;
+  };
+  using Entries = std::list<Entry>; // most recently used first
+
+  static string _key(const Query&);
+  void _erase(Entries::iterator);
+
+  mutable std::mutex                                 _mu;
+  size_t                                             _max_bytes;
+  Entries                                            _entries;
+  std::unordered_map<string, Entries::iterator>      _index;
+  u64                                                _generation = 0;
+  SearchCacheStats                                   _stats;
+};
+
+} // namespace
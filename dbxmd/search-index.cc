@@ -0,0 +1,1205 @@
+#include "dbxmd.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <forward_list>
+#include <iostream>
+#include <set>
+#include <unordered_set>
+
+#include "keyspace.hh"
+#include "search-index.hh"
+#include "dropbox_imp.hh"
+#include "db.hh"
+#include "str.hh"
+#include "path-dict.hh"
+#include "postings.hh"
+#include "query.hh"
+#include "varint.hh"
+#include "tokenizer.hh"
+
+namespace dbxmd {
+
+using std::vector;
+using std::string;
+
+// #define TRACELINE std::cerr << "T " << __LINE__ << std::endl;
+
+static const string kBasenameKeyPrefix{"b:"};
+static const string kNameKeyPrefix{"n:"};
+static const string kTypeKeyPrefix{"t:"};
+static const string kMimeTypeKeyPrefix{"m:"};
+static const string kSizeKeyPrefix{"s:"};
+static const string kDayKeyPrefix{"d:"};
+static const string kReverseKeyPrefix{"r:"};
+
+// Terms are stored as posting lists ("n:<term>") with a payload describing the match (see
+// posting_payload). Basenames are stored as index keys, ordered by basename, then rank, then
+// document, i.e. "b:<basename> <rank> <docnum>", with the same payload as their value. Ranks are
+// encoded as four bytes of seven bits each with the high bit set, so that they are fixed-width,
+// sort in numeric order and never contain a space.
+static const size_t kRankSize = 4;
+static const u64 kMaxRank = (1u << 28) - 1;
+
+static void append_rank(string& s, u64 rank) {
+  auto r = u32(RX_MIN(rank, kMaxRank));
+  s.push_back(char(0x80 | ((r >> 21) & 0x7f)));
+  s.push_back(char(0x80 | ((r >> 14) & 0x7f)));
+  s.push_back(char(0x80 | ((r >> 7) & 0x7f)));
+  s.push_back(char(0x80 | (r & 0x7f)));
+}
+
+
+// How a query matched an entry, from best to worst
+enum class Match : u32 {
+  ExactBasename,  // the query is the entry's basename
+  BasenamePrefix, // the query is a prefix of the entry's basename
+  BasenameTerm,   // a term of the query prefixes a term of the entry's basename
+  Type,           // e.g. ".pdf"
+  DirnameTerm,    // a term of the query prefixes a term of the entry's parent path
+};
+
+// Posting payloads describe how a term matched an entry and when the entry was modified, so that
+// results can be scored without reading their entries:
+//
+//   bits 30-31  match, relative to Match::BasenameTerm
+//   bits 24-29  depth of the entry, i.e. number of path components
+//   bits 20-23  position of the term in the basename or parent path
+//   bits 16-19  number of terms in the basename
+//   bits  0-15  day the entry was modified, counted from 1970-01-01, or 0 if unknown
+//
+// A better match has a lower payload, so the payload of a document which is in several of the
+// lists a query term prefixes is the lowest one.
+static u32 posting_payload(Match match, size_t depth, size_t position, size_t nterms, u32 day) {
+  return (u32(match) - u32(Match::BasenameTerm)) << 30
+       | u32(RX_MIN(depth, size_t(63))) << 24
+       | u32(RX_MIN(position, size_t(15))) << 20
+       | u32(RX_MIN(nterms, size_t(15))) << 16
+       | RX_MIN(day, u32(0xffff));
+}
+
+static u32 payload_day(u32 payload) { return payload & 0xffff; }
+
+
+// Entries are also posted to a list for their type ("t:<type>"), which is their extension in lower
+// case, or "/" for folders, so that searches can be restricted to types of entries
+static string normalize_type_name(string type_name) {
+  for (auto& c : type_name) {
+    c = (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+  }
+  return type_name;
+}
+
+// Returns the type names of a search's `type` argument, e.g. "pdf, .Doc" => {"pdf", "doc"}.
+// "folder" is the same as "/".
+static vector<string> parse_type_names(const string& type) {
+  vector<string> names;
+  for (auto& name : str_split(type, ",")) {
+    auto n = normalize_type_name(str_trim(name, " "));
+    if (n == "folder" || n == "/") {
+      names.emplace_back("/");
+    } else if (!(n = str_trim(n, ".")).empty()) {
+      names.emplace_back(std::move(n));
+    }
+  }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  return names;
+}
+
+
+// Fields which searches can have predicates on (see FieldQuery) are indexed in numeric order, so
+// that a range of values is a range of keys: "s:<bytes> <docnum>" for the sizes of files and
+// "d:<day> <docnum>" for days of modification, with values as fixed-width big-endian numbers and
+// the entry's posting payload as the value. MIME types are posting lists ("m:<mime type>").
+static const size_t kSizeWidth = 8;
+static const size_t kDayWidth = 4;
+
+static void append_big_endian(string& s, u64 value, size_t width) {
+  for (size_t i = width; i != 0; --i) {
+    s.push_back(char((value >> (8 * (i - 1))) & 0xff));
+  }
+}
+
+static string field_key(const string& key_prefix, u64 value, size_t width, DocNum docnum) {
+  string k;
+  k.reserve(key_prefix.size() + width + 1 + kDocNumSize);
+  k.append(key_prefix);
+  append_big_endian(k, value, width);
+  k.push_back(' ');
+  docnum_append(k, docnum);
+  return k;
+}
+
+
+// Returns the day of a date in Dropbox format, e.g. "Fri, 23 Jan 2015 22:15:17 +0000", counted
+// from 1970-01-01, or 0 if the date is malformed
+static u32 parse_dropbox_day(const string& date) {
+  struct tm tm = {};
+  if (date.empty() || strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S %z", &tm) == nullptr) {
+    return 0;
+  }
+  auto t = timegm(&tm) - tm.tm_gmtoff;
+  return t > 0 ? u32(t / 86400) : 0;
+}
+
+
+static string index_key(const string& key_prefix, const string& term, u64 rank, DocNum docnum) {
+  string k;
+  k.reserve(key_prefix.size() + term.size() + kRankSize + kDocNumSize + 2);
+  k.append(key_prefix);
+  k.append(term);
+  k.push_back(' ');
+  append_rank(k, rank);
+  k.push_back(' ');
+  docnum_append(k, docnum);
+  return k;
+}
+
+
+SearchIndex* SearchIndex::sharedInstance() {
+  static SearchIndex* p = nullptr;
+  if (p == nullptr) {
+    p = new SearchIndex{};
+  }
+  return p;
+}
+
+
+void SearchIndex::map(const string& canonical_path, DocNum docnum, const Record& record) {
+  auto path = str_trim(canonical_path, "/");
+  if (path.size() == 0) {
+    // Special case where path is "/"
+    return;
+  }
+  
+  // "foo/bar/baz.txt" => dirname "foo/bar", basename "baz.txt"
+  auto slash = path.rfind('/');
+  auto depth = size_t(std::count(path.begin(), path.end(), '/')) + 1;
+  auto dirname = slash == string::npos ?
+    leveldb::Slice{} : leveldb::Slice{path.data(), slash};
+  auto basename = slash == string::npos ? path : path.substr(slash + 1);
+
+  // Terms are split from the text as it is, as canonical paths are already lowercase
+  auto nbasename_terms = count_terms(basename, TermSplit::Index);
+  auto day = parse_dropbox_day(record[RecordField::Modified].string_value().ToString());
+  auto payload = [&](Match match, size_t position) {
+    return posting_payload(match, depth, position, nbasename_terms, day);
+  };
+
+  // Helper for adding a term index
+  string list;
+  auto add_term_index = [&](const leveldb::Slice& text, Match match) {
+    size_t position = 0;
+    leveldb::Slice term;
+    const char* end = text.data() + text.size();
+    for (const char* p = text.data(); next_term(p, end, TermSplit::Index, term);) {
+      list.assign(kNameKeyPrefix).append(term.data(), term.size());
+      post(list, payload(match, position++));
+    }
+  };
+  
+  // Basename (e.g. "/lol/cat/foo bar.txt" -> "b:foo bar.txt <rank> <docnum>")
+  auto k = index_key(kBasenameKeyPrefix, basename, depth, docnum);
+  string v;
+  varint_append(v, payload(Match::BasenameTerm, 0));
+  emit(k, v);
+
+  // Type name
+  string type_name;
+  if (record[RecordField::IsDir].bool_value()) {
+    type_name = "/";
+  } else {
+    type_name = str_file_ext(basename).second;
+
+    // Add type name as a "term" as well, with a dot prefix
+    if (!type_name.empty()) {
+      post(kNameKeyPrefix + "." + type_name, payload(Match::Type, 0));
+    }
+  }
+  if (!type_name.empty()) {
+    post(kTypeKeyPrefix + normalize_type_name(type_name), payload(Match::Type, 0));
+  }
+
+  // Fields
+  string field_value;
+  varint_append(field_value, payload(Match::Type, 0));
+  if (!record[RecordField::IsDir].bool_value()) {
+    auto bytes = record[RecordField::Bytes].number_value();
+    emit(field_key(kSizeKeyPrefix, bytes > 0 ? u64(bytes) : 0, kSizeWidth, docnum), field_value);
+  }
+  if (day != 0) {
+    emit(field_key(kDayKeyPrefix, day, kDayWidth, docnum), field_value);
+  }
+  auto mime_type = record[RecordField::MimeType].string_value();
+  if (!mime_type.empty()) {
+    post(kMimeTypeKeyPrefix + normalize_type_name(mime_type.ToString()), payload(Match::Type, 0));
+  }
+
+  // Basename terms
+  add_term_index(basename, Match::BasenameTerm);
+
+  // Dirname terms
+  add_term_index(dirname, Match::DirnameTerm);
+
+  // Note: Entries that the user has used are boosted when searching rather than here, so that
+  // using an entry doesn't require reindexing it. See BoostStore.
+}
+
+
+// ================================================================================================
+// Searching
+
+
+template <typename T>
+static void RX_UNUSED dump_collection(const char* name, const T& collection) {
+  std::cout << name << ":" << std::endl;
+  size_t i = 0;
+  for (auto& value : collection) { std::cout << "  " << i++ << " = " << value << std::endl; }
+  std::cout << std::endl;
+}
+
+
+static string normalize_term_text(const string& text) {
+  return text_to_lower(text);
+}
+
+
+static std::pair<size_t,size_t> parse_terms(
+  const string& text,
+  std::forward_list<string>& terms)
+{
+  // Returns a pair of term count: {positive_count, negative_count}
+
+  // Terms are split at the same characters as when indexing, except that a dot is kept for e.g.
+  // ".pdf" and a minus for logical-NOT terms
+  auto lowercase_text = text_to_lower(text);
+  const char* end = lowercase_text.data() + lowercase_text.size();
+
+  std::forward_list<string> negative_terms; // later added to end of terms
+  auto terms_tail = terms.before_begin();
+  auto negative_terms_tail = negative_terms.before_begin();
+  std::set<string> seen_terms;
+  size_t n_positive_terms = 0;
+
+  leveldb::Slice t;
+  for (const char* p = lowercase_text.data(); next_term(p, end, TermSplit::Query, t);) {
+    if (t.size() > 1 || t[0] != '-') {
+      // ^~~ Special case: Negative term w/o an actual term. i.e. "-"
+      auto I = seen_terms.emplace(t.data(), t.size());
+      if (I.second) {
+        // Never-seen-before term
+        const string& term = *I.first;
+        if (term[0] == '-') {
+          negative_terms_tail = negative_terms.emplace_after(negative_terms_tail, term);
+        } else {
+          terms_tail = terms.emplace_after(terms_tail, term);
+          ++n_positive_terms;
+        }
+      }
+    }
+  }
+  
+  if (!negative_terms.empty()) {
+    terms.splice_after(terms_tail, std::move(negative_terms));
+  }
+  
+  return {n_positive_terms, seen_terms.size()-n_positive_terms}; // {positive_count, nnegative_count}
+}
+
+
+// Results are scored by how well they match, by how recently they were modified and by how much
+// they have been used. Scores are costs, i.e. lower is better.
+static const u32 kMatchCost[] = {
+  0,  // ExactBasename
+  16, // BasenamePrefix
+  32, // BasenameTerm
+  48, // Type
+  64, // DirnameTerm
+};
+static const u32 kDepthCost = 2;     // per path component
+static const u32 kPositionCost = 1;  // per term preceding the matching term
+static const u32 kTermCountCost = 1; // per basename term, i.e. shorter names match better
+static const u32 kAgeCost = 4;       // per doubling of the number of days since modification
+static const u32 kBoostCost = 12;    // subtracted per doubling of an entry's usage boost (+1)
+
+static u32 score(Match match, u32 payload, u32 today) {
+  auto day = payload_day(payload);
+  u32 age = day == 0 ? 0xffff : today > day ? today - day : 0; // unknown is very old
+  u32 age_cost = age == 0 ? 0 : kAgeCost * u32(32 - __builtin_clz(age));
+  return kMatchCost[u32(match)]
+       + kDepthCost * ((payload >> 24) & 0x3f)
+       + kPositionCost * ((payload >> 20) & 0xf)
+       + kTermCountCost * ((payload >> 16) & 0xf)
+       + age_cost;
+}
+
+// Returns the amount by which a boost lowers a score
+static u32 boost_discount(float boost) {
+  return boost > 0 ? u32(float(kBoostCost) * log2f(1 + boost)) : 0;
+}
+
+static Match payload_match(u32 payload) {
+  return Match(u32(Match::BasenameTerm) + (payload >> 30));
+}
+
+
+struct ScoredDoc {
+  u32    score;
+  DocNum docnum;
+  bool operator<(const ScoredDoc& other) const {
+    return score < other.score || (score == other.score && docnum < other.docnum);
+  }
+};
+
+// Keeps the best `limit` documents added to it which rank after `after`, e.g. the last document of
+// the previous page, as a heap with the worst of them on top. No document ranks before {0, 0}.
+struct TopDocs {
+  TopDocs(size_t limit, ScoredDoc after = ScoredDoc{0, 0}) : _limit{limit}, _after{after} {
+    _docs.reserve(limit);
+  }
+
+  // True if a document would be kept if it were added now
+  bool accepts(u32 score, DocNum docnum) const {
+    ScoredDoc doc{score, docnum};
+    return _after < doc &&
+      (_docs.size() < _limit || (_limit != 0 && doc < _docs.front()));
+  }
+
+  void add(u32 score, DocNum docnum) {
+    ScoredDoc doc{score, docnum};
+    if (!(_after < doc)) {
+      return;
+    } else if (_docs.size() < _limit) {
+      _docs.push_back(doc);
+      std::push_heap(_docs.begin(), _docs.end());
+    } else if (accepts(score, docnum)) {
+      std::pop_heap(_docs.begin(), _docs.end());
+      _docs.back() = doc;
+      std::push_heap(_docs.begin(), _docs.end());
+    }
+  }
+
+  // Returns the documents, best first, leaving none behind
+  vector<ScoredDoc> take_sorted() {
+    std::sort_heap(_docs.begin(), _docs.end());
+    return std::move(_docs);
+  }
+
+private:
+  size_t            _limit;
+  ScoredDoc         _after;
+  vector<ScoredDoc> _docs;
+};
+
+
+// Unions of more posting lists than this are not merged as they're read, e.g. for a one-letter
+// term which prefixes thousands of terms. Such terms are either read into memory or probed.
+static const size_t kMaxMergedLists = 64;
+
+// A term with more than this many times as many documents as the rarest term is skipped through,
+// seeking to the documents of the rarest term. Otherwise it's read into memory, which is cheaper
+// when most of its blocks would be read anyway.
+static const size_t kSeekRatio = 32;
+
+// A term matching too many lists to merge is checked against the candidate documents' own terms
+// when there are at most this many candidates, rather than being read.
+static const size_t kMaxProbedDocs = 1000;
+
+// A term which prefixes no term of the index matches at most this many terms similar to it
+static const size_t kMaxSimilarTerms = 8;
+
+// A cancelled search stops scoring after at most this many more documents
+static const u32 kDocsPerCancellationCheck = 1024;
+
+
+// A query term and the posting lists of the terms that it prefixes
+struct QueryTerm {
+  string key; // index key for kNameKeyPrefix and the term
+  bool   is_negative = false;
+  bool   is_similar = false; // matches terms similar to it rather than terms which it prefixes
+  bool   is_filter = false; // matches the type or fields of entries rather than a term of the text
+  std::vector<std::pair<string, u32>> lists; // key and document count of each list
+  bool   is_range = false; // matches a range of a field's values, whose documents are range_docs
+  DocArray range_docs;
+  bool   has_more_lists = false; // more than kMaxMergedLists lists match; `lists` has the first few
+  size_t df = 0; // number of documents, approximately (the sum of the lists' counts)
+
+  // How documents are matched against the term
+  enum Plan { Stream, Read, Probe } plan = Stream;
+  DocStreamPtr stream; // for Stream and Read
+
+  bool matches_nothing() const { return is_range ? range_docs.size() == 0 : lists.empty(); }
+
+  bool is_rarer_than(const QueryTerm& other) const {
+    return has_more_lists != other.has_more_lists ? !has_more_lists : df < other.df;
+  }
+};
+
+
+// Looks up the posting lists of a term, which are counted as they are maintained
+static void read_term_lists(const PostingReader& reader, QueryTerm& term) {
+  reader.lists_foreach(
+    term.key,
+    [&](const leveldb::Slice& list_key, u32 count) {
+      if (term.lists.size() == kMaxMergedLists) {
+        term.has_more_lists = true;
+        return false;
+      }
+      term.lists.emplace_back(list_key.ToString(), count);
+      term.df += count;
+      return true; // continue enumeration
+    }
+  );
+}
+
+
+// Looks up the posting lists of the terms most similar to a term which prefixes no term, e.g.
+// "invioce" => "invoice", "invoices". Like the term itself would, each similar term matches the
+// terms which it prefixes.
+static void read_similar_term_lists(
+  const PostingReader& reader,
+  const TermDict& similar_terms,
+  const string& terms_key,
+  const string& term_text,
+  QueryTerm& term)
+{
+  auto max_edits = TermDict::max_edits(term_text.size());
+  for (auto& similar : similar_terms.similar(term_text, max_edits, kMaxSimilarTerms)) {
+    reader.lists_foreach(
+      terms_key + similar,
+      [&](const leveldb::Slice& list_key, u32 count) {
+        if (term.lists.size() == kMaxMergedLists) {
+          return false;
+        }
+        term.lists.emplace_back(list_key.ToString(), count);
+        return true; // continue enumeration
+      }
+    );
+  }
+  // A similar term can prefix another
+  std::sort(term.lists.begin(), term.lists.end());
+  term.lists.erase(std::unique(term.lists.begin(), term.lists.end()), term.lists.end());
+  term.df = 0;
+  for (auto& list : term.lists) {
+    term.df += list.second;
+  }
+  term.is_similar = !term.lists.empty();
+}
+
+
+static bool is_set(const std::atomic<bool>* flag) {
+  return flag != nullptr && flag->load(std::memory_order_relaxed);
+}
+
+
+// Reads the documents whose values of a numeric field are in a range. Only the keys of those
+// values are read.
+static DocArray read_field_range(
+  leveldb::DB* db,
+  leveldb::ReadOptions& read_options,
+  const string& key_prefix, // index key for the field's prefix
+  size_t width,
+  const FieldRange& range,
+  const std::atomic<bool>* is_cancelled)
+{
+  const u64 max_value = width < 8 ? (u64(1) << (8 * width)) - 1 : UINT64_MAX;
+  DocArray docs;
+  if (range.is_empty() || range.min > max_value) {
+    return docs;
+  }
+  string begin_key = key_prefix;
+  append_big_endian(begin_key, range.min, width);
+  string end_key = key_prefix;
+  if (range.max >= max_value) {
+    end_key.back() = char(end_key.back() + 1); // the first key after the field's keys
+  } else {
+    append_big_endian(end_key, range.max + 1, width);
+  }
+
+  // Keys are ordered by value, so sort the documents
+  Postings postings;
+  db_foreach_range(
+    db,
+    read_options,
+    begin_key,
+    end_key,
+    [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+      const char* p = value.data();
+      u64 payload = 0;
+      varint_read(p, p + value.size(), payload);
+      postings.push_back(
+        Posting{docnum_decode(key.data() + key.size() - kDocNumSize), u32(payload)});
+      return !is_set(is_cancelled); // continue enumeration?
+    }
+  );
+  std::sort(postings.begin(), postings.end(), [](const Posting& a, const Posting& b) {
+    return a.docnum < b.docnum;
+  });
+  docs.docnums.reserve(postings.size());
+  docs.payloads.reserve(postings.size());
+  for (auto& p : postings) {
+    docs.push_back(p.docnum, p.payload);
+  }
+  return docs;
+}
+
+
+// Returns the documents of a term, i.e. the union of its posting lists. Each document's payload is
+// its best (lowest) rank.
+static DocStreamPtr term_stream(
+  const PostingReader& reader,
+  const QueryTerm& term,
+  const std::atomic<bool>* is_cancelled)
+{
+  if (term.is_range) {
+    return array_stream(term.range_docs);
+  } else if (!term.has_more_lists) {
+    DocStreams lists;
+    for (auto& list : term.lists) {
+      lists.emplace_back(reader.stream(list.first, list.second));
+    }
+    auto stream = union_stream(std::move(lists));
+    return term.plan == QueryTerm::Stream ? std::move(stream) : array_stream(DocArray::read(*stream));
+  }
+
+  // Read all lists, then sort their documents and keep the best rank of each
+  Postings postings;
+  reader.lists_foreach(
+    term.key,
+    [&](const leveldb::Slice& list_key, u32 count) {
+      postings.reserve(postings.size() + count);
+      reader.read(list_key.ToString(), postings);
+      return !is_set(is_cancelled); // continue enumeration?
+    }
+  );
+  std::sort(postings.begin(), postings.end(), [](const Posting& a, const Posting& b) {
+    return a.docnum < b.docnum || (a.docnum == b.docnum && a.payload < b.payload);
+  });
+  DocArray docs;
+  docs.docnums.reserve(postings.size());
+  docs.payloads.reserve(postings.size());
+  for (auto& p : postings) {
+    if (docs.size() == 0 || docs.docnums.back() != p.docnum) {
+      docs.push_back(p.docnum, p.payload);
+    }
+  }
+  return array_stream(std::move(docs));
+}
+
+
+// Chooses how to match a term against the candidates of a query, i.e. the documents of the
+// driving term or of a previous search
+static QueryTerm::Plan plan_term(const QueryTerm& t, size_t ncandidates, bool is_any_candidate) {
+  if (t.has_more_lists) {
+    return ncandidates <= kMaxProbedDocs && !is_any_candidate ? QueryTerm::Probe : QueryTerm::Read;
+  }
+  return t.df > ncandidates * kSeekRatio ? QueryTerm::Stream : QueryTerm::Read;
+}
+
+
+// Returns the type names of a search, which only folders match if it has an is:folder predicate
+static vector<string> search_type_names(const string& type, const FieldQuery& fields) {
+  auto type_names = parse_type_names(type);
+  if (fields.is_folder) {
+    bool is_folder_type = type_names.empty() ||
+      std::binary_search(type_names.begin(), type_names.end(), string{"/"});
+    type_names.assign(1, is_folder_type ? "/" : "");
+  }
+  return type_names;
+}
+
+
+string SearchIndex::terms_key() const {
+  return key(kNameKeyPrefix);
+}
+
+
+std::vector<string> SearchIndex::posting_list_prefixes() const {
+  return std::vector<string>{key(kNameKeyPrefix), key(kTypeKeyPrefix), key(kMimeTypeKeyPrefix)};
+}
+
+
+SearchIndex::QueryKeys SearchIndex::query_keys(
+  const string& query_text,
+  const string& type,
+  const TermDict* similar_terms) const
+{
+  const u32 today = u32(time(nullptr) / 86400);
+  string text = query_text;
+  auto fields = FieldQuery::parse(text, today);
+  QueryKeys keys;
+  keys.text = normalize_term_text(query_text);
+  if (fields.has_modified) {
+    // Relative days change meaning from one day to the next
+    keys.text += "\n" + std::to_string(fields.modified.min) + ".." +
+      std::to_string(fields.modified.max);
+  }
+  keys.prefixes.emplace_back(key(kBasenameKeyPrefix + normalize_term_text(text)));
+  std::forward_list<string> terms;
+  parse_terms(text, terms);
+  bool is_any_similar = false;
+  for (auto& term : terms) {
+    keys.prefixes.emplace_back(key(kNameKeyPrefix + (term[0] == '-' ? term.substr(1) : term)));
+    is_any_similar = is_any_similar ||
+      (similar_terms != nullptr && term[0] != '-' && !similar_terms->has_prefix(term));
+  }
+  if (is_any_similar) {
+    // Which terms are similar to a term changes as terms are added
+    keys.prefixes.emplace_back(key(kNameKeyPrefix));
+  }
+  for (auto& type_name : search_type_names(type, fields)) {
+    keys.prefixes.emplace_back(key(kTypeKeyPrefix + type_name));
+  }
+  for (auto& mime_type : fields.mime_types) {
+    keys.prefixes.emplace_back(key(kMimeTypeKeyPrefix + mime_type));
+  }
+  if (fields.has_size) {
+    keys.prefixes.emplace_back(key(kSizeKeyPrefix));
+  }
+  if (fields.has_modified) {
+    keys.prefixes.emplace_back(key(kDayKeyPrefix));
+  }
+  return keys;
+}
+
+
+std::vector<SearchIndex::Hit> SearchIndex::_search(
+  leveldb::DB*             db,
+  leveldb::ReadOptions&    read_options,
+  const string&            type,
+  const string&            query_text,
+  u32                      limit,
+  const BoostTable*        boosts,
+  const TermDict*          similar_terms,
+  const SearchShardView*   shard,
+  Session*                 session,
+  const std::atomic<bool>* is_cancelled,
+  const Hit*               after,
+  u32                      first_limit) const
+{
+  const u32 now = u32(time(nullptr));
+  const u32 today = now / 86400;
+
+  // Field predicates are matched like terms, but aren't part of the text
+  string text = query_text;
+  auto fields = FieldQuery::parse(text, today);
+
+  // Parse and collect terms from text
+  std::forward_list<string> terms;
+  auto nterms = parse_terms(text, terms);
+  auto nterms_pos = nterms.first, nterms_neg = nterms.second;
+  //dump_collection("terms", terms);
+  
+  // essentially we will consider no more than (limit*look_ahead_factor) filename matches. Every
+  // page of a search considers as many as its first page, so that the pages rank the same matches.
+  const u32 look_ahead_factor = 100;
+  const size_t max_filename_matches =
+    size_t(first_limit != 0 ? first_limit : limit) * look_ahead_factor;
+
+  // Lowers the score of an entry by its usage boost. Boosts are few, so the most that any boost
+  // lowers a score by lets us skip looking up most documents.
+  const u32 max_boost_discount = boosts != nullptr ? boost_discount(boosts->max_value) : 0;
+  auto boosted_score = [&](u32 score, DocNum docnum) -> u32 {
+    if (max_boost_discount == 0) {
+      return score;
+    }
+    return score - RX_MIN(score, boost_discount(boosts->value(docnum, now)));
+  };
+
+  // No positive terms or predicates? No results.
+  if (nterms_pos == 0 && fields.empty()) {
+    if (session != nullptr) {
+      session->is_valid = false;
+    }
+    return std::vector<Hit>{};
+  }
+
+  auto docnum_from_index_key = [](const leveldb::Slice& key) -> DocNum {
+    // Document number is always the last part of a key
+    return key.size() > kDocNumSize ? docnum_decode(key.data() + key.size() - kDocNumSize) : 0;
+  };
+
+  // Look up the posting lists of each term. Negative terms are at the end of `terms`.
+  PostingReader reader{db, read_options, shard};
+  std::set<string> term_uniq_set;
+  vector<QueryTerm> qterms;
+  qterms.reserve(nterms_pos + nterms_neg);
+  for (auto& term : terms) {
+    
+    // negative term?
+    bool term_is_negative = false;
+    if (term[0] == '-') {
+      term.replace(0, 1, string{});
+      term_is_negative = true;
+      //std::cout << "NOT term '" << term << "'" << std::endl;
+    }
+    
+    auto kp = key(kNameKeyPrefix + term);
+
+    if (!term_uniq_set.emplace(kp).second) {
+      // We already processed this word
+      continue;
+    }
+
+    qterms.emplace_back();
+    qterms.back().key = kp;
+    qterms.back().is_negative = term_is_negative;
+    read_term_lists(reader, qterms.back());
+    if (similar_terms != nullptr && !term_is_negative && qterms.back().lists.empty()) {
+      read_similar_term_lists(reader, *similar_terms, key(kNameKeyPrefix), term, qterms.back());
+    }
+  }
+
+  // The types of entries to search and the field predicates are matched like more positive terms,
+  // which follow the positive terms of the text. A type or MIME type term's lists are those of the
+  // types, and a range term's documents are read from the field's keys in the range.
+  vector<QueryTerm> filters;
+  auto type_names = search_type_names(type, fields);
+  if (!type_names.empty()) {
+    QueryTerm t;
+    t.key = key(kTypeKeyPrefix + str_join(type_names, ","));
+    for (auto& type_name : type_names) {
+      auto list_key = key(kTypeKeyPrefix + type_name);
+      auto count = reader.count(list_key);
+      if (count != 0) {
+        t.lists.emplace_back(list_key, count);
+        t.df += count;
+      }
+    }
+    filters.push_back(std::move(t));
+  }
+  if (!fields.mime_types.empty()) {
+    QueryTerm t;
+    t.key = key(kMimeTypeKeyPrefix + str_join(fields.mime_types, ","));
+    for (auto& mime_type : fields.mime_types) {
+      // MIME types are few, so all the lists of a prefix are merged
+      reader.lists_foreach(
+        key(kMimeTypeKeyPrefix + mime_type),
+        [&](const leveldb::Slice& list_key, u32 count) {
+          t.lists.emplace_back(list_key.ToString(), count);
+          t.df += count;
+          return true; // continue enumeration
+        }
+      );
+    }
+    filters.push_back(std::move(t));
+  }
+  auto add_range = [&](const string& key_prefix, size_t width, const FieldRange& range) {
+    QueryTerm t;
+    t.key = key(key_prefix);
+    t.is_range = true;
+    t.range_docs = read_field_range(db, read_options, t.key, width, range, is_cancelled);
+    t.df = t.range_docs.size();
+    filters.push_back(std::move(t));
+  };
+  if (fields.has_size) {
+    add_range(kSizeKeyPrefix, kSizeWidth, fields.size);
+  }
+  if (fields.has_modified) {
+    add_range(kDayKeyPrefix, kDayWidth, fields.modified);
+  }
+  for (auto& t : filters) {
+    t.is_filter = true;
+  }
+  qterms.insert(
+    std::find_if(qterms.begin(), qterms.end(), [](const QueryTerm& t) { return t.is_negative; }),
+    std::make_move_iterator(filters.begin()),
+    std::make_move_iterator(filters.end()));
+
+  // Can we refine the session's previous search? Only if each of its positive terms was kept or
+  // extended, so that the documents matching all positive terms are among its documents. Negative
+  // terms are applied anew. The terms similar to an extended term needn't be among those similar
+  // to the term, so searches with similar terms are never refined and can't be refined.
+  auto normalized_text = normalize_term_text(text);
+  bool is_any_similar = std::any_of(qterms.begin(), qterms.end(), [](const QueryTerm& t) {
+    return t.is_similar;
+  });
+  bool is_refinement =
+    !is_any_similar &&
+    session != nullptr &&
+    session->is_valid &&
+    session->type == type &&
+    session->fields == fields &&
+    normalized_text.compare(0, session->text.size(), session->text) == 0 &&
+    nterms_pos >= session->positive_terms.size();
+  for (size_t i = 0; is_refinement && i != session->positive_terms.size(); ++i) {
+    // Positive terms come first
+    auto& prev_key = session->positive_terms[i];
+    is_refinement = qterms[i].key.compare(0, prev_key.size(), prev_key) == 0;
+  }
+
+  // Do we have any filename matches? They're scored like all other matches, so we look beyond
+  // the first `limit` of them for better ones. A search of predicates alone has none.
+  vector<Session::FilenameMatch> filename_matches;
+  bool is_filename_scan_complete = true;
+  if (nterms_pos == 0) {
+    is_filename_scan_complete = false;
+  } else if (is_refinement && session->is_filename_scan_complete) {
+    // The basenames starting with the text are among those starting with the previous text
+    for (auto& m : session->filename_matches) {
+      if (m.basename.compare(0, normalized_text.size(), normalized_text) == 0) {
+        filename_matches.push_back(m);
+      }
+    }
+  } else {
+    auto bkp = key(kBasenameKeyPrefix + normalized_text);
+    auto basename_offset = key().size() + kBasenameKeyPrefix.size();
+    db_foreach(
+      db,
+      read_options,
+      bkp,
+      [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+        // Note: assert valid docnum, or our index building is buggy :-S
+        auto docnum = docnum_from_index_key(key); assert(docnum != 0);
+        const char* p = value.data();
+        u64 payload = 0;
+        varint_read(p, p + value.size(), payload);
+        // "<basename> <rank> <docnum>"
+        string basename{
+          key.data() + basename_offset,
+          key.size() - basename_offset - (1 + kRankSize + 1 + kDocNumSize)};
+        filename_matches.push_back(
+          Session::FilenameMatch{docnum, u32(payload), std::move(basename)});
+        // continue enumeration?
+        is_filename_scan_complete = filename_matches.size() < max_filename_matches;
+        return is_filename_scan_complete && !is_set(is_cancelled);
+      }
+    );
+  }
+
+  // Score the filename matches. An entry has a single basename, so each is a different document.
+  vector<ScoredDoc> filename_docs;
+  filename_docs.reserve(filename_matches.size());
+  for (auto& m : filename_matches) {
+    auto match = m.basename.size() == normalized_text.size() ?
+      Match::ExactBasename : Match::BasenamePrefix;
+    auto doc_score = boosted_score(score(match, m.payload, today), m.docnum);
+    filename_docs.push_back(ScoredDoc{doc_score, m.docnum});
+  }
+  vector<DocNum> filename_docnums;
+  filename_docnums.reserve(filename_docs.size());
+  for (auto& doc : filename_docs) {
+    filename_docnums.push_back(doc.docnum);
+  }
+  std::sort(filename_docnums.begin(), filename_docnums.end());
+
+  // Plan the query. The rarest positive term drives it: its documents are the candidates, which
+  // the other terms only need to be checked against. Results are ranked by the first term.
+  // A refinement is driven by the previous search's documents instead.
+  QueryTerm* first_term = nullptr;
+  QueryTerm* driver = nullptr;
+  bool is_missing_term = false; // a positive term matches no documents
+  for (auto& t : qterms) {
+    if (!t.is_negative) {
+      if (first_term == nullptr && !t.is_filter) {
+        first_term = &t;
+      }
+      is_missing_term = is_missing_term || (&t != first_term && t.matches_nothing());
+      if (driver == nullptr || t.is_rarer_than(*driver)) {
+        driver = &t;
+      }
+    }
+  }
+  size_t nprev_positive = is_refinement ? session->positive_terms.size() : 0;
+  auto is_new_term = [&](const QueryTerm& t) {
+    // Any term but the previous search's positive terms and filters, whose documents we have
+    if (!is_refinement || t.is_negative) {
+      return true;
+    } else if (t.is_filter) {
+      return false;
+    }
+    size_t i = &t - &qterms[0];
+    return i >= nprev_positive || t.key != session->positive_terms[i];
+  };
+  if (is_refinement) {
+    auto ncandidates = session->positive_docs.size();
+    for (auto& t : qterms) {
+      if (is_new_term(t) && !t.matches_nothing()) {
+        t.plan = plan_term(t, ncandidates, false);
+      }
+    }
+  } else {
+    bool is_any_read = false;
+    for (auto& t : qterms) {
+      if (&t != driver && !t.matches_nothing()) {
+        t.plan = plan_term(t, driver->df, driver->has_more_lists);
+        is_any_read = is_any_read || t.plan == QueryTerm::Read;
+      }
+    }
+    // With everything else in memory, the driver might as well be too, so that it's all
+    // intersected in one go
+    driver->plan = driver->has_more_lists || is_any_read ? QueryTerm::Read : QueryTerm::Stream;
+  }
+
+  // Probing checks whether any of the terms a document was indexed on starts with the term
+  auto probe = [&](const QueryTerm& t, DocNum docnum) {
+    leveldb::Slice term_key{t.key.data() + key().size(), t.key.size() - key().size()};
+    for (auto& list : read_lists(db, read_options, docnum)) {
+      if (leveldb::Slice{list}.starts_with(term_key)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  auto probe_filter = [&](DocStreamPtr docs, const QueryTerm* t) {
+    return filter_stream(std::move(docs), [&probe, t](DocNum docnum) {
+      return probe(*t, docnum) != t->is_negative;
+    });
+  };
+
+  for (auto& t : qterms) {
+    if (is_new_term(t) && !t.matches_nothing() && t.plan != QueryTerm::Probe) {
+      t.stream = term_stream(reader, t, is_cancelled);
+    }
+  }
+
+  // Filename matches are not required to match the first term, but the other terms apply to them
+  // as well. Check them in document order, and then rewind the streams for the query.
+  if (is_missing_term) {
+    filename_docs.clear();
+  } else if (!filename_docs.empty() && qterms.size() > 1) {
+    std::unordered_set<DocNum> excluded_docs;
+    for (auto& t : qterms) {
+      if (&t == first_term || t.matches_nothing()) {
+        continue;
+      }
+      auto plan = t.plan;
+      DocStreamPtr stream;
+      auto* s = t.stream.get();
+      if (s == nullptr && (!t.has_more_lists || filename_docnums.size() > kMaxProbedDocs)) {
+        // A term of the previous search, for which we have no stream
+        t.plan = t.has_more_lists ? QueryTerm::Read : QueryTerm::Stream;
+        stream = term_stream(reader, t, is_cancelled);
+        s = stream.get();
+      }
+      for (auto docnum : filename_docnums) {
+        bool matches;
+        if (s == nullptr) {
+          matches = probe(t, docnum);
+        } else {
+          s->seek(docnum);
+          matches = s->valid() && s->docnum() == docnum;
+        }
+        if (matches == t.is_negative) {
+          excluded_docs.emplace(docnum);
+        }
+      }
+      t.plan = plan;
+      if (t.stream != nullptr) {
+        t.stream->rewind();
+      }
+    }
+    filename_docs.erase(
+      std::remove_if(filename_docs.begin(), filename_docs.end(), [&](const ScoredDoc& doc) {
+        return excluded_docs.find(doc.docnum) != excluded_docs.end();
+      }),
+      filename_docs.end()
+    );
+  }
+
+  // The documents matching all positive terms, ranked by the first term, or by the driver if the
+  // first term is probed or if there are only predicates
+  DocStreamPtr query;
+  if (is_missing_term || (first_term != nullptr && first_term->matches_nothing())) {
+    query = array_stream(DocArray{});
+  } else if (is_refinement) {
+    // Check the previous search's documents against the new and extended terms. An extended
+    // first term ranks the documents anew, unless it's probed.
+    query = array_stream(std::move(session->positive_docs));
+    for (auto& t : qterms) {
+      if (t.is_negative || !is_new_term(t)) {
+        continue;
+      } else if (t.plan == QueryTerm::Probe) {
+        query = probe_filter(std::move(query), &t);
+      } else {
+        DocStreams streams;
+        streams.emplace_back(std::move(t.stream));
+        streams.insert(&t == first_term ? streams.end() : streams.begin(), std::move(query));
+        query = and_stream(std::move(streams));
+      }
+    }
+  } else {
+    auto* ranking_term =
+      first_term == nullptr || first_term->plan == QueryTerm::Probe ? driver : first_term;
+    DocStreams positive_streams;
+    positive_streams.emplace_back(std::move(ranking_term->stream));
+    for (auto& t : qterms) {
+      if (t.stream != nullptr && !t.is_negative) {
+        positive_streams.emplace_back(std::move(t.stream));
+      }
+    }
+    query = and_stream(std::move(positive_streams));
+    for (auto& t : qterms) {
+      if (t.plan == QueryTerm::Probe && !t.is_negative) {
+        query = probe_filter(std::move(query), &t);
+      }
+    }
+  }
+  if (session != nullptr) {
+    // Keep the documents for refining this search
+    session->positive_docs = DocArray::read(*query);
+    query = array_stream(session->positive_docs);
+  }
+
+  // Exclude documents matching any negative term
+  DocStreams negative_streams;
+  for (auto& t : qterms) {
+    if (t.is_negative && t.stream != nullptr) {
+      negative_streams.emplace_back(std::move(t.stream));
+    }
+  }
+  if (!negative_streams.empty()) {
+    query = and_not_stream(std::move(query), union_stream(std::move(negative_streams)));
+  }
+  for (auto& t : qterms) {
+    if (t.is_negative && t.plan == QueryTerm::Probe) {
+      query = probe_filter(std::move(query), &t);
+    }
+  }
+
+  // Score filename matches and the documents matching all terms, keeping the best ones. Term
+  // matches are scored by their ranking term's match. A filename match always scores better than
+  // its term matches. A page starts after the last result of the previous page.
+  auto prev_page_end = after != nullptr ? ScoredDoc{after->score, after->docnum} : ScoredDoc{0, 0};
+  TopDocs top_docs{limit, prev_page_end};
+  for (auto& doc : filename_docs) {
+    top_docs.add(doc.score, doc.docnum);
+  }
+  for (u32 n = 1; query->valid(); query->next(), ++n) {
+    if (n % kDocsPerCancellationCheck == 0 && is_set(is_cancelled)) {
+      break;
+    }
+    auto docnum = query->docnum();
+    auto payload = query->payload();
+    auto doc_score = score(payload_match(payload), payload, today);
+    if (top_docs.accepts(doc_score - RX_MIN(doc_score, max_boost_discount), docnum) &&
+        !std::binary_search(filename_docnums.begin(), filename_docnums.end(), docnum))
+    {
+      top_docs.add(boosted_score(doc_score, docnum), docnum);
+    }
+  }
+  auto docs = top_docs.take_sorted();
+
+  // A cancelled search might have skipped any of the above
+  if (is_set(is_cancelled)) {
+    if (session != nullptr) {
+      session->is_valid = false;
+    }
+    return std::vector<Hit>{};
+  }
+
+  if (session != nullptr) {
+    session->is_valid = !is_any_similar;
+    session->type = type;
+    session->fields = fields;
+    session->text = normalized_text;
+    session->positive_terms.clear();
+    for (auto& t : qterms) {
+      if (!t.is_negative && !t.is_filter) {
+        session->positive_terms.push_back(t.key);
+      }
+    }
+    session->filename_matches = std::move(filename_matches);
+    session->is_filename_scan_complete = is_filename_scan_complete;
+  }
+
+  std::vector<Hit> hits;
+  hits.reserve(docs.size());
+  for (auto& doc : docs) {
+    hits.push_back(Hit{doc.score, doc.docnum, string{}});
+  }
+  return hits;
+}
+
+
+Dropbox::SearchResults SearchIndex::search_sync(
+  leveldb::DB*             db,
+  const string&            type,
+  const string&            text,
+  u32                      limit,
+  const BoostTable*        boosts,
+  const TermDict*          similar_terms,
+  const SearchShardView*   shard,
+  Session*                 session,
+  const std::atomic<bool>* is_cancelled,
+  std::vector<string>*     entry_keys) const
+{
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto hits = _search(
+    db,
+    read_options,
+    type,
+    text,
+    limit,
+    boosts,
+    similar_terms,
+    shard,
+    session,
+    is_cancelled,
+    nullptr,
+    0);
+
+  // Resolve document numbers to paths and read the file entries
+  Dropbox::SearchResults results;
+  string value;
+  for (auto& hit : hits) {
+    auto path = PathDict::read_path(db, read_options, hit.docnum);
+    auto entry_key = kFileEntryKeyPrefix + path;
+    auto st = db->Get(read_options, entry_key, &value);
+    results.emplace_back(st.ok() ? Record{value}.to_json().dump() : string{});
+    if (entry_keys != nullptr) {
+      entry_keys->emplace_back(std::move(entry_key));
+    }
+    if (!st.ok()) {
+      // Report DB lookup error
+      std::cout << "[" << __PRETTY_FUNCTION__ << "] index entry pointing to '" << path
+                << "' does not have a respective file entry (" << st.ToString() << ")"
+                << std::endl;
+    }
+  }
+
+  db->ReleaseSnapshot(read_options.snapshot);
+
+  return std::move(results);
+}
+
+
+std::vector<SearchIndex::Hit> SearchIndex::search_hits(
+  leveldb::DB*             db,
+  const string&            type,
+  const string&            text,
+  u32                      limit,
+  const BoostTable*        boosts,
+  const TermDict*          similar_terms,
+  const SearchShardView*   shard,
+  const Hit*               after,
+  u32                      first_limit,
+  const std::atomic<bool>* is_cancelled) const
+{
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto hits = _search(
+    db,
+    read_options,
+    type,
+    text,
+    limit,
+    boosts,
+    similar_terms,
+    shard,
+    nullptr,
+    is_cancelled,
+    after,
+    first_limit);
+  for (auto& hit : hits) {
+    hit.path = PathDict::read_path(db, read_options, hit.docnum);
+  }
+  db->ReleaseSnapshot(read_options.snapshot);
+  return hits;
+}
+
+
+} // namespace
@@ -1,5 +1,11 @@
 #pragma once
 #include "index.hh"
+#include "boost-store.hh"
+#include "query.hh"
+#include "field-query.hh"
+#include "term-dict.hh"
+#include "search-shard.hh"
+#include <atomic>
 namespace dbxmd {
 
 using std::string;
@@ -9,19 +15,108 @@ struct SearchIndex : Index {
   SearchIndex() : Index{"search"} {}
 
   // Implements Index:
-  const string& version() const { static string v{"1"}; return v; }
-  void map(const string& path, const Json&);
+  const string& version() const { static string v{"10"}; return v; }
+  void map(const string& path, DocNum, const Record&);
 
   bool index_file_entry(
     const string& canonical_path,
     const Json&,
     leveldb::WriteBatch&);
 
+  // The prefix of the keys of the posting lists of terms, e.g. for a TermDictStore
+  string terms_key() const;
+
+  // The prefixes of the keys of all posting lists which searches read, e.g. for a SearchShardStore
+  std::vector<string> posting_list_prefixes() const;
+
+  // A query's normalized text, and the prefixes of the index keys which it reads: its results
+  // can only change when keys with these prefixes change. Pass the same term dictionary as to
+  // search_sync().
+  struct QueryKeys {
+    string              text;
+    std::vector<string> prefixes;
+  };
+  QueryKeys query_keys(
+    const string& text,
+    const string& type = string{},
+    const TermDict* similar_terms = nullptr) const;
+
+  // What a search remembers so that the next search of a session can refine it rather than
+  // search the whole index, e.g. when the user types another character. Only valid for as long
+  // as the index is unchanged.
+  struct Session {
+    struct FilenameMatch {
+      DocNum docnum;
+      u32    payload;
+      string basename;
+    };
+
+    bool                       is_valid = false;
+    string                     type;
+    FieldQuery                 fields;
+    string                     text; // normalized, without field predicates
+    std::vector<string>        positive_terms; // index keys
+    DocArray                   positive_docs;  // matching all positive terms, ranked by the first
+    std::vector<FilenameMatch> filename_matches; // before applying terms
+    bool                       is_filename_scan_complete = false;
+  };
+
+  // Results are boosted by usage if a boost table is given. A term which prefixes no term of the
+  // index, e.g. a misspelled one, matches the terms most similar to it if a term dictionary of
+  // the index is given. Posting lists are read from a shard of the index, where it has them, if
+  // a view of one is given; take the view before the search. With a session, the search refines
+  // the session's previous search if its text extends the previous text, and then updates the
+  // session. The search stops early and returns no results once is_cancelled is set. The keys of
+  // the results' file entries are appended to entry_keys if given, e.g. for a SearchCache.
   Dropbox::SearchResults search_sync(
-    leveldb::DB*       db,
+    leveldb::DB*             db,
+    const std::string&       type,
+    const std::string&       text,
+    u32                      limit,
+    const BoostTable*        boosts = nullptr,
+    const TermDict*          similar_terms = nullptr,
+    const SearchShardView*   shard = nullptr,
+    Session*                 session = nullptr,
+    const std::atomic<bool>* is_cancelled = nullptr,
+    std::vector<string>*     entry_keys = nullptr) const;
+
+  // A search result before its entry is read. Results are ordered by score, lowest (best) first,
+  // and then by document number.
+  struct Hit {
+    u32    score;
+    DocNum docnum;
+    string path;
+  };
+
+  // Like search_sync(), but doesn't read the results' entries. Returns the results which follow
+  // `after`, the last result of the previous page, if given. Pass the limit of the first page as
+  // first_limit for the following pages.
+  std::vector<Hit> search_hits(
+    leveldb::DB*             db,
+    const std::string&       type,
+    const std::string&       text,
+    u32                      limit,
+    const BoostTable*        boosts = nullptr,
+    const TermDict*          similar_terms = nullptr,
+    const SearchShardView*   shard = nullptr,
+    const Hit*               after = nullptr,
+    u32                      first_limit = 0,
+    const std::atomic<bool>* is_cancelled = nullptr) const;
+
+private:
+  std::vector<Hit> _search(
+    leveldb::DB*,
+    leveldb::ReadOptions&,
     const std::string& type,
     const std::string& text,
-    u32                limit) const;
+    u32 limit,
+    const BoostTable*,
+    const TermDict* similar_terms,
+    const SearchShardView*,
+    Session*,
+    const std::atomic<bool>* is_cancelled,
+    const Hit* after,
+    u32 first_limit) const;
 };
 
 } // namespace
@@ -0,0 +1,77 @@
+#include <rx/rx.h>
+#include "search-pool.hh"
+#include <algorithm>
+#include <mutex>
+namespace dbxmd {
+
+void SearchTask::__dealloc(SearchTask::Imp* p) { delete p; }
+
+void SearchTask::cancel() const {
+  if (self != nullptr) {
+    self->is_cancelled.store(true);
+  }
+}
+
+bool SearchTask::isCancelled() const {
+  return self != nullptr && self->is_cancelled.load();
+}
+
+
+struct SearchPool::Shared {
+  struct Pending {
+    u64              seq; // later searches have higher numbers
+    SearchTask       task;
+    rx::func<void()> fn;
+  };
+  static bool is_earlier(const Pending& a, const Pending& b) { return a.seq < b.seq; }
+
+  std::mutex           mu;
+  std::vector<Thread>  idle_threads;
+  std::vector<Pending> pending; // heap, latest first
+  u64                  next_seq = 0;
+};
+
+
+// Runs pending searches on a thread until there are none
+void SearchPool::_drain(const std::shared_ptr<Shared>& shared, const Thread& thread) {
+  for (;;) {
+    Shared::Pending p;
+    {
+      std::lock_guard<std::mutex> lock(shared->mu);
+      do {
+        if (shared->pending.empty()) {
+          shared->idle_threads.push_back(thread);
+          return;
+        }
+        std::pop_heap(shared->pending.begin(), shared->pending.end(), Shared::is_earlier);
+        p = std::move(shared->pending.back());
+        shared->pending.pop_back();
+      } while (p.task.isCancelled());
+    }
+    p.fn();
+  }
+}
+
+
+SearchPool::SearchPool(std::vector<Thread> threads) : _shared{new Shared} {
+  _shared->idle_threads = std::move(threads);
+}
+
+
+void SearchPool::async(const SearchTask& task, rx::func<void()> fn) const {
+  Thread thread;
+  {
+    std::lock_guard<std::mutex> lock(_shared->mu);
+    _shared->pending.push_back(Shared::Pending{_shared->next_seq++, task, std::move(fn)});
+    std::push_heap(_shared->pending.begin(), _shared->pending.end(), Shared::is_earlier);
+    if (_shared->idle_threads.empty()) {
+      return; // a running thread will get to it
+    }
+    thread = _shared->idle_threads.back();
+    _shared->idle_threads.pop_back();
+  }
+  auto shared = _shared;
+  thread.async([shared, thread] { _drain(shared, thread); });
+}
+
+} // namespace
@@ -0,0 +1,33 @@
+#pragma once
+#include "dbxmd.h"
+#include "thread.hh"
+#include <atomic>
+#include <memory>
+#include <vector>
+namespace dbxmd {
+
+struct SearchTask::Imp : rx::ref_counted_novtable {
+  std::atomic<bool> is_cancelled{false};
+};
+
+
+// Runs searches on a few threads. When searches pile up, e.g. while the user types, the most
+// recently started search runs first, and searches cancelled meanwhile are dropped without
+// running.
+//
+// Safe to use from multiple threads.
+struct SearchPool {
+  // Runs searches on these threads, each of which should be serial
+  explicit SearchPool(std::vector<Thread> threads);
+
+  // Runs fn on one of the threads, unless task is cancelled first
+  void async(const SearchTask&, rx::func<void()> fn) const;
+
+private:
+  struct Shared;
+  static void _drain(const std::shared_ptr<Shared>&, const Thread&);
+
+  std::shared_ptr<Shared> _shared; // with running threads, which can outlive the pool
+};
+
+} // namespace
@@ -0,0 +1,30 @@
+#include <rx/rx.h>
+#include "dbxmd.h"
+#include "dropbox_imp.hh"
+#include "search_session_imp.hh"
+namespace dbxmd {
+
+void SearchSession::__dealloc(SearchSession::Imp* p) { delete p; }
+
+
+Dropbox::SearchResults SearchSession::search(const string& type, const string& text, u32 limit) {
+  if (self == nullptr) {
+    return Dropbox::SearchResults{};
+  }
+  auto& dbx = self->dropbox;
+  // The search cache's generation changes with the index, after which the previous search can't
+  // be refined
+  auto generation = dbx->search_cache.generation();
+  if (generation != self->generation) {
+    self->state.is_valid = false;
+  }
+  auto boosts = dbx->boosts.table();
+  auto terms = dbx->search_terms.dict();
+  auto shard = dbx->search_shard.view();
+  auto results = SearchIndex::sharedInstance()->search_sync(
+    dbx->db, type, text, limit, boosts.get(), terms.get(), &shard, &self->state);
+  self->generation = generation;
+  return results;
+}
+
+} // namespace
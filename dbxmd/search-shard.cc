@@ -0,0 +1,639 @@
+#include "search-shard.hh"
+#include "keyspace.hh"
+#include "varint.hh"
+#include "unittest.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dbxmd {
+
+static const char kShardMagic[8] = {'d', 'b', 'x', 'm', 'd', 's', 'h', '1'};
+
+struct ShardHeader {
+  char magic[8];
+  u64  id;
+  u64  nlists;
+  u64  table_offset;
+  u64  keys_offset;
+  u64  file_size;
+  u64  reserved[2];
+};
+static_assert(sizeof(ShardHeader) == 64, "unexpected shard header size");
+
+struct ShardTableEntry {
+  u32 key_offset;
+  u32 key_size;
+  u32 count;
+  u32 reserved;
+  u64 postings_offset;
+};
+static_assert(sizeof(ShardTableEntry) == 24, "unexpected shard table entry size");
+
+// Rewrite the shard once this many lists plus a quarter of its lists have changed since it was
+// written. Changed lists are read from the database, which is slower the more of them a query
+// reads, and are kept in memory.
+static const size_t kMinChangedLists = 1024;
+
+
+static string errno_message(const string& what, const string& path) {
+  return what + " \"" + path + "\": " + strerror(errno);
+}
+
+
+// Returns the key of the list which a key of a list's head or block belongs to ("<list>\0...")
+static leveldb::Slice list_key_of(const leveldb::Slice& key, size_t key_prefix_size) {
+  auto* p = (const char*)memchr(
+    key.data() + key_prefix_size, '\0', key.size() - key_prefix_size);
+  return p == nullptr ? key : leveldb::Slice{key.data(), size_t(p - key.data())};
+}
+
+// ------------------------------------------------------------------------------------------------
+// SearchShard::Writer
+
+SearchShard::Writer::Writer(const string& path, u64 id) : _path{path}, _id{id} {
+  auto tmp_path = _path + ".tmp";
+  _file = fopen(tmp_path.c_str(), "wb");
+  if (_file == nullptr) {
+    _status = Status{errno_message("failed to create", tmp_path)};
+    return;
+  }
+  ShardHeader header; // written by finish()
+  memset(&header, 0, sizeof(header));
+  _write(&header, sizeof(header));
+}
+
+
+SearchShard::Writer::~Writer() {
+  if (_file != nullptr) {
+    fclose(_file);
+    unlink((_path + ".tmp").c_str());
+  }
+}
+
+
+Status SearchShard::Writer::_write(const void* data, size_t size) {
+  if (_status.ok() && size != 0 && fwrite(data, 1, size, _file) != size) {
+    _status = Status{errno_message("failed to write", _path + ".tmp")};
+  }
+  _offset += size;
+  return _status;
+}
+
+
+Status SearchShard::Writer::add(const leveldb::Slice& key, const Postings& postings) {
+  if (!_status.ok() || postings.empty()) {
+    return _status;
+  }
+  if (_nlists != 0 && key.compare(_last_key) <= 0) {
+    return Status{"shard lists added out of order"};
+  }
+  _last_key.assign(key.data(), key.size());
+  ShardTableEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.key_offset = u32(_keys.size());
+  entry.key_size = u32(key.size());
+  entry.count = u32(postings.size());
+  entry.postings_offset = _offset;
+  _table.append((const char*)&entry, sizeof(entry));
+  _keys.append(key.data(), key.size());
+  ++_nlists;
+
+  _buffer.resize(postings.size());
+  for (size_t i = 0; i != postings.size(); ++i) {
+    _buffer[i] = postings[i].docnum;
+  }
+  _write(_buffer.data(), _buffer.size() * sizeof(u32));
+  for (size_t i = 0; i != postings.size(); ++i) {
+    _buffer[i] = postings[i].payload;
+  }
+  return _write(_buffer.data(), _buffer.size() * sizeof(u32));
+}
+
+
+Status SearchShard::Writer::finish() {
+  if (_file == nullptr || !_status.ok()) {
+    return _status.ok() ? Status{"shard already finished"} : _status;
+  }
+  ShardHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kShardMagic, sizeof(kShardMagic));
+  header.id = _id;
+  header.nlists = _nlists;
+  static const char zeroes[8] = {0};
+  _write(zeroes, (8 - _offset % 8) % 8); // align the table
+  header.table_offset = _offset;
+  _write(_table.data(), _table.size());
+  header.keys_offset = _offset;
+  _write(_keys.data(), _keys.size());
+  header.file_size = _offset;
+
+  // The header goes last, so that a partly written file is never valid
+  auto tmp_path = _path + ".tmp";
+  if (_status.ok() && (fseek(_file, 0, SEEK_SET) != 0 ||
+                       fwrite(&header, 1, sizeof(header), _file) != sizeof(header) ||
+                       fflush(_file) != 0 ||
+                       fsync(fileno(_file)) != 0))
+  {
+    _status = Status{errno_message("failed to write", tmp_path)};
+  }
+  if (fclose(_file) != 0 && _status.ok()) {
+    _status = Status{errno_message("failed to write", tmp_path)};
+  }
+  _file = nullptr;
+  if (_status.ok() && rename(tmp_path.c_str(), _path.c_str()) != 0) {
+    _status = Status{errno_message("failed to rename", tmp_path)};
+  }
+  if (!_status.ok()) {
+    unlink(tmp_path.c_str());
+  }
+  return _status;
+}
+
+// ------------------------------------------------------------------------------------------------
+// SearchShard
+
+SearchShard::~SearchShard() {
+  if (_data != nullptr) {
+    munmap((void*)_data, _size);
+  }
+}
+
+
+Status SearchShard::write(
+  const string& path,
+  u64 id,
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const std::vector<string>& key_prefixes)
+{
+  // Lists are added in key order, so the prefixes must be too. A list's head is followed by its
+  // blocks ("<list>" < "<list>\0<docnum>" < "<list>X"), so one pass reads each list in turn.
+  auto prefixes = key_prefixes;
+  std::sort(prefixes.begin(), prefixes.end());
+  Writer writer{path, id};
+  auto* it = db->NewIterator(read_options);
+  Postings postings;
+  string list_key;
+  Status status;
+  for (auto& prefix : prefixes) {
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      auto key = it->key();
+      auto key_list = list_key_of(key, prefix.size());
+      if (key_list.size() == key.size()) {
+        // A list's head
+        status = writer.add(list_key, postings);
+        if (!status.ok()) {
+          break;
+        }
+        list_key.assign(key.data(), key.size());
+        postings.clear();
+      } else if (key_list == leveldb::Slice{list_key} &&
+                 !posting_block_decode(
+                   docnum_decode(key.data() + key.size() - kDocNumSize), it->value(), postings))
+      {
+        std::clog << "[dbxmd] malformed posting list block in \"" << list_key << "\"" << std::endl;
+      }
+    }
+    if (!status.ok()) {
+      break;
+    }
+    status = writer.add(list_key, postings);
+    postings.clear();
+  }
+  delete it;
+  return status.ok() ? writer.finish() : status;
+}
+
+
+Status SearchShard::open(const string& path, std::shared_ptr<const SearchShard>& shard) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return Status{errno_message("failed to open", path)};
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ShardHeader)) {
+    close(fd);
+    return Status{"invalid search shard \"" + path + "\""};
+  }
+  size_t size = size_t(st.st_size);
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file open
+  if (data == MAP_FAILED) {
+    return Status{errno_message("failed to map", path)};
+  }
+  std::shared_ptr<SearchShard> s{new SearchShard};
+  s->_data = (const char*)data;
+  s->_size = size;
+
+  // Check that everything is where the header says before reading it
+  auto& header = *(const ShardHeader*)s->_data;
+  bool is_valid =
+    memcmp(header.magic, kShardMagic, sizeof(kShardMagic)) == 0 &&
+    header.file_size == size &&
+    header.table_offset % 8 == 0 &&
+    header.table_offset >= sizeof(ShardHeader) &&
+    header.keys_offset <= size &&
+    header.keys_offset >= header.table_offset &&
+    (header.keys_offset - header.table_offset) / sizeof(ShardTableEntry) == header.nlists;
+  u64 keys_size = 0;
+  if (is_valid) {
+    s->_id = header.id;
+    s->_nlists = size_t(header.nlists);
+    s->_table = s->_data + header.table_offset;
+    s->_keys = s->_data + header.keys_offset;
+    keys_size = size - header.keys_offset;
+  }
+  for (size_t i = 0; is_valid && i != s->_nlists; ++i) {
+    auto& entry = ((const ShardTableEntry*)s->_table)[i];
+    is_valid =
+      u64(entry.key_offset) + entry.key_size <= keys_size &&
+      entry.count != 0 &&
+      entry.postings_offset % 4 == 0 &&
+      entry.postings_offset >= sizeof(ShardHeader) &&
+      entry.postings_offset + u64(entry.count) * 8 <= header.table_offset &&
+      (i == 0 || s->list(i - 1).key.compare(s->list(i).key) < 0);
+  }
+  if (!is_valid) {
+    return Status{"invalid search shard \"" + path + "\""};
+  }
+  shard = std::move(s);
+  return Status::OK();
+}
+
+
+SearchShard::List SearchShard::list(size_t i) const {
+  auto& entry = ((const ShardTableEntry*)_table)[i];
+  auto* docnums = (const DocNum*)(_data + entry.postings_offset);
+  return List{
+    leveldb::Slice{_keys + entry.key_offset, entry.key_size},
+    entry.count,
+    docnums,
+    docnums + entry.count};
+}
+
+
+size_t SearchShard::lower_bound(const leveldb::Slice& key) const {
+  size_t begin = 0, end = _nlists;
+  while (begin != end) {
+    size_t mid = begin + (end - begin) / 2;
+    if (list(mid).key.compare(key) < 0) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return begin;
+}
+
+
+bool SearchShard::find(const leveldb::Slice& key, List& list) const {
+  auto i = lower_bound(key);
+  if (i == _nlists || this->list(i).key != key) {
+    return false;
+  }
+  list = this->list(i);
+  return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// PostingReader
+
+PostingReader::PostingReader(
+  leveldb::DB* db,
+  const leveldb::ReadOptions& read_options,
+  const SearchShardView* view)
+  : _db{db}
+  , _read_options{read_options}
+{
+  if (view != nullptr && view->shard != nullptr) {
+    _shard = view->shard.get();
+    _changed_lists = view->changed_lists.get();
+  }
+}
+
+
+bool PostingReader::_find(const leveldb::Slice& list_key, SearchShard::List& list) const {
+  return
+    _shard != nullptr &&
+    (_changed_lists == nullptr || _changed_lists->count(list_key.ToString()) == 0) &&
+    _shard->find(list_key, list);
+}
+
+
+void PostingReader::lists_foreach(
+  const string& key_prefix,
+  rx::func<bool(const leveldb::Slice& list_key, u32 count)> fn) const
+{
+  if (_shard == nullptr) {
+    posting_lists_foreach(_db, _read_options, key_prefix, fn);
+    return;
+  }
+
+  // Merge the shard's lists which haven't changed with the changed lists, which are read from
+  // the database
+  static const std::set<string> no_lists;
+  auto& changed_lists = _changed_lists != nullptr ? *_changed_lists : no_lists;
+  auto C = changed_lists.lower_bound(key_prefix);
+  auto is_changed_list = [&] {
+    return C != changed_lists.end() && C->compare(0, key_prefix.size(), key_prefix) == 0;
+  };
+  for (auto i = _shard->lower_bound(key_prefix); i != _shard->size(); ++i) {
+    auto list = _shard->list(i);
+    if (!list.key.starts_with(key_prefix)) {
+      break;
+    }
+    bool is_changed = false;
+    for (; is_changed_list() && leveldb::Slice{*C}.compare(list.key) <= 0; ++C) {
+      is_changed = leveldb::Slice{*C} == list.key;
+      auto count = PostingCursor::count(_db, _read_options, *C);
+      if (count != 0 && !fn(*C, count)) {
+        return;
+      }
+    }
+    if (!is_changed && !fn(list.key, list.count)) {
+      return;
+    }
+  }
+  for (; is_changed_list(); ++C) {
+    auto count = PostingCursor::count(_db, _read_options, *C);
+    if (count != 0 && !fn(*C, count)) {
+      return;
+    }
+  }
+}
+
+
+u32 PostingReader::count(const string& list_key) const {
+  SearchShard::List list;
+  return _find(list_key, list) ? list.count : PostingCursor::count(_db, _read_options, list_key);
+}
+
+
+DocStreamPtr PostingReader::stream(const string& list_key, u32 count) const {
+  SearchShard::List list;
+  if (_find(list_key, list)) {
+    return array_stream(list.docnums, list.payloads, list.count);
+  }
+  return posting_stream(_db, _read_options, list_key, count);
+}
+
+
+void PostingReader::read(const string& list_key, Postings& out) const {
+  SearchShard::List list;
+  if (_find(list_key, list)) {
+    out.reserve(out.size() + list.count);
+    for (u32 i = 0; i != list.count; ++i) {
+      out.push_back(Posting{list.docnums[i], list.payloads[i]});
+    }
+    return;
+  }
+  for (PostingCursor c{_db, _read_options, list_key}; c.valid(); c.next()) {
+    out.push_back(Posting{c.docnum(), c.payload()});
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// SearchShardStore
+//
+//   "g:search-shard" => id:varint version:str nlists:varint list_key:str{nlists}
+//   str              := len:varint bytes
+
+static void append_str(string& out, const leveldb::Slice& s) {
+  varint_append(out, s.size());
+  out.append(s.data(), s.size());
+}
+
+
+static bool read_str(const char*& p, const char* end, string& s) {
+  u64 size = 0;
+  if (!varint_read(p, end, size) || size > u64(end - p)) {
+    return false;
+  }
+  s.assign(p, size_t(size));
+  p += size;
+  return true;
+}
+
+
+Status SearchShardStore::open(
+  leveldb::DB* db,
+  const string& path,
+  const string& index_version,
+  const std::vector<string>& key_prefixes)
+{
+  string value;
+  auto st = db->Get(leveldb::ReadOptions{}, kSearchShardKey, &value);
+  if (!st.ok() && !st.IsNotFound()) {
+    return Status{st.ToString()};
+  }
+  const char* p = value.data();
+  const char* end = p + value.size();
+  u64 id = 0, nlists = 0;
+  string version;
+  auto changed_lists = std::make_shared<Lists>();
+  bool is_recorded =
+    st.ok() && varint_read(p, end, id) && read_str(p, end, version) &&
+    varint_read(p, end, nlists);
+  for (u64 i = 0; is_recorded && i != nlists; ++i) {
+    string list_key;
+    is_recorded = read_str(p, end, list_key);
+    changed_lists->insert(std::move(list_key));
+  }
+
+  // Until close() records it again, the shard could miss changes
+  if (st.ok()) {
+    leveldb::WriteOptions write_options;
+    write_options.sync = true;
+    st = db->Delete(write_options, kSearchShardKey);
+    if (!st.ok()) {
+      return Status{st.ToString()};
+    }
+  }
+
+  SearchShardPtr shard;
+  if (is_recorded && version == index_version) {
+    auto status = SearchShard::open(path, shard);
+    if (!status.ok()) {
+      std::clog << "[dbxmd] " << status.message() << std::endl;
+    } else if (shard->id() != id) {
+      shard.reset();
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mu);
+  _path = path;
+  _index_version = index_version;
+  _key_prefixes = key_prefixes;
+  _shard = std::move(shard);
+  _changed_lists = _shard != nullptr ? std::move(changed_lists) : nullptr;
+  _next_id = RX_MAX(id, _next_id) + 1;
+  return Status::OK();
+}
+
+
+bool SearchShardStore::_list_key(const leveldb::Slice& key, string& list_key) const {
+  for (auto& prefix : _key_prefixes) {
+    if (key.starts_with(prefix)) {
+      auto k = list_key_of(key, prefix.size());
+      list_key.assign(k.data(), k.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void SearchShardStore::update(const DataChanges& changes) {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_shard == nullptr && _rewrite_changed_lists == nullptr) {
+    return;
+  }
+  // Views share the set of changed lists, so it's copied when lists are added to it
+  std::shared_ptr<Lists> changed_lists;
+  string list_key;
+  for (auto& change : changes) {
+    if (!_list_key(change.key, list_key)) {
+      continue;
+    }
+    if (_rewrite_changed_lists != nullptr) {
+      _rewrite_changed_lists->insert(list_key);
+    }
+    if (_shard != nullptr && _changed_lists->count(list_key) == 0) {
+      if (changed_lists == nullptr) {
+        changed_lists = std::make_shared<Lists>(*_changed_lists);
+      }
+      changed_lists->insert(std::move(list_key));
+    }
+  }
+  if (changed_lists != nullptr) {
+    _changed_lists = std::move(changed_lists);
+  }
+}
+
+
+bool SearchShardStore::should_rewrite() {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_path.empty() || _is_rewrite_pending) {
+    return false;
+  }
+  _is_rewrite_pending =
+    _shard == nullptr || _changed_lists->size() > kMinChangedLists + _shard->size() / 4;
+  return _is_rewrite_pending;
+}
+
+
+Status SearchShardStore::rewrite(leveldb::DB* db) {
+  // Lists which change after the snapshot are recorded as changed since the new shard
+  string path;
+  std::vector<string> key_prefixes;
+  u64 id;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _is_rewrite_pending = true;
+    _rewrite_changed_lists.reset(new Lists);
+    path = _path;
+    key_prefixes = _key_prefixes;
+    id = _next_id++;
+  }
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = db->GetSnapshot();
+  auto status = SearchShard::write(path, id, db, read_options, key_prefixes);
+  db->ReleaseSnapshot(read_options.snapshot);
+  SearchShardPtr shard;
+  if (status.ok()) {
+    status = SearchShard::open(path, shard);
+  }
+
+  std::lock_guard<std::mutex> lock(_mu);
+  if (status.ok()) {
+    _shard = std::move(shard);
+    _changed_lists = std::make_shared<const Lists>(std::move(*_rewrite_changed_lists));
+  }
+  _rewrite_changed_lists.reset();
+  _is_rewrite_pending = false;
+  return status;
+}
+
+
+SearchShardView SearchShardStore::view() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  return SearchShardView{_shard, _changed_lists};
+}
+
+
+Status SearchShardStore::close(leveldb::DB* db) {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_shard == nullptr) {
+    return Status::OK();
+  }
+  string value;
+  varint_append(value, _shard->id());
+  append_str(value, _index_version);
+  varint_append(value, _changed_lists->size());
+  for (auto& list_key : *_changed_lists) {
+    append_str(value, list_key);
+  }
+  leveldb::WriteOptions write_options;
+  write_options.sync = true;
+  auto st = db->Put(write_options, kSearchShardKey, value);
+  return st.ok() ? Status::OK() : Status{st.ToString()};
+}
+
+
+UNIT_TEST(search_shard, {
+  const char* tmpdir = getenv("TMPDIR");
+  string path = string{tmpdir != nullptr ? tmpdir : "/tmp"} + "/dbxmd-test-" +
+    std::to_string(getpid()) + ".search-shard";
+  auto postings = [](DocNum first, size_t n) {
+    Postings p;
+    for (DocNum d = first; p.size() != n; d += 3) {
+      Posting posting; posting.docnum = d; posting.payload = d % 7; p.push_back(posting);
+    }
+    return p;
+  };
+  auto write = [&] {
+    SearchShard::Writer w(path, 42);
+    w.add("n:cat", postings(1, 3));
+    w.add("n:catalog", postings(5, 200));
+    w.add("n:dog", postings(2, 1));
+    if (w.add("n:ant", postings(1, 1)).ok()) {
+      throw test_failure("accepted list out of order");
+    }
+    return w.finish();
+  };
+  if (!write().ok()) {
+    throw test_failure("failed to write shard");
+  }
+  SearchShardPtr shard;
+  auto status = SearchShard::open(path, shard);
+  unlink(path.c_str());
+  if (!status.ok() || shard->id() != 42 || shard->size() != 3) {
+    throw test_failure("failed to open shard");
+  }
+  SearchShard::List list;
+  if (!shard->find("n:catalog", list) || list.count != 200 || list.docnums[199] != 5 + 199 * 3 ||
+      list.payloads[1] != 8 % 7 || shard->find("n:ca", list) || shard->find("n:dogs", list))
+  {
+    throw test_failure("unexpected list");
+  }
+  if (shard->lower_bound("n:ca") != 0 || shard->lower_bound("n:cb") != 2 ||
+      shard->lower_bound("n:z") != 3)
+  {
+    throw test_failure("unexpected lower_bound");
+  }
+  shard->find("n:catalog", list);
+  auto s = array_stream(list.docnums, list.payloads, list.count);
+  s->seek(300);
+  if (!s->valid() || s->docnum() != 302 || s->payload() != 302 % 7) {
+    throw test_failure("unexpected stream");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,187 @@
+#pragma once
+#include "dbxmd.h"
+#include "postings.hh"
+#include "query.hh"
+#include <leveldb/db.h>
+#include <rx/status.hh>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+namespace dbxmd {
+
+using std::string;
+using rx::Status;
+
+// A read-optimized copy of posting lists in a memory-mapped file: a sorted table of list keys
+// and the documents of each list as plain arrays, which queries read in place without decoding
+// blocks or going through database iterators. Numbers are in native byte order, as a shard is a
+// cache local to the device.
+//
+//   header   := magic:8 id:u64 nlists:u64 table_offset:u64 keys_offset:u64 file_size:u64
+//   postings := (docnums:u32{count} payloads:u32{count})*     at offset 64
+//   table    := (key_offset:u32 key_size:u32 count:u32 0:u32 postings_offset:u64){nlists}
+//   keys     := bytes
+//
+// Immutable.
+struct SearchShard {
+  struct List {
+    leveldb::Slice key;
+    u32            count;
+    const DocNum*  docnums;
+    const u32*     payloads;
+  };
+
+  // Writes a shard list by list. The file is written under a temporary name and renamed by
+  // finish(), so that a shard which is mapped meanwhile stays intact.
+  struct Writer {
+    Writer(const string& path, u64 id);
+    ~Writer(); // removes the temporary file, unless finished
+
+    // Lists must be added in key order
+    Status add(const leveldb::Slice& key, const Postings&);
+    Status finish();
+
+  private:
+    Writer(const Writer&) = delete;
+    Status _write(const void* data, size_t size);
+
+    string           _path;
+    u64              _id;
+    FILE*            _file = nullptr;
+    Status           _status;
+    u64              _offset = 0;
+    string           _table;
+    string           _keys;
+    string           _last_key;
+    u64              _nlists = 0;
+    std::vector<u32> _buffer;
+  };
+
+  ~SearchShard();
+
+  // Writes a shard of the lists whose keys start with any of key_prefixes, as of read_options'
+  // snapshot
+  static Status write(
+    const string& path,
+    u64 id,
+    leveldb::DB*,
+    const leveldb::ReadOptions&,
+    const std::vector<string>& key_prefixes);
+
+  // Maps a shard written by write()
+  static Status open(const string& path, std::shared_ptr<const SearchShard>& shard);
+
+  u64 id() const { return _id; }
+  size_t size() const { return _nlists; }
+  List list(size_t i) const;
+
+  // Index of the first list whose key is key or after it
+  size_t lower_bound(const leveldb::Slice& key) const;
+
+  // Looks up a list, returning false if there's none with the key
+  bool find(const leveldb::Slice& key, List&) const;
+
+private:
+  SearchShard() = default;
+  SearchShard(const SearchShard&) = delete;
+
+  const char* _data = nullptr;
+  size_t      _size = 0;
+  u64         _id = 0;
+  size_t      _nlists = 0;
+  const char* _table = nullptr;
+  const char* _keys = nullptr;
+};
+
+using SearchShardPtr = std::shared_ptr<const SearchShard>;
+
+
+// A shard together with the lists which changed since it was written, which are read from the
+// database instead
+struct SearchShardView {
+  SearchShardPtr                          shard;
+  std::shared_ptr<const std::set<string>> changed_lists;
+};
+
+
+// Reads posting lists from a shard view, or from the database if there's no shard or if a list
+// changed since the shard was written. Lists are read as of read_options' snapshot, except for
+// those read from the shard. The view and read_options must outlive the reader and its streams.
+struct PostingReader {
+  PostingReader(leveldb::DB*, const leveldb::ReadOptions&, const SearchShardView* = nullptr);
+
+  // Like posting_lists_foreach()
+  void lists_foreach(
+    const string& key_prefix,
+    rx::func<bool(const leveldb::Slice& list_key, u32 count)> fn) const;
+
+  // Number of documents in a list
+  u32 count(const string& list_key) const;
+
+  // The documents of a list with `count` documents
+  DocStreamPtr stream(const string& list_key, u32 count) const;
+
+  // Appends the postings of a list to out
+  void read(const string& list_key, Postings& out) const;
+
+private:
+  bool _find(const leveldb::Slice& list_key, SearchShard::List&) const;
+
+  leveldb::DB*                _db;
+  const leveldb::ReadOptions& _read_options;
+  const SearchShard*          _shard = nullptr;
+  const std::set<string>*     _changed_lists = nullptr;
+};
+
+
+// Keeps a shard of an index's posting lists current. Lists which change are read from the
+// database until enough of them have changed that the shard is rewritten, in the background.
+// The shard outlives the process: close() records in the database which lists changed since it
+// was written, and open() maps it again if the record is there. open() removes the record, so
+// that a shard isn't trusted after a crash, and is rewritten instead.
+//
+// Safe to use from multiple threads.
+struct SearchShardStore {
+  // Maps the shard at path, if the database records that it's current for an index of this
+  // version. Lists are those whose keys start with any of key_prefixes.
+  Status open(
+    leveldb::DB*,
+    const string& path,
+    const string& index_version,
+    const std::vector<string>& key_prefixes);
+
+  // Records changes to lists, e.g. from a change listener
+  void update(const DataChanges&);
+
+  // Returns true, once, when there's no shard or when enough lists changed since it was written.
+  // rewrite() should then be called.
+  bool should_rewrite();
+
+  // Writes and maps a new shard of the database's lists. Slow, so call it in the background.
+  Status rewrite(leveldb::DB*);
+
+  // Returns the current shard and the lists changed since it was written, or an empty view
+  SearchShardView view() const;
+
+  // Records the shard in the database for the next open()
+  Status close(leveldb::DB*);
+
+private:
+  using Lists = std::set<string>;
+  bool _list_key(const leveldb::Slice& key, string& list_key) const;
+
+  mutable std::mutex                    _mu;
+  string                                _path;
+  string                                _index_version;
+  std::vector<string>                   _key_prefixes;
+  SearchShardPtr                        _shard;
+  std::shared_ptr<const Lists>          _changed_lists; // since _shard was written
+  std::unique_ptr<Lists>                _rewrite_changed_lists; // since a rewrite started
+  u64                                   _next_id = 1;
+  bool                                  _is_rewrite_pending = false;
+};
+
+} // namespace
@@ -0,0 +1,13 @@
+#pragma once
+#include "search-index.hh"
+namespace dbxmd {
+
+struct SearchSession::Imp : rx::ref_counted_novtable {
+  Dropbox              dropbox;
+  SearchIndex::Session state;
+  u64                  generation = 0; // of the search cache when state was last updated
+
+  Imp(const Dropbox& dropbox) : dropbox{dropbox} {}
+};
+
+} // namespace
@@ -5,10 +5,9 @@ namespace dbxmd {
 
 string str_trim(const string& s, const string& charset) {
   auto a = s.find_first_not_of(charset);
-  if (a == string::npos) a = 0;
+  if (a == string::npos) return string{};
   auto b = s.find_last_not_of(charset);
-  if (b == string::npos) b = s.size();
-  return s.substr(a, b-a);
+  return s.substr(a, b-a+1);
 }
 
 
@@ -48,7 +47,7 @@ std::pair<string, string> str_file_ext(const string& filename) {
   auto dotp = filename.rfind('.');
   if (dotp != string::npos) {
     auto slashp = filename.find_last_of('/');
-    if (slashp != string::npos && slashp < dotp) {
+    if (slashp == string::npos || slashp < dotp) {
       return std::pair<string, string>{filename.substr(0, dotp), filename.substr(dotp+1)};
     }
   }
@@ -56,6 +55,34 @@ std::pair<string, string> str_file_ext(const string& filename) {
 }
 
 
+UNIT_TEST(str_trim, {
+  if (str_trim("/foo/bar.pdf", "/") != "foo/bar.pdf" ||
+      str_trim("//foo//", "/") != "foo" ||
+      str_trim("foo", "/") != "foo" ||
+      str_trim("/", "/") != "" ||
+      str_trim("", "/") != "")
+  {
+    throw test_failure("unexpected result of str_trim");
+  }
+})
+
+
+UNIT_TEST(str_file_ext, {
+  auto t = [](const string& filename, const string& name, const string& ext) {
+    auto p = str_file_ext(filename);
+    if (p.first != name || p.second != ext) {
+      std::cerr << "str_file_ext(\"" << filename << "\") => {\"" << p.first << "\", \""
+                << p.second << "\"}" << std::endl;
+      throw test_failure("unexpected result of str_file_ext");
+    }
+  };
+  t("foo.pdf", "foo", "pdf");
+  t("/a/foo.tar.gz", "/a/foo.tar", "gz");
+  t("/a.b/foo", "/a.b/foo", "");
+  t("foo", "foo", "");
+})
+
+
 UNIT_TEST(str_split, {
   auto t = [](const string& subject, const string& delim, const vector<string>& expect) {
     auto components = str_split(subject, delim);
@@ -0,0 +1,382 @@
+#include "term-dict.hh"
+#include "postings.hh"
+#include "str.hh"
+#include "unittest.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace dbxmd {
+
+// Terms are padded with two of these at the start and one at the end, e.g. "cat" has the
+// trigrams "__c", "_ca", "cat" and "at_"
+static const char kTrigramPad = '\x01';
+
+
+// Calls fn with each trigram of a term
+template <typename F>
+static void trigrams_foreach(const string& term, F fn) {
+  u32 t = (u32(u8(kTrigramPad)) << 8) | u8(kTrigramPad);
+  for (auto c : term) {
+    t = ((t << 8) | u8(c)) & 0xffffff;
+    fn(t);
+  }
+  fn(((t << 8) | u8(kTrigramPad)) & 0xffffff);
+}
+
+
+// Returns the optimal string alignment distance of a and b, i.e. the number of insertions,
+// deletions, substitutions and transpositions of adjacent bytes which turn one into the other,
+// or max + 1 if it's more than max. Rows are scratch space.
+static u32 edit_distance(const string& a, const string& b, u32 max, std::vector<u32> (&rows)[3]) {
+  for (auto& row : rows) {
+    row.resize(b.size() + 1);
+  }
+  auto* prev2 = rows[0].data();
+  auto* prev = rows[1].data();
+  auto* cur = rows[2].data();
+  for (size_t j = 0; j <= b.size(); ++j) {
+    prev[j] = u32(j);
+  }
+  for (size_t i = 1; i <= a.size(); ++i) {
+    cur[0] = u32(i);
+    u32 row_min = cur[0];
+    for (size_t j = 1; j <= b.size(); ++j) {
+      u32 cost = a[i - 1] == b[j - 1] ? 0 : 1;
+      u32 d = std::min(std::min(prev[j] + 1, cur[j - 1] + 1), prev[j - 1] + cost);
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+        d = std::min(d, prev2[j - 2] + 1);
+      }
+      cur[j] = d;
+      row_min = std::min(row_min, d);
+    }
+    if (row_min > max) {
+      return max + 1; // every alignment is already too costly
+    }
+    std::swap(prev2, prev);
+    std::swap(prev, cur);
+  }
+  return std::min(prev[b.size()], max + 1);
+}
+
+
+// Terms of the overlay are compared one by one, so the dictionary is indexed again once it has
+// this many
+static const size_t kMaxOverlaySize = 256;
+
+
+TermDict::TermDict() : _index{std::make_shared<const TrigramIndex>()} {}
+
+
+TermDict::TermDict(std::vector<string> terms) {
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+  auto index = std::make_shared<TrigramIndex>();
+
+  // Sort (trigram, term) pairs and then split them into a list of terms per trigram
+  std::vector<std::pair<u32, u32>> pairs;
+  for (u32 i = 0; i != u32(terms.size()); ++i) {
+    trigrams_foreach(terms[i], [&](u32 t) { pairs.emplace_back(t, i); });
+  }
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+  index->trigram_terms.reserve(pairs.size());
+  for (auto& p : pairs) {
+    if (index->trigrams.empty() || index->trigrams.back() != p.first) {
+      index->trigrams.push_back(p.first);
+      index->trigram_offsets.push_back(u32(index->trigram_terms.size()));
+    }
+    index->trigram_terms.push_back(p.second);
+  }
+  index->trigram_offsets.push_back(u32(index->trigram_terms.size()));
+  index->terms = std::move(terms);
+  _index = std::move(index);
+}
+
+
+TermDict::TermDict(const TermDict& base, std::vector<string> added, std::vector<string> removed)
+  : _index{base._index}
+  , _added{std::move(added)}
+  , _removed{std::move(removed)}
+{
+  std::sort(_added.begin(), _added.end());
+  std::sort(_removed.begin(), _removed.end());
+}
+
+
+bool TermDict::_is_indexed(const string& term) const {
+  return std::binary_search(_index->terms.begin(), _index->terms.end(), term);
+}
+
+
+bool TermDict::_is_removed(const string& term) const {
+  return !_removed.empty() && std::binary_search(_removed.begin(), _removed.end(), term);
+}
+
+
+bool TermDict::contains(const string& term) const {
+  return std::binary_search(_added.begin(), _added.end(), term) ||
+         (_is_indexed(term) && !_is_removed(term));
+}
+
+
+std::vector<string> TermDict::terms() const {
+  std::vector<string> terms;
+  terms.reserve(size());
+  auto& indexed = _index->terms;
+  auto a = _added.begin();
+  for (auto& term : indexed) {
+    for (; a != _added.end() && *a < term; ++a) {
+      terms.push_back(*a);
+    }
+    if (!_is_removed(term)) {
+      terms.push_back(term);
+    }
+  }
+  terms.insert(terms.end(), a, _added.end());
+  return terms;
+}
+
+
+bool TermDict::has_prefix(const string& prefix) const {
+  auto is_prefixed = [&](const string& term) {
+    return term.compare(0, prefix.size(), prefix) == 0;
+  };
+  auto A = std::lower_bound(_added.begin(), _added.end(), prefix);
+  if (A != _added.end() && is_prefixed(*A)) {
+    return true;
+  }
+  auto& terms = _index->terms;
+  for (auto I = std::lower_bound(terms.begin(), terms.end(), prefix);
+       I != terms.end() && is_prefixed(*I); ++I)
+  {
+    if (!_is_removed(*I)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+std::vector<string> TermDict::similar(const string& term, u32 max_edits, size_t limit) const {
+  std::vector<string> similar_terms;
+  if (max_edits == 0 || limit == 0 || size() == 0) {
+    return similar_terms;
+  }
+  auto& index = *_index;
+
+  // An edit changes at most four trigrams of a term (a transposition), so a term which is
+  // max_edits away shares all but 4 * max_edits of its distinct trigrams
+  std::vector<u32> trigrams;
+  trigrams_foreach(term, [&](u32 t) { trigrams.push_back(t); });
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+  size_t min_common = trigrams.size() > 4 * max_edits ? trigrams.size() - 4 * max_edits : 1;
+
+  std::vector<u16> ncommon(index.terms.size());
+  std::vector<u32> candidates;
+  for (auto t : trigrams) {
+    auto I = std::lower_bound(index.trigrams.begin(), index.trigrams.end(), t);
+    if (I == index.trigrams.end() || *I != t) {
+      continue;
+    }
+    auto i = I - index.trigrams.begin();
+    for (auto k = index.trigram_offsets[i]; k != index.trigram_offsets[i + 1]; ++k) {
+      if (++ncommon[index.trigram_terms[k]] == min_common) {
+        candidates.push_back(index.trigram_terms[k]);
+      }
+    }
+  }
+
+  std::vector<std::pair<u32, const string*>> matches; // edits and each similar term
+  std::vector<u32> rows[3];
+  auto compare = [&](const string& candidate) {
+    auto size_diff = candidate.size() > term.size() ?
+      candidate.size() - term.size() : term.size() - candidate.size();
+    if (size_diff <= max_edits) {
+      auto edits = edit_distance(term, candidate, max_edits, rows);
+      if (edits <= max_edits) {
+        matches.emplace_back(edits, &candidate);
+      }
+    }
+  };
+  for (auto i : candidates) {
+    if (!_is_removed(index.terms[i])) {
+      compare(index.terms[i]);
+    }
+  }
+  for (auto& candidate : _added) {
+    compare(candidate);
+  }
+  std::sort(matches.begin(), matches.end(),
+    [](const std::pair<u32, const string*>& a, const std::pair<u32, const string*>& b) {
+      return a.first != b.first ? a.first < b.first : *a.second < *b.second;
+    });
+  for (size_t i = 0; i != matches.size() && i != limit; ++i) {
+    similar_terms.push_back(*matches[i].second);
+  }
+  return similar_terms;
+}
+
+// ------------------------------------------------------------------------------------------------
+// TermDictStore
+
+Status TermDictStore::load(leveldb::DB* db, const string& key_prefix) {
+  std::vector<string> terms;
+  posting_lists_foreach(
+    db,
+    leveldb::ReadOptions{},
+    key_prefix,
+    [&](const leveldb::Slice& list_key, u32) {
+      terms.emplace_back(list_key.data() + key_prefix.size(), list_key.size() - key_prefix.size());
+      return true; // continue enumeration
+    }
+  );
+  auto dict = std::make_shared<const TermDict>(std::move(terms));
+  std::lock_guard<std::mutex> lock(_mu);
+  _key_prefix = key_prefix;
+  _dict = std::move(dict);
+  _added.clear();
+  _removed.clear();
+  return Status::OK();
+}
+
+
+void TermDictStore::update(const DataChanges& changes) {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_dict == nullptr) {
+    return;
+  }
+  bool is_changed = false;
+  for (auto& change : changes) {
+    // Only the head of a list ("<list>") is added with it and removed with its last document
+    auto& k = change.key;
+    if (!k.starts_with(_key_prefix) ||
+        memchr(k.data() + _key_prefix.size(), '\0', k.size() - _key_prefix.size()) != nullptr)
+    {
+      continue;
+    }
+    string term{k.data() + _key_prefix.size(), k.size() - _key_prefix.size()};
+    bool is_indexed = _dict->_is_indexed(term);
+    if (change.kind == DataChange::Modified) {
+      is_changed = (is_indexed ? _removed.erase(term) != 0 : _added.insert(term).second) ||
+                   is_changed;
+    } else {
+      is_changed = (is_indexed ? _removed.insert(term).second : _added.erase(term) != 0) ||
+                   is_changed;
+    }
+    if (_rebuild_changed_terms != nullptr) {
+      _rebuild_changed_terms->insert(std::move(term));
+    }
+  }
+  if (is_changed) {
+    _dict = std::make_shared<const TermDict>(
+      *_dict,
+      std::vector<string>{_added.begin(), _added.end()},
+      std::vector<string>{_removed.begin(), _removed.end()});
+  }
+}
+
+
+bool TermDictStore::should_rebuild() {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_dict == nullptr || _is_rebuild_pending) {
+    return false;
+  }
+  _is_rebuild_pending = _dict->overlay_size() > kMaxOverlaySize;
+  return _is_rebuild_pending;
+}
+
+
+void TermDictStore::rebuild() {
+  // Terms which change after the dictionary is read are in the overlay of the new dictionary
+  TermDictPtr dict;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _is_rebuild_pending = true;
+    _rebuild_changed_terms.reset(new Terms);
+    dict = _dict;
+  }
+  TermDict rebuilt{dict != nullptr ? dict->terms() : std::vector<string>{}};
+
+  std::lock_guard<std::mutex> lock(_mu);
+  _is_rebuild_pending = false;
+  auto changed_terms = std::move(_rebuild_changed_terms);
+  if (_dict == nullptr) {
+    return;
+  }
+  Terms added, removed;
+  for (auto& term : *changed_terms) {
+    bool is_current =
+      _added.count(term) != 0 || (_dict->_is_indexed(term) && _removed.count(term) == 0);
+    bool is_indexed = rebuilt._is_indexed(term);
+    if (is_current && !is_indexed) {
+      added.insert(term);
+    } else if (!is_current && is_indexed) {
+      removed.insert(term);
+    }
+  }
+  _dict = std::make_shared<const TermDict>(
+    rebuilt,
+    std::vector<string>{added.begin(), added.end()},
+    std::vector<string>{removed.begin(), removed.end()});
+  _added = std::move(added);
+  _removed = std::move(removed);
+}
+
+
+TermDictPtr TermDictStore::dict() const {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _dict;
+}
+
+
+UNIT_TEST(term_dict, {
+  auto dict = [] {
+    std::vector<string> terms;
+    for (auto t : {"invoice", "invoices", "receipt", "recipe", "report", "budget", "cat"}) {
+      terms.push_back(t);
+    }
+    return TermDict{std::move(terms)};
+  }();
+  auto similar = [&](const string& term) {
+    return str_join(dict.similar(term, TermDict::max_edits(term.size()), 10), ",");
+  };
+  if (similar("invioce") != "invoice" || similar("reciept") != "receipt") {
+    throw test_failure("expected transpositions to match");
+  }
+  if (similar("invoicesx") != "invoices,invoice" || similar("recipes") != "recipe") {
+    throw test_failure("expected closest terms first");
+  }
+  if (similar("rcpt") != "" || similar("cta") != "" || similar("budgetary") != "") {
+    throw test_failure("unexpected similar terms");
+  }
+  if (!dict.has_prefix("rece") || dict.has_prefix("recz") || dict.has_prefix("cats")) {
+    throw test_failure("unexpected prefix");
+  }
+
+  // An overlay adds and removes terms without indexing them
+  std::vector<string> added(1, "budgets");
+  added.push_back("catalog");
+  TermDict overlay(dict, std::move(added), std::vector<string>(1, "invoice"));
+  auto overlay_similar = [&](const string& term) {
+    return str_join(overlay.similar(term, TermDict::max_edits(term.size()), 10), ",");
+  };
+  if (overlay.size() != 8 || !overlay.contains("catalog") || overlay.contains("invoice") ||
+      str_join(overlay.terms(), ",") != "budget,budgets,cat,catalog,invoices,receipt,recipe,report")
+  {
+    throw test_failure("unexpected overlay terms");
+  }
+  if (overlay_similar("invioce") != "" || overlay_similar("budgetz") != "budget,budgets" ||
+      overlay_similar("catalgo") != "catalog")
+  {
+    throw test_failure("unexpected similar terms with an overlay");
+  }
+  if (!overlay.has_prefix("catal") || overlay.has_prefix("invoicez") ||
+      !overlay.has_prefix("invoice"))
+  {
+    throw test_failure("unexpected prefix with an overlay");
+  }
+})
+
+
+} // namespace
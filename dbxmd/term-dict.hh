@@ -0,0 +1,109 @@
+#pragma once
+#include "dbxmd.h"
+#include <leveldb/db.h>
+#include <rx/status.hh>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+namespace dbxmd {
+
+using std::string;
+using rx::Status;
+
+// The distinct terms of an index, for finding the terms which are similar to a misspelled one,
+// e.g. "reciept" => "receipt". Terms are indexed by their trigrams, including trigrams padded at
+// the start and end of terms, so that only terms which share enough trigrams with a term are
+// compared with it. Trigrams and edits are of bytes. Immutable.
+//
+// Indexing terms takes a while, so a dictionary can also be a small overlay of added and removed
+// terms on top of the indexed terms of another, whose index it shares. Added terms are compared
+// with a term one by one.
+struct TermDict {
+  TermDict();
+  explicit TermDict(std::vector<string> terms);
+
+  // The indexed terms of base, ignoring its overlay, plus `added` and minus `removed`
+  TermDict(const TermDict& base, std::vector<string> added, std::vector<string> removed);
+
+  size_t size() const { return _index->terms.size() + _added.size() - _removed.size(); }
+
+  // Number of terms in the overlay
+  size_t overlay_size() const { return _added.size() + _removed.size(); }
+
+  // True if term is a term of the dictionary
+  bool contains(const string& term) const;
+
+  // All terms, sorted
+  std::vector<string> terms() const;
+
+  // True if any term starts with prefix
+  bool has_prefix(const string& prefix) const;
+
+  // Returns up to `limit` terms which are at most max_edits insertions, deletions, substitutions
+  // or transpositions of adjacent bytes away from term, closest first
+  std::vector<string> similar(const string& term, u32 max_edits, size_t limit) const;
+
+  // How misspelled a term of `size` bytes can be for similar terms to be meaningful: not at all
+  // when it's short, as most short terms are a few edits from each other
+  static u32 max_edits(size_t size) { return size < 4 ? 0 : size < 8 ? 1 : 2; }
+
+private:
+  friend struct TermDictStore;
+
+  struct TrigramIndex {
+    std::vector<string> terms;         // sorted
+    std::vector<u32>    trigrams;      // sorted
+    std::vector<u32>    trigram_terms; // indexes of the terms of trigrams[i], in
+                                       // [trigram_offsets[i], trigram_offsets[i + 1])
+    std::vector<u32>    trigram_offsets;
+  };
+
+  bool _is_indexed(const string& term) const;
+  bool _is_removed(const string& term) const;
+
+  std::shared_ptr<const TrigramIndex> _index;
+  std::vector<string>                 _added;   // sorted, not in _index
+  std::vector<string>                 _removed; // sorted, in _index
+};
+
+using TermDictPtr = std::shared_ptr<const TermDict>;
+
+
+// Keeps a TermDict of the terms of posting lists stored under a key prefix up to date as the lists
+// change. Terms are read once and then added or removed as their lists are, in the dictionary's
+// overlay, until the overlay grows large enough that the terms are indexed again, in the
+// background.
+//
+// Safe to use from multiple threads.
+struct TermDictStore {
+  // Reads the terms of the lists whose keys start with key_prefix
+  Status load(leveldb::DB*, const string& key_prefix);
+
+  // Applies changes to lists, e.g. from a change listener
+  void update(const DataChanges&);
+
+  // Returns true, once, when the overlay of added and removed terms has grown large. rebuild()
+  // should then be called.
+  bool should_rebuild();
+
+  // Indexes all terms into a new dictionary, whose overlay only has the terms which changed
+  // meanwhile. Slow, so call it in the background.
+  void rebuild();
+
+  // Returns the current dictionary, or nullptr before load()
+  TermDictPtr dict() const;
+
+private:
+  using Terms = std::set<string>;
+
+  mutable std::mutex     _mu;
+  string                 _key_prefix;
+  TermDictPtr            _dict;
+  Terms                  _added;   // the overlay of _dict
+  Terms                  _removed;
+  std::unique_ptr<Terms> _rebuild_changed_terms; // since a rebuild started
+  bool                   _is_rebuild_pending = false;
+};
+
+} // namespace
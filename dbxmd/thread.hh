@@ -15,6 +15,10 @@ struct Thread final {
 
   void async(rx::func<void()>) const;
 
+  // Invokes fn once for each index in [0-count) concurrently on a shared pool of threads and
+  // returns when all invocations have completed.
+  static void apply(size_t count, rx::func<void(size_t)> fn);
+
   RX_REF_MIXIN_NOVTABLE(Thread)
 };
 
@@ -76,4 +76,10 @@ void Thread::async(rx::func<void()> fn) const {
   });
 }
 
+void Thread::apply(size_t count, rx::func<void(size_t)> fn) {
+  dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+    fn(i);
+  });
+}
+
 } // namespace
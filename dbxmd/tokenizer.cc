@@ -0,0 +1,147 @@
+#include "tokenizer.hh"
+#include "unicode.hh"
+#include "str.hh"
+#include "unittest.hh"
+#include <vector>
+
+namespace dbxmd {
+
+// ASCII characters are classified by table, without decoding them
+enum : u8 {
+  kIndexSeparator = 1,
+  kQuerySeparator = 2,
+};
+
+struct AsciiClasses {
+  u8 classes[0x80];
+  AsciiClasses() {
+    for (u32 c = 0; c != 0x80; ++c) {
+      classes[c] = !unicode_is_separator(c) ? 0 :
+        c == '.' || c == '-' ? kIndexSeparator : (kIndexSeparator | kQuerySeparator);
+    }
+  }
+};
+
+static const u8* ascii_classes() {
+  static const AsciiClasses ascii; // on first use, as unit tests run before static initializers
+  return ascii.classes;
+}
+
+
+bool next_term(const char*& p, const char* end, TermSplit split, leveldb::Slice& term) {
+  const u8 separator = split == TermSplit::Index ? kIndexSeparator : kQuerySeparator;
+  const u8* classes = ascii_classes();
+  const char* begin = nullptr;
+  while (p != end) {
+    const char* c_begin = p;
+    bool is_separator;
+    auto b = u8(*p);
+    if (b < 0x80) {
+      is_separator = (classes[b] & separator) != 0;
+      ++p;
+    } else {
+      u32 c;
+      is_separator = !utf8_decode(p, end, c) || unicode_is_separator(c);
+    }
+    if (!is_separator) {
+      begin = begin != nullptr ? begin : c_begin;
+    } else if (begin != nullptr) {
+      term = leveldb::Slice{begin, size_t(c_begin - begin)};
+      return true;
+    }
+  }
+  if (begin != nullptr) {
+    term = leveldb::Slice{begin, size_t(end - begin)};
+    return true;
+  }
+  return false;
+}
+
+
+size_t count_terms(const leveldb::Slice& text, TermSplit split) {
+  size_t n = 0;
+  leveldb::Slice term;
+  for (const char* p = text.data(); next_term(p, text.data() + text.size(), split, term);) {
+    ++n;
+  }
+  return n;
+}
+
+
+string text_to_lower(const leveldb::Slice& text) {
+  string lower;
+  lower.reserve(text.size());
+  const char* end = text.data() + text.size();
+  for (const char* p = text.data(); p != end;) {
+    auto b = u8(*p);
+    if (b < 0x80) {
+      lower.push_back(char(b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b));
+      ++p;
+      continue;
+    }
+    const char* c_begin = p;
+    u32 c;
+    if (!utf8_decode(p, end, c)) {
+      lower.push_back(char(b));
+      continue;
+    }
+    auto lower_c = unicode_to_lower(c);
+    if (lower_c == c) {
+      lower.append(c_begin, size_t(p - c_begin));
+    } else {
+      utf8_append(lower, lower_c);
+      if (c == 0x130) {
+        utf8_append(lower, 0x307); // "i̇"
+      }
+    }
+  }
+  return lower;
+}
+
+
+UNIT_TEST(tokenizer, {
+  auto terms = [](const string& text, TermSplit split) {
+    vector<string> v;
+    leveldb::Slice term;
+    for (const char* p = text.data(); next_term(p, text.data() + text.size(), split, term);) {
+      v.push_back(term.ToString());
+    }
+    return str_join(v, "|");
+  };
+  auto index_terms = [&](const string& text) { return terms(text, TermSplit::Index); };
+  auto query_terms = [&](const string& text) { return terms(text, TermSplit::Query); };
+
+  if (index_terms("  foo bar.txt") != "foo|bar|txt" ||
+      index_terms("q3_budget (final)-2.xls") != "q3|budget|final|2|xls" ||
+      query_terms("report -draft .pdf") != "report|-draft|.pdf" ||
+      index_terms("$100+tax~") != "$100+tax~" ||
+      index_terms("") != "" || index_terms(" .,") != "")
+  {
+    throw test_failure("unexpected terms of ASCII text");
+  }
+  // Em dash, ideographic space and U+0378 (unassigned) separate terms, accents don't
+  if (index_terms("caf\xc3\xa9\xe2\x80\x94menu") != "caf\xc3\xa9|menu" ||
+      index_terms("\xe6\x97\xa5\xe3\x80\x80\xe8\xaa\x9e") != "\xe6\x97\xa5|\xe8\xaa\x9e" ||
+      index_terms("a\xcd\xb8" "b") != "a|b" ||
+      index_terms("nai\xcc\x88ve") != "nai\xcc\x88ve")
+  {
+    throw test_failure("unexpected terms of Unicode text");
+  }
+  if (index_terms("ab\xff" "cd\xe6\x97") != "ab|cd" || index_terms("\xc0\xaf" "x") != "x") {
+    throw test_failure("expected invalid UTF-8 to separate terms");
+  }
+  if (count_terms("foo bar.txt", TermSplit::Index) != 3 ||
+      count_terms("foo bar.txt", TermSplit::Query) != 2)
+  {
+    throw test_failure("unexpected count_terms");
+  }
+  if (text_to_lower("Foo \xc3\x80\xce\xa3\xd0\x96 \xc4\xb0 \xe1\xba\x9e") !=
+        "foo \xc3\xa0\xcf\x83\xd0\xb6 i\xcc\x87 \xc3\x9f" ||
+      text_to_lower("A\xff" "B") != "a\xff" "b")
+  {
+    throw test_failure("unexpected text_to_lower");
+  }
+})
+
+
+} // namespace
@@ -0,0 +1,30 @@
+#pragma once
+#include <rx/rx.h>
+#include <leveldb/slice.h>
+#include <string>
+namespace dbxmd {
+
+// Where text is split into terms
+enum class TermSplit {
+  Index, // at separators (see unicode_is_separator) and bytes which aren't valid UTF-8
+  Query, // the same, except at "." (e.g. ".pdf") and "-" (e.g. "-draft")
+};
+
+// Finds the first term of UTF-8 text at or after p, and advances p past it. Returns false when
+// there are no more terms. Terms are slices of the text and are never empty, so splitting text
+// doesn't allocate:
+//
+//   leveldb::Slice term;
+//   for (const char* p = text.data(); next_term(p, text.data() + text.size(), split, term);) {
+//     ...
+//   }
+bool next_term(const char*& p, const char* end, TermSplit, leveldb::Slice& term);
+
+// Returns the number of terms of text
+size_t count_terms(const leveldb::Slice& text, TermSplit);
+
+// Returns UTF-8 text in lowercase, like NSString's lowercaseString. Bytes which aren't valid
+// UTF-8 are kept as they are.
+std::string text_to_lower(const leveldb::Slice& text);
+
+} // namespace
@@ -0,0 +1,171 @@
+#import <rx/rx.h>
+#import "tokenizer.hh"
+#import "unicode.hh"
+#import "unittest.hh"
+#import <Foundation/Foundation.h>
+#import <chrono>
+#import <iostream>
+#import <random>
+#import <vector>
+
+// Checks the tokenizer against the Foundation-based term splitting which it replaced, on a sample
+// of characters and paths at startup. Set DBXMD_TOKENIZER_EXHAUSTIVE to check every character
+// instead and to compare their speed on a larger corpus of paths.
+
+namespace dbxmd {
+
+#if DEBUG && !defined(DISABLE_UNIT_TESTS)
+
+static NSCharacterSet* foundation_term_separators() {
+  static NSMutableCharacterSet* cs;
+  static dispatch_once_t onceToken; dispatch_once(&onceToken, ^{
+    cs = [[NSCharacterSet punctuationCharacterSet] mutableCopy];
+    [cs formUnionWithCharacterSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    [cs formUnionWithCharacterSet:[NSCharacterSet illegalCharacterSet]];
+  });
+  return cs;
+}
+
+
+static void foundation_terms(const string& text, std::vector<string>& terms) {
+  NSArray* components = [[[NSString alloc] initWithBytes:(void*)text.data()
+    length:text.size() encoding:NSUTF8StringEncoding]
+    componentsSeparatedByCharactersInSet:foundation_term_separators()];
+  for (NSString* term in components) {
+    if (term.length != 0) {
+      terms.emplace_back(term.UTF8String);
+    }
+  }
+}
+
+
+static void tokenizer_terms(const string& text, std::vector<string>& terms) {
+  leveldb::Slice term;
+  const char* end = text.data() + text.size();
+  for (const char* p = text.data(); next_term(p, end, TermSplit::Index, term);) {
+    terms.emplace_back(term.data(), term.size());
+  }
+}
+
+
+// Paths of words in several scripts, separated by spaces and punctuation
+static std::vector<string> path_corpus(size_t size) {
+  static const char* words[] = {
+    "report", "invoice", "2015", "q3", "budget", "final", "draft", "photo", "img_0042",
+    "caf\xc3\xa9", "na\xc3\xafve", "r\xc3\xa9sum\xc3\xa9", "stra\xc3\x9f" "e",
+    "\xd0\xbe\xd1\x82\xd1\x87\xd1\x91\xd1\x82", "\xce\xb1\xce\xbb\xcf\x86\xce\xb1",
+    "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", "\xe5\x86\x99\xe7\x9c\x9f", "\xed\x95\x9c\xea\xb8\x80",
+    "$100", "c++", "a&b",
+  };
+  static const char* separators[] = {
+    " ", "_", "-", ".", " - ", "\xe2\x80\x94", "\xe3\x80\x81", "\xe2\x80\x9c", "\xe3\x80\x80",
+    "(", ")", ", ",
+  };
+  static const char* exts[] = {".pdf", ".jpg", ".docx", ".txt", ""};
+  std::mt19937 rng{42};
+  std::vector<string> paths;
+  paths.reserve(size);
+  for (size_t i = 0; i != size; ++i) {
+    string path;
+    auto depth = 1 + rng() % 4;
+    for (u32 d = 0; d != depth; ++d) {
+      path += "/";
+      auto nwords = 1 + rng() % 4;
+      for (u32 w = 0; w != nwords; ++w) {
+        if (w != 0) {
+          path += separators[rng() % (sizeof(separators) / sizeof(*separators))];
+        }
+        path += words[rng() % (sizeof(words) / sizeof(*words))];
+      }
+    }
+    path += exts[rng() % (sizeof(exts) / sizeof(*exts))];
+    paths.push_back(std::move(path));
+  }
+  return paths;
+}
+
+
+// Returns the number of characters before `end` which Foundation classifies or lowercases
+// differently, checking every character below U+0100 and every `step`th one after it. Only
+// characters before U+2000 are counted, as Foundation's later characters follow the Unicode
+// version of the OS.
+static size_t count_character_differences(u32 end, u32 step) {
+  NSCharacterSet* separators = foundation_term_separators();
+  NSCharacterSet* letters = [NSCharacterSet letterCharacterSet];
+  size_t n = 0, nlater = 0;
+  for (u32 c = 0; c < end; c += c < 0x100 ? 1 : step) {
+    if (c >= 0xd800 && c <= 0xdfff) {
+      continue;
+    }
+    bool is_different = [separators longCharacterIsMember:c] != unicode_is_separator(c);
+    if (!is_different && [letters longCharacterIsMember:c]) {
+      string s;
+      utf8_append(s, c);
+      NSString* ns = [[NSString alloc] initWithBytes:s.data() length:s.size()
+        encoding:NSUTF8StringEncoding];
+      is_different = text_to_lower(s) != ns.lowercaseString.UTF8String;
+    }
+    if (is_different) {
+      c < 0x2000 ? ++n : ++nlater;
+    }
+  }
+  if (end > 0x2000) {
+    std::clog << "[tokenizer] characters after U+2000 which differ from Foundation: " << nlater
+              << std::endl;
+  }
+  return n;
+}
+
+
+UNIT_TEST(tokenizer_foundation, {
+  if (count_character_differences(0x2000, /*step=*/7) != 0) {
+    throw test_failure("characters classified or lowercased differently than by Foundation");
+  }
+  std::vector<string> expected;
+  std::vector<string> actual;
+  for (auto& path : path_corpus(200)) {
+    foundation_terms(path, expected);
+    tokenizer_terms(path, actual);
+  }
+  if (actual != expected) {
+    throw test_failure("terms differ from those split by Foundation");
+  }
+})
+
+
+UNIT_TEST(tokenizer_foundation_exhaustive, {
+  if (getenv("DBXMD_TOKENIZER_EXHAUSTIVE") == nullptr) {
+    return;
+  }
+  if (count_character_differences(0x110000, /*step=*/1) != 0) {
+    throw test_failure("characters classified or lowercased differently than by Foundation");
+  }
+
+  using clock = std::chrono::steady_clock;
+  auto paths = path_corpus(20000);
+  std::vector<string> expected;
+  std::vector<string> actual;
+  auto t0 = clock::now();
+  for (auto& path : paths) {
+    foundation_terms(path, expected);
+  }
+  auto t1 = clock::now();
+  for (auto& path : paths) {
+    tokenizer_terms(path, actual);
+  }
+  auto t2 = clock::now();
+  if (actual != expected) {
+    throw test_failure("terms differ from those split by Foundation");
+  }
+  auto ms = [](clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0;
+  };
+  std::clog << "[tokenizer] split " << paths.size() << " paths into " << actual.size()
+            << " terms: " << ms(t2 - t1) << " ms (Foundation: " << ms(t1 - t0) << " ms)"
+            << std::endl;
+})
+
+#endif
+
+
+} // namespace
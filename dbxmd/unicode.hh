@@ -0,0 +1,25 @@
+#pragma once
+#include <rx/rx.h>
+#include <string>
+namespace dbxmd {
+
+// Code points of Unicode characters, and their UTF-8 encoding. Character properties are those of
+// Unicode 14.0.
+
+// Decodes the character at p, advancing p past it. Returns false and advances p by one byte if
+// the bytes at p aren't a valid UTF-8 encoding of a character, e.g. if they're overlong, encode a
+// surrogate or end early.
+bool utf8_decode(const char*& p, const char* end, u32& c);
+
+void utf8_append(std::string& out, u32 c);
+
+// True for the characters of NSCharacterSet's whitespaceAndNewlineCharacterSet,
+// punctuationCharacterSet and illegalCharacterSet, i.e. spaces and separators (Z*), U+0009-U+000D,
+// U+0085, punctuation (P*) and unassigned code points (Cn)
+bool unicode_is_separator(u32 c);
+
+// Returns the lowercase of a character, or the character if it has none. U+0130 (İ), whose
+// lowercase is two characters, returns the first of them (i).
+u32 unicode_to_lower(u32 c);
+
+} // namespace
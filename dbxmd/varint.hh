@@ -0,0 +1,30 @@
+#pragma once
+#include <rx/rx.h>
+#include <string>
+namespace dbxmd {
+
+// LEB128-style variable-length unsigned integers: seven bits per byte, least significant group
+// first, high bit set on all but the last byte.
+
+inline void varint_append(std::string& out, u64 v) {
+  while (v >= 0x80) {
+    out.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+
+// Reads a varint from p, advancing p. Returns false if the input ends before the varint does.
+inline bool varint_read(const char*& p, const char* end, u64& v) {
+  v = 0;
+  for (u32 shift = 0; shift < 64 && p < end; shift += 7) {
+    u8 b = u8(*p++);
+    v |= u64(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
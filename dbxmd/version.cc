@@ -1,6 +1,6 @@
 #include "version.hh"
 namespace dbxmd {
 
-const std::string kDatabaseVersion = "4";
+const std::string kDatabaseVersion = "6";
 
 } // namespace